@@ -766,9 +766,15 @@ size_t mbstrnlen(const char *s, size_t maxlen)
     if (use_utf8) {
 	size_t n = 0;
 
-	for (; *s != '\0' && maxlen > 0; s += move_mbright(s, 0),
-		maxlen--, n++)
-	    ;
+	/* Most text is plain ASCII, and a byte below 0x80 is always a
+	 * character on its own in UTF-8, so step over those without
+	 * asking mblen(). */
+	for (; *s != '\0' && maxlen > 0; maxlen--, n++) {
+	    if ((unsigned char)*s < 0x80)
+		s++;
+	    else
+		s += move_mbright(s, 0);
+	}
 
 	return n;
     } else
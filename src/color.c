@@ -154,12 +154,11 @@ void color_update(void)
 		bool not_compiled = (e->ext == NULL);
 
 		/* e->ext_regex has already been checked for validity
-		 * elsewhere.  Compile its specified regex if we haven't
+		 * elsewhere.  Get its compiled regex if we haven't
 		 * already. */
-		if (not_compiled) {
-		    e->ext = (regex_t *)nmalloc(sizeof(regex_t));
-		    regcomp(e->ext, fixbounds(e->ext_regex), REG_EXTENDED);
-		}
+		if (not_compiled)
+		    e->ext = regexp_cache_get(fixbounds(e->ext_regex),
+			REG_EXTENDED | REG_NOSUB, NULL);
 
 		/* Set colorstrings if we matched the extension
 		 * regex. */
@@ -172,11 +171,10 @@ void color_update(void)
 		if (openfile->colorstrings != NULL)
 		    break;
 
-		/* Decompile e->ext_regex's specified regex if we aren't
+		/* Give back e->ext_regex's compiled regex if we aren't
 		 * going to use it. */
 		if (not_compiled) {
-		    regfree(e->ext);
-		    free(e->ext);
+		    regexp_cache_release(e->ext);
 		    e->ext = NULL;
 		}
 	    }
@@ -195,12 +193,11 @@ void color_update(void)
 		    bool not_compiled = (e->ext == NULL);
 
 		    /* e->ext_regex has already been checked for validity
-		     * elsewhere.  Compile its specified regex if we haven't
+		     * elsewhere.  Get its compiled regex if we haven't
 		     * already. */
-		    if (not_compiled) {
-			e->ext = (regex_t *)nmalloc(sizeof(regex_t));
-			regcomp(e->ext, fixbounds(e->ext_regex), REG_EXTENDED);
-		    }
+		    if (not_compiled)
+			e->ext = regexp_cache_get(fixbounds(e->ext_regex),
+			    REG_EXTENDED | REG_NOSUB, NULL);
 
 		    /* Set colorstrings if we matched the extension
 		     * regex. */
@@ -215,11 +212,10 @@ void color_update(void)
 		    if (openfile->colorstrings != NULL)
 			break;
 
-		    /* Decompile e->ext_regex's specified regex if we aren't
+		    /* Give back e->ext_regex's compiled regex if we aren't
 		     * going to use it. */
 		    if (not_compiled) {
-			regfree(e->ext);
-			free(e->ext);
+			regexp_cache_release(e->ext);
 			e->ext = NULL;
 		    }
 		}
@@ -238,19 +234,48 @@ void color_update(void)
     for (tmpcolor = openfile->colorstrings; tmpcolor != NULL;
 	tmpcolor = tmpcolor->next) {
 	/* tmpcolor->start_regex and tmpcolor->end_regex have already
-	 * been checked for validity elsewhere.  Compile their specified
-	 * regexes if we haven't already. */
-	if (tmpcolor->start == NULL) {
-	    tmpcolor->start = (regex_t *)nmalloc(sizeof(regex_t));
-	    regcomp(tmpcolor->start, fixbounds(tmpcolor->start_regex),
-		REG_EXTENDED | (tmpcolor->icase ? REG_ICASE : 0));
-	}
+	 * been checked for validity elsewhere, which left their compiled
+	 * forms in the regex cache.  Get them if we haven't already. */
+	if (tmpcolor->start == NULL)
+	    tmpcolor->start = regexp_cache_get(
+		fixbounds(tmpcolor->start_regex),
+		REG_EXTENDED | (tmpcolor->icase ? REG_ICASE : 0), NULL);
+
+	if (tmpcolor->end_regex != NULL && tmpcolor->end == NULL)
+	    tmpcolor->end = regexp_cache_get(
+		fixbounds(tmpcolor->end_regex),
+		REG_EXTENDED | (tmpcolor->icase ? REG_ICASE : 0), NULL);
+    }
+}
 
-	if (tmpcolor->end_regex != NULL && tmpcolor->end == NULL) {
-	    tmpcolor->end = (regex_t *)nmalloc(sizeof(regex_t));
-	    regcomp(tmpcolor->end, fixbounds(tmpcolor->end_regex),
-		REG_EXTENDED | (tmpcolor->icase ? REG_ICASE : 0));
-	}
+/* Return where the info on the multi-line regex with the given id is
+ * kept for the given line.  The info on the first MAX_MULTIS of them is
+ * in the line itself; room for the info on the rest is only made once
+ * a syntax that has more of them asks for it. */
+signed char *multidata_for(filestruct *fileptr, int id)
+{
+    assert(fileptr != NULL && id >= 0 && id < most_multis);
+
+    if (id < MAX_MULTIS)
+	return &fileptr->multidata[id];
+
+    if (fileptr->multimore == NULL) {
+	fileptr->multimore = (signed char *)nmalloc(most_multis -
+		MAX_MULTIS);
+	memset(fileptr->multimore, -1, most_multis - MAX_MULTIS);
+    }
+
+    return &fileptr->multimore[id - MAX_MULTIS];
+}
+
+/* Mark the multi-line regex info of the given line as not worked out
+ * yet, as for a new line. */
+void clear_multidata(filestruct *fileptr)
+{
+    memset(fileptr->multidata, -1, sizeof(fileptr->multidata));
+    if (fileptr->multimore != NULL) {
+	free(fileptr->multimore);
+	fileptr->multimore = NULL;
     }
 }
 
@@ -260,20 +285,14 @@ void reset_multis_after(filestruct *fileptr, int mindex)
 {
     filestruct *oof;
     for (oof = fileptr->next; oof != NULL; oof = oof->next) {
-	alloc_multidata_if_needed(oof);
-	if (oof->multidata == NULL)
-	    continue;
-	if (oof->multidata[mindex] != CNONE)
-	    oof->multidata[mindex] = -1;
+	if (*multidata_for(oof, mindex) != CNONE)
+	    *multidata_for(oof, mindex) = -1;
 	else
 	    break;
     }
     for (; oof != NULL; oof = oof->next) {
-	alloc_multidata_if_needed(oof);
-	if (oof->multidata == NULL)
-	    continue;
-	if (oof->multidata[mindex] == CNONE)
-	    oof->multidata[mindex] = -1;
+	if (*multidata_for(oof, mindex) == CNONE)
+	    *multidata_for(oof, mindex) = -1;
 	else
 	    break;
     }
@@ -284,20 +303,14 @@ void reset_multis_before(filestruct *fileptr, int mindex)
 {
     filestruct *oof;
     for (oof = fileptr->prev; oof != NULL; oof = oof->prev) {
-	alloc_multidata_if_needed(oof);
-	if (oof->multidata == NULL)
-	    continue;
-	if (oof->multidata[mindex] != CNONE)
-	    oof->multidata[mindex] = -1;
+	if (*multidata_for(oof, mindex) != CNONE)
+	    *multidata_for(oof, mindex) = -1;
 	else
 	    break;
     }
     for (; oof != NULL; oof = oof->prev) {
-	alloc_multidata_if_needed(oof);
-	if (oof->multidata == NULL)
-	    continue;
-	if (oof->multidata[mindex] == CNONE)
-	    oof->multidata[mindex] = -1;
+	if (*multidata_for(oof, mindex) == CNONE)
+	    *multidata_for(oof, mindex) = -1;
 	else
 	    break;
     }
@@ -310,7 +323,7 @@ void reset_multis_for_id(filestruct *fileptr, int num)
 {
     reset_multis_before(fileptr, num);
     reset_multis_after(fileptr, num);
-    fileptr->multidata[num] = -1;
+    *multidata_for(fileptr, num) = -1;
 }
 
 /* Reset multi line strings around a filestruct ptr, trying to be smart about stopping
@@ -331,7 +344,6 @@ void reset_multis(filestruct *fileptr, bool force)
 	if (tmpcolor->end == NULL)
 	    continue;
 
-	alloc_multidata_if_needed(fileptr);
 	if (force == TRUE) {
 	    reset_multis_for_id(fileptr, tmpcolor->id);
 	    continue;
@@ -341,13 +353,13 @@ void reset_multis(filestruct *fileptr, bool force)
 	   things changed drastically for the precalculated multi values */
         nobegin = regexec(tmpcolor->start, fileptr->data, 1, &startmatch, 0);
         noend = regexec(tmpcolor->end, fileptr->data, 1, &endmatch, 0);
-	if (fileptr->multidata[tmpcolor->id] ==  CWHOLELINE) {
+	if (*multidata_for(fileptr, tmpcolor->id) ==  CWHOLELINE) {
 	    if (nobegin && noend)
 		continue;
-	} else if (fileptr->multidata[tmpcolor->id] == CNONE) {
+	} else if (*multidata_for(fileptr, tmpcolor->id) == CNONE) {
 	    if (nobegin && noend)
 		continue;
-	}  else if (fileptr->multidata[tmpcolor->id] & CBEGINBEFORE && !noend
+	}  else if (*multidata_for(fileptr, tmpcolor->id) & CBEGINBEFORE && !noend
 	  && (nobegin || endmatch.rm_eo > startmatch.rm_eo)) {
 	    reset_multis_after(fileptr, tmpcolor->id);
 	    continue;
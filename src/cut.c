@@ -25,10 +25,14 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 static bool keep_cutbuffer = FALSE;
 	/* Should we keep the contents of the cutbuffer? */
 	/* Pointer to the end of the cutbuffer. */
+static bool cut_pending = FALSE;
+	/* Have whole lines been cut without renumbering the lines after
+	 * them and without updating the undo item of the cut? */
 
 /* Indicate that we should no longer keep the contents of the
  * cutbuffer. */
@@ -37,6 +41,246 @@ void cutbuffer_reset(void)
     keep_cutbuffer = FALSE;
 }
 
+/* Throw away the text in the cutbuffer, including the part of it that
+ * was written out to the cut spill file. */
+void free_cutbuffer(void)
+{
+    if (cutbuffer != NULL) {
+	free_filestruct(cutbuffer);
+	cutbuffer = NULL;
+    }
+#ifndef NANO_TINY
+    release_spill_range(cut_spill_range);
+    cut_spill_range = NULL;
+    cut_spill_lines = 0;
+#endif
+}
+
+#ifndef NANO_TINY
+static spillrange *last_spill_range = NULL;
+	/* The range at the end of the cut spill file, if any. */
+
+/* Add a reference to range, if it isn't NULL, and return it. */
+spillrange *hold_spill_range(spillrange *range)
+{
+    if (range != NULL)
+	range->refs++;
+
+    return range;
+}
+
+/* Drop a reference to range, if it isn't NULL.  Once nothing refers to
+ * the ranges at the end of the cut spill file any more, cut the file
+ * back to the end of the last range that's still referred to, so that
+ * the room is used again. */
+void release_spill_range(spillrange *range)
+{
+    if (range == NULL || --range->refs > 0 || range != last_spill_range)
+	return;
+
+    while (last_spill_range != NULL && last_spill_range->refs == 0) {
+	range = last_spill_range;
+	last_spill_range = range->prev;
+	free(range);
+    }
+
+    IGNORE_CALL_RESULT(ftruncate(fileno(cut_spill),
+	(last_spill_range != NULL) ? last_spill_range->end : 0));
+}
+
+/* If the text in the cutbuffer takes up more memory than the cut budget
+ * allows, write all its lines but the last one out to the cut spill
+ * file, after the ones that are there already, and free them.  The
+ * last line stays, as more text may still be added to it.  The lines
+ * of the cutbuffer are always the last ones in the file, so that they
+ * follow each other, in one range; the ranges of earlier cutbuffers
+ * are left before it for as long as undo items refer to them. */
+static void spill_cut(void)
+{
+    size_t size = 0, nlines = 0;
+    filestruct *line;
+    off_t start, end;
+
+    if (cut_budget == 0 || cutbuffer == NULL)
+	return;
+
+    for (line = cutbuffer; line != cutbottom; line = line->next)
+	size += sizeof(filestruct) + strlen(line->data) + 1;
+
+    if (size <= (size_t)cut_budget * 1024)
+	return;
+
+    /* The file has no name, so it goes away by itself when it's closed
+     * or when we die. */
+    if (cut_spill == NULL && (cut_spill = tmpfile()) == NULL)
+	return;
+
+    if (fseeko(cut_spill, 0, SEEK_END) == -1 || (start =
+	ftello(cut_spill)) == -1)
+	return;
+
+    for (line = cutbuffer; line != cutbottom; line = line->next) {
+	if (!spill_string(cut_spill, line->data, strlen(line->data)))
+	    break;
+	nlines++;
+    }
+
+    /* If not all of it could be written out, take back what was, and
+     * keep the text in memory. */
+    if (line != cutbottom || fflush(cut_spill) != 0 || (end =
+	ftello(cut_spill)) == -1) {
+	fseeko(cut_spill, start, SEEK_SET);
+	IGNORE_CALL_RESULT(ftruncate(fileno(cut_spill), start));
+	clearerr(cut_spill);
+	return;
+    }
+
+    if (cut_spill_lines == 0) {
+	cut_spill_range = (spillrange *)nmalloc(sizeof(spillrange));
+	cut_spill_range->start = start;
+	cut_spill_range->refs = 1;
+	cut_spill_range->prev = last_spill_range;
+	last_spill_range = cut_spill_range;
+    }
+
+    assert(cut_spill_range == last_spill_range);
+
+    cut_spill_range->end = end;
+    cut_spill_lines += nlines;
+
+    cutbottom->prev->next = NULL;
+    cutbottom->prev = NULL;
+    free_filestruct(cutbuffer);
+    cutbuffer = cutbottom;
+}
+
+/* Read the first nlines lines of range in the cut spill file back in,
+ * and return them, followed by a copy of the lines from top onward,
+ * with the last line in *bot.  Return NULL if they can't be read. */
+filestruct *unspill_cut(const spillrange *range, size_t nlines,
+	filestruct *top, filestruct **bot)
+{
+    filestruct *first = NULL, *last = NULL, *copy;
+    size_t i;
+
+    if (nlines > 0 && fseeko(cut_spill, range->start, SEEK_SET) == -1)
+	goto read_error;
+
+    for (i = 0; i < nlines; i++) {
+	char *text;
+
+	if (!unspill_string(cut_spill, &text, NULL) || text == NULL)
+	    goto read_error;
+
+	last = make_new_node(last);
+	last->data = text;
+	if (last->prev != NULL)
+	    last->prev->next = last;
+	else
+	    first = last;
+    }
+
+    copy = copy_filestruct(top);
+    if (last != NULL) {
+	last->next = copy;
+	copy->prev = last;
+    } else
+	first = copy;
+
+    for (*bot = copy; (*bot)->next != NULL; *bot = (*bot)->next)
+	;
+
+    return first;
+
+  read_error:
+    if (first != NULL)
+	free_filestruct(first);
+    statusbar(_("Error reading cut text back in"));
+
+    return NULL;
+}
+#endif /* !NANO_TINY */
+
+/* If a run of whole-line cuts has left the lines after the current one
+ * misnumbered, renumber them, and update the undo item of the cut with
+ * the text in the cutbuffer. */
+void finish_cut(void)
+{
+    if (!cut_pending)
+	return;
+
+    cut_pending = FALSE;
+    finish_renumbering();
+#ifndef NANO_TINY
+    spill_cut();
+    update_undo(CUT);
+#endif
+}
+
+/* Move the current line, which isn't the last line of the file, onto
+ * the end of the cutbuffer, which is empty or ends with a newline, by
+ * relinking it.  Only the lines on the screen and the last line are
+ * renumbered; the rest, and the undo item, wait for finish_cut(), so
+ * that cutting n lines one by one doesn't take n times as long as the
+ * file is. */
+static void move_line_to_cutbuffer(void)
+{
+    filestruct *line = openfile->current, *next = line->next;
+
+#ifndef NANO_TINY
+    /* The line leaves the buffer, so undo items can't refer to it
+     * anymore. */
+    if (line->handle != NULL) {
+	line->handle->line = NULL;
+	line->handle = NULL;
+    }
+#endif
+
+    openfile->totsize -= mbstrlen(line->data) + 1;
+#ifndef NANO_TINY
+    mark_changed(line, line);
+#endif
+
+    /* Take the line out of the file. */
+    if (line == openfile->fileage)
+	openfile->fileage = next;
+    if (line == openfile->edittop)
+	openfile->edittop = next;
+    next->prev = line->prev;
+    if (line->prev != NULL)
+	line->prev->next = next;
+
+#ifdef ENABLE_COLOR
+    /* The next line now follows other text, so its multiline regex
+     * info has to be worked out again, as for a new line. */
+    clear_multidata(next);
+#endif
+
+    /* Put it in front of the empty line at the end of the
+     * cutbuffer. */
+    if (cutbuffer == NULL) {
+	cutbottom = make_new_node(NULL);
+	cutbottom->data = mallocstrcpy(NULL, "");
+	cutbuffer = cutbottom;
+    }
+    line->prev = cutbottom->prev;
+    if (line->prev != NULL)
+	line->prev->next = line;
+    else
+	cutbuffer = line;
+    line->next = cutbottom;
+    cutbottom->prev = line;
+    line->lineno = cutbottom->lineno++;
+
+    /* Only the lines on the screen have to be numbered right for
+     * now. */
+    openfile->current = next;
+    openfile->current_x = 0;
+    renumber_partly(next, -1);
+
+    cut_pending = TRUE;
+}
+
 /* If we aren't on the last line of the file, move all the text of the
  * current line, plus the newline at the end, into the cutbuffer.  If we
  * are, move all of the text of the current line into the cutbuffer.  In
@@ -44,12 +288,19 @@ void cutbuffer_reset(void)
  * current line. */
 void cut_line(void)
 {
-    if (openfile->current != openfile->filebot)
-	move_to_filestruct(&cutbuffer, &cutbottom, openfile->current, 0,
-		openfile->current->next, 0);
-    else
-	move_to_filestruct(&cutbuffer, &cutbottom, openfile->current, 0,
-		openfile->current, strlen(openfile->current->data));
+    if (openfile->current != openfile->filebot && (cutbuffer == NULL ||
+	cutbottom->data[0] == '\0'))
+	move_line_to_cutbuffer();
+    else {
+	finish_cut();
+	if (openfile->current != openfile->filebot)
+	    move_to_filestruct(&cutbuffer, &cutbottom,
+		openfile->current, 0, openfile->current->next, 0);
+	else
+	    move_to_filestruct(&cutbuffer, &cutbottom,
+		openfile->current, 0, openfile->current,
+		line_len(openfile->current));
+    }
     openfile->placewewant = 0;
 }
 
@@ -76,7 +327,7 @@ void cut_marked(void)
  * newline used to be. */
 void cut_to_eol(void)
 {
-    size_t data_len = strlen(openfile->current->data);
+    size_t data_len = line_len(openfile->current);
 
     assert(openfile->current_x <= data_len);
 
@@ -108,60 +359,36 @@ void cut_to_eof(void)
 #endif /* !NANO_TINY */
 
 /* Move text from the current filestruct into the cutbuffer.  If
- * copy_text is TRUE, copy the text back into the filestruct afterward.
- * If cut_till_end is TRUE, move all text from the current cursor
- * position to the end of the file into the cutbuffer. */
+ * cut_till_end is TRUE, move all text from the current cursor position
+ * to the end of the file into the cutbuffer. */
 void do_cut_text(
 #ifndef NANO_TINY
-	bool copy_text, bool cut_till_end, bool undoing
+	bool cut_till_end, bool undoing
 #else
 	void
 #endif
 	)
 {
-#ifndef NANO_TINY
-    filestruct *cb_save = NULL;
-	/* The current end of the cutbuffer, before we add text to
-	 * it. */
-    size_t cb_save_len = 0;
-	/* The length of the string at the current end of the cutbuffer,
-	 * before we add text to it.  */
-    bool old_no_newlines = ISSET(NO_NEWLINES);
-#endif
-
     assert(openfile->current != NULL && openfile->current->data != NULL);
 
     /* If keep_cutbuffer is FALSE and the cutbuffer isn't empty, blow
      * away the text in the cutbuffer. */
     if (!keep_cutbuffer && cutbuffer != NULL) {
-	free_filestruct(cutbuffer);
-	cutbuffer = NULL;
+	free_cutbuffer();
 #ifdef DEBUG
 	fprintf(stderr, "Blew away cutbuffer =)\n");
 #endif
     }
 
-#ifndef NANO_TINY
-    if (copy_text) {
-	if (cutbuffer != NULL) {
-	    /* If the cutbuffer isn't empty, save where it currently
-	     * ends.  This is where we'll add the new text. */
-	    cb_save = cutbottom;
-	    cb_save_len = strlen(cutbottom->data);
-	}
-
-	/* Set NO_NEWLINES to TRUE, so that we don't disturb the last
-	 * line of the file when moving text to the cutbuffer. */
-	SET(NO_NEWLINES);
-    }
-#endif
-
     /* Set keep_cutbuffer to TRUE, so that the text we're going to move
      * into the cutbuffer will be added to the text already in the
      * cutbuffer instead of replacing it. */
     keep_cutbuffer = TRUE;
 
 #ifndef NANO_TINY
+    /* Only a whole line can be added to a run of cuts. */
+    if (cut_till_end || openfile->mark_set || ISSET(CUT_TO_END))
+	finish_cut();
 
     if (cut_till_end) {
 	/* If cut_till_end is TRUE, move all text up to the end of the
@@ -182,34 +409,22 @@ void do_cut_text(
 	cut_line();
 
 #ifndef NANO_TINY
-    if (copy_text) {
-	/* Copy the text in the cutbuffer, starting at its saved end if
-	 * there is one, back into the filestruct.  This effectively
-	 * uncuts the text we just cut without marking the file as
-	 * modified. */
-	if (cutbuffer != NULL) {
-	    if (cb_save != NULL) {
-		cb_save->data += cb_save_len;
-		copy_from_filestruct(cb_save, cutbottom);
-		cb_save->data -= cb_save_len;
-	    } else
-		copy_from_filestruct(cutbuffer, cutbottom);
-
-	    /* Set the current place we want to where the text from the
-	     * cutbuffer ends. */
-	    openfile->placewewant = xplustabs();
-	}
-
-	/* Set NO_NEWLINES back to what it was before, since we're done
-	 * disturbing the text. */
-	if (!old_no_newlines)
-	    UNSET(NO_NEWLINES);
-    } else if (!undoing)
-	update_undo(CUT);
+    /* A redone cut doesn't have an undo item to update, so don't leave
+     * it for finish_cut() to do. */
+    if (undoing && cut_pending) {
+	cut_pending = FALSE;
+	finish_renumbering();
+    }
+    if (!cut_pending) {
+	spill_cut();
+	if (!undoing)
+	    update_undo(CUT);
+    }
 #endif
-	/* Leave the text in the cutbuffer, and mark the file as
-	 * modified. */
-	set_modified();
+
+    /* Leave the text in the cutbuffer, and mark the file as
+     * modified. */
+    set_modified();
 
     /* Update the screen. */
     edit_refresh_needed = TRUE;
@@ -231,17 +446,70 @@ void do_cut_text_void(void)
 #endif
     do_cut_text(
 #ifndef NANO_TINY
-	FALSE, FALSE, FALSE
+	FALSE, FALSE
 #endif
 	);
 }
 
 #ifndef NANO_TINY
-/* Move text from the current filestruct into the cutbuffer, and copy it
- * back into the filestruct afterward. */
+/* Copy the text that do_cut_text() would cut into the cutbuffer,
+ * straight from the current filestruct, which is left alone.  The
+ * cursor ends up where the text ends, as if it had been cut and put
+ * back. */
 void do_copy_text(void)
 {
-    do_cut_text(TRUE, FALSE, FALSE);
+    filestruct *top = openfile->current, *bot = top;
+    size_t top_x = 0, bot_x = 0;
+
+    finish_cut();
+
+    /* If keep_cutbuffer is FALSE and the cutbuffer isn't empty, blow
+     * away the text in the cutbuffer. */
+    if (!keep_cutbuffer && cutbuffer != NULL)
+	free_cutbuffer();
+
+    /* Set keep_cutbuffer to TRUE, so that the text we're going to copy
+     * into the cutbuffer will be added to the text already in the
+     * cutbuffer instead of replacing it. */
+    keep_cutbuffer = TRUE;
+
+    if (openfile->mark_set) {
+	/* If the mark is on, copy the marked text, and turn the mark
+	 * off. */
+	mark_order((const filestruct **)&top, &top_x,
+		(const filestruct **)&bot, &bot_x, NULL);
+	openfile->mark_set = FALSE;
+    } else if (ISSET(CUT_TO_END)) {
+	/* If the CUT_TO_END flag is set, copy the text up to the end of
+	 * the line, or the newline at the end if we're there already,
+	 * unless this is the last line. */
+	top_x = openfile->current_x;
+	bot_x = strlen(top->data);
+	if (top_x == bot_x) {
+	    if (top == openfile->filebot)
+		return;
+	    bot = top->next;
+	    bot_x = 0;
+	}
+    } else if (top != openfile->filebot)
+	/* Copy the entire line, with the newline at the end. */
+	bot = top->next;
+    else
+	/* Copy the entire last line. */
+	bot_x = strlen(top->data);
+
+    copy_to_filestruct(&cutbuffer, &cutbottom, top, top_x, bot, bot_x);
+
+    openfile->current = bot;
+    openfile->current_x = bot_x;
+    openfile->placewewant = xplustabs();
+
+    /* Update the screen. */
+    edit_refresh_needed = TRUE;
+
+#ifdef DEBUG
+    dump_filestruct(cutbuffer);
+#endif
 }
 
 /* Cut from the current cursor position to the end of the file. */
@@ -250,13 +518,15 @@ void do_cut_till_end(void)
 #ifndef NANO_TINY
     add_undo(CUT);
 #endif
-    do_cut_text(FALSE, TRUE, FALSE);
+    do_cut_text(TRUE, FALSE);
 }
 #endif /* !NANO_TINY */
 
 /* Copy text from the cutbuffer into the current filestruct. */
 void do_uncut_text(void)
 {
+    filestruct *top = cutbuffer, *bot = cutbottom;
+
     assert(openfile->current != NULL && openfile->current->data != NULL);
 
     /* If the cutbuffer is empty, get out. */
@@ -264,12 +534,23 @@ void do_uncut_text(void)
 	return;
 
 #ifndef NANO_TINY
+    /* If part of the text was written out, read it back in, in front
+     * of a copy of the rest, in one go. */
+    if (cut_spill_lines > 0 && (top = unspill_cut(cut_spill_range,
+	cut_spill_lines, cutbuffer, &bot)) == NULL)
+	return;
+
      update_undo(UNCUT);
 #endif
 
     /* Add a copy of the text in the cutbuffer to the current filestruct
      * at the current cursor position. */
-    copy_from_filestruct(cutbuffer, cutbottom);
+    copy_from_filestruct(top, bot);
+
+#ifndef NANO_TINY
+    if (top != cutbuffer)
+	free_filestruct(top);
+#endif
 
     /* Set the current place we want to where the text from the
      * cutbuffer ends. */
@@ -31,6 +31,17 @@
 #include <errno.h>
 #include <ctype.h>
 #include <pwd.h>
+#include <sys/uio.h>
+#ifndef NANO_TINY
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <signal.h>
+#endif
+#if !defined(NANO_TINY) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
 
 /* Add an entry to the openfile openfilestruct.  This should only be
  * called from open_buffer(). */
@@ -77,6 +88,10 @@ void initialize_buffer(void)
     openfile->current_stat = NULL;
     openfile->undotop = NULL;
     openfile->current_undo = NULL;
+    openfile->undo_size = 0;
+    openfile->undo_trim = NULL;
+    openfile->undo_spill = NULL;
+    openfile->shared_lines = FALSE;
 #endif
 #ifdef ENABLE_COLOR
     openfile->colorstrings = NULL;
@@ -97,10 +112,16 @@ void initialize_buffer_text(void)
     openfile->current = openfile->fileage;
 
 #ifdef ENABLE_COLOR
-    openfile->fileage->multidata = NULL;
+    memset(openfile->fileage->multidata, -1,
+	sizeof(openfile->fileage->multidata));
+    openfile->fileage->multimore = NULL;
 #endif
 
     openfile->totsize = 0;
+#ifndef NANO_TINY
+    openfile->version++;
+    mark_changed(openfile->fileage, openfile->filebot);
+#endif
 }
 
 /* If it's not "", filename is a file to open.  We make a new buffer, if
@@ -164,6 +185,13 @@ void open_buffer(const char *filename, bool undoable)
 	openfile->placewewant = 0;
     }
 
+#ifndef NANO_TINY
+    /* If we're loading into a new buffer, keep a journal of the changes
+     * to it, after recovering the ones left behind, if any. */
+    if (rc != -1 && new_buffer)
+	open_journal();
+#endif
+
 #ifdef ENABLE_COLOR
     /* If we're loading into a new buffer, update the colors to account
      * for it, if applicable. */
@@ -198,6 +226,10 @@ void replace_buffer(const char *filename)
     if (rc > 0)
 	read_file(f, rc, filename, FALSE, TRUE);
 
+#ifndef NANO_TINY
+    mark_changed(openfile->fileage, openfile->filebot);
+#endif
+
     /* Move back to the beginning of the first line of the buffer. */
     openfile->current = openfile->fileage;
     openfile->current_x = 0;
@@ -332,32 +364,20 @@ int is_file_writable(const char *filename)
     return ans;
 }
 
-/* We make a new line of text from buf.  buf is length buf_len.  If
- * first_line_ins is TRUE, then we put the new line at the top of the
- * file.  Otherwise, we assume prevnode is the last line of the file,
- * and put our line after prevnode. */
-filestruct *read_line(char *buf, filestruct *prevnode, bool
-	*first_line_ins, size_t buf_len)
+/* Fill in the rest of the new line fileptr, and put it at the top of
+ * the file if first_line_ins is TRUE.  Otherwise, we assume prevnode is
+ * the last line of the file, and put fileptr after prevnode. */
+static void link_read_line(filestruct *fileptr, filestruct *prevnode,
+	bool *first_line_ins)
 {
-    filestruct *fileptr = (filestruct *)nmalloc(sizeof(filestruct));
-
-    /* Convert nulls to newlines.  buf_len is the string's real
-     * length. */
-    unsunder(buf, buf_len);
-
-    assert(openfile->fileage != NULL && strlen(buf) == buf_len);
-
-    fileptr->data = mallocstrcpy(NULL, buf);
-
 #ifndef NANO_TINY
-    /* If it's a DOS file ("\r\n"), and file conversion isn't disabled,
-     * strip the '\r' part from fileptr->data. */
-    if (!ISSET(NO_CONVERT) && buf_len > 0 && buf[buf_len - 1] == '\r')
-	fileptr->data[buf_len - 1] = '\0';
+    fileptr->handle = NULL;
+    fileptr->len_stamp = 0;
 #endif
 
 #ifdef ENABLE_COLOR
-	fileptr->multidata = NULL;
+    memset(fileptr->multidata, -1, sizeof(fileptr->multidata));
+    fileptr->multimore = NULL;
 #endif
 
     if (*first_line_ins) {
@@ -383,10 +403,311 @@ filestruct *read_line(char *buf, filestruct *prevnode, bool
 	fileptr->lineno = prevnode->lineno + 1;
 	prevnode->next = fileptr;
     }
+}
+
+/* We make a new line of text from buf.  buf is length buf_len.  If
+ * first_line_ins is TRUE, then we put the new line at the top of the
+ * file.  Otherwise, we assume prevnode is the last line of the file,
+ * and put our line after prevnode. */
+filestruct *read_line(char *buf, filestruct *prevnode, bool
+	*first_line_ins, size_t buf_len)
+{
+    filestruct *fileptr = (filestruct *)nmalloc(sizeof(filestruct));
+
+    /* Convert nulls to newlines.  buf_len is the string's real
+     * length. */
+    unsunder(buf, buf_len);
+
+    assert(openfile->fileage != NULL && strlen(buf) == buf_len);
+
+    /* The length is known, so there's no need to measure it again. */
+    fileptr->data = charalloc(buf_len + 1);
+    memcpy(fileptr->data, buf, buf_len + 1);
+
+#ifndef NANO_TINY
+    fileptr->sharers = NULL;
+
+    /* If it's a DOS file ("\r\n"), and file conversion isn't disabled,
+     * strip the '\r' part from fileptr->data. */
+    if (!ISSET(NO_CONVERT) && buf_len > 0 && buf[buf_len - 1] == '\r')
+	fileptr->data[--buf_len] = '\0';
+#endif
+
+    link_read_line(fileptr, prevnode, first_line_ins);
+
+#ifndef NANO_TINY
+    set_line_len(fileptr, buf_len, mbstrlen(fileptr->data));
+#endif
+
+    return fileptr;
+}
+
+#ifndef NANO_TINY
+/* Read the file f into a private mapping of its own, in one piece, so
+ * that its lines can keep their text there instead of each getting a
+ * copy of it, if mapping files is turned on and the file is read into
+ * an empty buffer.  The file itself isn't mapped, as truncating it,
+ * which saving over it does, takes the pages of every mapping of it
+ * away, even the ones that were copied.  Return NULL if it isn't read
+ * this way, in which case nothing has been read from f yet. */
+static filemap *map_file(FILE *f)
+{
+    struct stat fileinfo;
+    filemap *map;
+    void *addr;
+    size_t len = 0;
+    ssize_t got;
+
+    if (!ISSET(MAP_FILES) || openfile->fileage != openfile->filebot ||
+	openfile->fileage->data[0] != '\0' || fstat(fileno(f),
+	&fileinfo) == -1 || !S_ISREG(fileinfo.st_mode) ||
+	fileinfo.st_size <= 0 || (size_t)fileinfo.st_size !=
+	fileinfo.st_size)
+	return NULL;
+
+    addr = mmap(NULL, fileinfo.st_size, PROT_READ | PROT_WRITE,
+	MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+	return NULL;
+
+    while (len < (size_t)fileinfo.st_size) {
+	got = read(fileno(f), (char *)addr + len, fileinfo.st_size -
+		len);
+
+	if (got == -1 && errno == EINTR)
+	    continue;
+
+	/* If the file can't be read or has shrunk since we looked at
+	 * it, read it the usual way instead. */
+	if (got <= 0) {
+	    munmap(addr, fileinfo.st_size);
+	    lseek(fileno(f), 0, SEEK_SET);
+	    return NULL;
+	}
+
+	len += got;
+    }
+
+    map = (filemap *)nmalloc(sizeof(filemap));
+    map->refs = 0;
+    map->addr = (char *)addr;
+    map->len = fileinfo.st_size;
+    map->next = NULL;
+
+    return map;
+}
+
+/* Convert the nulls in the len bytes at text in a file mapping to
+ * newlines, as read_line() does, and end the text in place of the
+ * newline or the '\r' after it. */
+static void end_mapped_text(char *text, size_t len)
+{
+    unsunder(text, len);
+
+    if (!ISSET(NO_CONVERT) && len > 0 && text[len - 1] == '\r')
+	text[len - 1] = '\0';
+    else
+	text[len] = '\0';
+}
+
+/* Make a new line of text from the len bytes at text in the file
+ * mapping map, like read_line() does from buf, but leave the text where
+ * it is, ending it in place of the newline or the '\r' after it. */
+static filestruct *read_mapped_line(char *text, filestruct *prevnode,
+	bool *first_line_ins, size_t len, filemap *map)
+{
+    filestruct *fileptr = (filestruct *)nmalloc(sizeof(filestruct));
+
+    end_mapped_text(text, len);
+
+    fileptr->data = text;
+    fileptr->sharers = &map->refs;
+    map->refs++;
+
+    link_read_line(fileptr, prevnode, first_line_ins);
+    measure_line(fileptr);
 
     return fileptr;
 }
 
+/* Once the lines of the file mapping map have been read, keep the
+ * mapping if lines have their text in it, or unmap it otherwise. */
+static void finish_map(filemap *map)
+{
+    if (map->refs == 0) {
+	munmap(map->addr, map->len);
+	free(map);
+	return;
+    }
+
+    map->next = filemaps;
+    filemaps = map;
+    openfile->shared_lines = TRUE;
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Make lines out of the piece of a file mapping described by chunk, the
+ * way read_file() does, into a list of their own, numbered from one.
+ * This may run in a thread of its own, so it touches nothing that's
+ * shared; read_mapped_chunks() links the list in afterwards. */
+static void *read_chunk(void *arg)
+{
+    readchunk *chunk = (readchunk *)arg;
+    char *text = chunk->start, *eol;
+
+    chunk->first = NULL;
+    chunk->last = NULL;
+    chunk->lines = 0;
+    chunk->dos = FALSE;
+    chunk->mac = FALSE;
+
+    while (text < chunk->end) {
+	filestruct *fileptr = (filestruct *)nmalloc(sizeof(filestruct));
+	size_t len;
+
+	/* The piece ends with a newline, so the '\r' can't be its last
+	 * byte. */
+	if (chunk->convert) {
+	    for (eol = text; *eol != '\n' && (*eol != '\r' ||
+		eol[1] == '\n'); eol++)
+		;
+	} else
+	    eol = (char *)memchr(text, '\n', chunk->end - text);
+
+	if (*eol == '\r') {
+	    chunk->mac = TRUE;
+	    len = eol - text + 1;
+	} else {
+	    if (chunk->convert && eol > text && eol[-1] == '\r')
+		chunk->dos = TRUE;
+	    len = eol - text;
+	}
+
+	end_mapped_text(text, len);
+
+	fileptr->data = text;
+	fileptr->lineno = ++chunk->lines;
+	fileptr->next = NULL;
+	fileptr->prev = chunk->last;
+	fileptr->handle = NULL;
+	fileptr->sharers = chunk->sharers;
+	fileptr->len_stamp = 0;
+#ifdef ENABLE_COLOR
+	memset(fileptr->multidata, -1, sizeof(fileptr->multidata));
+	fileptr->multimore = NULL;
+#endif
+
+	if (chunk->last != NULL)
+	    chunk->last->next = fileptr;
+	else
+	    chunk->first = fileptr;
+	chunk->last = fileptr;
+
+	text = eol + 1;
+    }
+
+    return NULL;
+}
+
+/* Make lines out of the file mapping map from *pos up to and including
+ * its last newline, in pieces, with as many threads as there are
+ * processors, and link them in after *fileptr.  The first line must
+ * already have been read, as it settles whether to look for DOS and
+ * Mac line endings; the ones found are added to *format.  Set *pos and
+ * *fileptr to after the text read and to its last line, and return the
+ * number of lines made.  Return 0 without doing anything if there isn't
+ * enough text, or enough processors, to make this worth it. */
+static size_t read_mapped_chunks(filemap *map, size_t *pos, filestruct
+	**fileptr, int *format)
+{
+    readchunk chunks[READ_MAX_THREADS];
+    pthread_t threads[READ_MAX_THREADS];
+    bool started[READ_MAX_THREADS];
+    sigset_t allsigs, oldsigs;
+    char *begin = map->addr + *pos, *end = map->addr + map->len;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nchunks, i, total = 0;
+    filestruct *prev = *fileptr, *line;
+    ssize_t lineno = prev->lineno;
+
+    while (end > begin && end[-1] != '\n')
+	end--;
+
+    nchunks = (end - begin) / READ_CHUNK_MIN;
+    if (ncpus > READ_MAX_THREADS)
+	ncpus = READ_MAX_THREADS;
+    if (nchunks > (size_t)ncpus)
+	nchunks = ncpus;
+    if (nchunks < 2)
+	return 0;
+
+    /* Cut the text into about equal pieces, each ending just after a
+     * newline, so that no line or line ending is split between two of
+     * them. */
+    for (i = 0; i < nchunks; i++) {
+	char *cut = begin + (end - begin) / nchunks * i;
+
+	if (i == 0)
+	    chunks[i].start = begin;
+	else {
+	    if (cut < chunks[i - 1].start)
+		cut = chunks[i - 1].start;
+	    chunks[i].start = (cut == end) ? end :
+		(char *)memchr(cut, '\n', end - cut) + 1;
+	    chunks[i - 1].end = chunks[i].start;
+	}
+	chunks[i].convert = (!ISSET(NO_CONVERT) && *format != 0);
+	chunks[i].sharers = &map->refs;
+    }
+    chunks[nchunks - 1].end = end;
+
+    /* Keep all signals away from the threads; only we handle them.  We
+     * do the first piece ourselves, and any piece that no thread could
+     * be started for. */
+    sigfillset(&allsigs);
+    pthread_sigmask(SIG_SETMASK, &allsigs, &oldsigs);
+    for (i = 1; i < nchunks; i++)
+	started[i] = (pthread_create(&threads[i], NULL, read_chunk,
+		&chunks[i]) == 0);
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+    read_chunk(&chunks[0]);
+    for (i = 1; i < nchunks; i++) {
+	if (started[i])
+	    pthread_join(threads[i], NULL);
+	else
+	    read_chunk(&chunks[i]);
+    }
+
+    /* Stitch the pieces together, numbering their lines as we go. */
+    for (i = 0; i < nchunks; i++) {
+	if (chunks[i].lines == 0)
+	    continue;
+
+	prev->next = chunks[i].first;
+	chunks[i].first->prev = prev;
+	for (line = chunks[i].first; line != NULL; line = line->next)
+	    line->lineno += lineno;
+
+	lineno += chunks[i].lines;
+	total += chunks[i].lines;
+	prev = chunks[i].last;
+
+	if (chunks[i].dos)
+	    *format |= 1;
+	if (chunks[i].mac)
+	    *format |= 2;
+    }
+
+    map->refs += total;
+    *pos = end - map->addr;
+    *fileptr = prev;
+
+    return total;
+}
+#endif /* HAVE_PTHREAD_H */
+#endif /* !NANO_TINY */
+
 /* Read an open file into the current buffer.  f should be set to the
  * open file, and filename should be set to the name of the file.
  * undoable  means do we want to create undo records to try and undo this.
@@ -418,6 +739,15 @@ void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkw
 #ifndef NANO_TINY
     int format = 0;
 	/* 0 = *nix, 1 = DOS, 2 = Mac, 3 = both DOS and Mac. */
+    filemap *map;
+	/* The mapping that the file was read into, if it was. */
+    size_t pos = 0;
+	/* The position in the file mapping. */
+    size_t start = 0;
+	/* Where the current line starts in the file mapping. */
+    char *text;
+	/* Where the text of the current line is: in buf, or in the
+	 * mapped file. */
 #endif
 
     assert(openfile->fileage != NULL && openfile->current != NULL);
@@ -425,6 +755,11 @@ void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkw
     buf = charalloc(bufx);
     buf[0] = '\0';
 
+#ifndef NANO_TINY
+    map = map_file(f);
+    text = (map != NULL) ? map->addr : buf;
+#endif
+
 #ifndef NANO_TINY
     if (undoable)
 	add_undo(INSERT);
@@ -436,7 +771,18 @@ void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkw
 	fileptr = openfile->current->prev;
 
     /* Read the entire file into the filestruct. */
-    while ((input_int = getc(f)) != EOF) {
+    while (TRUE) {
+#ifndef NANO_TINY
+	if (map != NULL)
+	    input_int = (pos < map->len) ?
+		(unsigned char)map->addr[pos++] : EOF;
+	else
+#endif
+	    input_int = getc(f);
+
+	if (input_int == EOF)
+	    break;
+
 	input = (char)input_int;
 
 	/* If it's a *nix file ("\n") or a DOS file ("\r\n"), and file
@@ -448,14 +794,18 @@ void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkw
 	     * line otherwise), and file conversion isn't disabled,
 	     * handle it! */
 	    if (!ISSET(NO_CONVERT) && (num_lines == 0 || format != 0) &&
-		i > 0 && buf[i - 1] == '\r') {
+		i > 0 && text[i - 1] == '\r') {
 		if (format == 0 || format == 2)
 		    format++;
 	    }
-#endif
 
 	    /* Read in the line properly. */
-	    fileptr = read_line(buf, fileptr, &first_line_ins, len);
+	    if (map != NULL)
+		fileptr = read_mapped_line(text, fileptr,
+			&first_line_ins, len, map);
+	    else
+#endif
+		fileptr = read_line(buf, fileptr, &first_line_ins, len);
 
 	    /* Reset the line length in preparation for the next
 	     * line. */
@@ -465,11 +815,23 @@ void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkw
 	    buf[0] = '\0';
 	    i = 0;
 #ifndef NANO_TINY
+	    if (map != NULL) {
+#ifdef HAVE_PTHREAD_H
+		/* Once the first line has settled whether this is a DOS
+		 * or Mac file, the lines of the rest of it can be made in
+		 * parallel. */
+		if (num_lines == 1)
+		    num_lines += read_mapped_chunks(map, &pos, &fileptr,
+			&format);
+#endif
+		start = pos;
+		text = map->addr + start;
+	    }
 	/* If it's a Mac file ('\r' without '\n' on the first line if we
 	 * think it's a *nix file, or on any line otherwise), and file
 	 * conversion isn't disabled, handle it! */
 	} else if (!ISSET(NO_CONVERT) && (num_lines == 0 ||
-		format != 0) && i > 0 && buf[i - 1] == '\r') {
+		format != 0) && i > 0 && text[i - 1] == '\r') {
 	    /* If we currently think the file is a *nix file, set format
 	     * to Mac.  If we currently think the file is a DOS file,
 	     * set format to both DOS and Mac. */
@@ -477,7 +839,11 @@ void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkw
 		format += 2;
 
 	    /* Read in the line properly. */
-	    fileptr = read_line(buf, fileptr, &first_line_ins, len);
+	    if (map != NULL)
+		fileptr = read_mapped_line(text, fileptr,
+			&first_line_ins, len, map);
+	    else
+		fileptr = read_line(buf, fileptr, &first_line_ins, len);
 
 	    /* Reset the line length in preparation for the next line.
 	     * Since we've already read in the next character, reset it
@@ -488,12 +854,24 @@ void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkw
 	    buf[0] = input;
 	    buf[1] = '\0';
 	    i = 1;
+	    if (map != NULL) {
+		start = pos - 1;
+		text = map->addr + start;
+	    }
 #endif
 	} else {
 	    /* Calculate the total length of the line.  It might have
 	     * nulls in it, so we can't just use strlen() here. */
 	    len++;
 
+#ifndef NANO_TINY
+	    /* Text in the file mapping stays where it is. */
+	    if (map != NULL) {
+		i++;
+		continue;
+	    }
+#endif
+
 	    /* Now we allocate a bigger buffer MAX_BUF_SIZE characters
 	     * at a time.  If we allocate a lot of space for one line,
 	     * we may indeed have to use a buffer this big later on, so
@@ -502,6 +880,9 @@ void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkw
 	    if (i >= bufx - 1) {
 		bufx += MAX_BUF_SIZE;
 		buf = charealloc(buf, bufx);
+#ifndef NANO_TINY
+		text = buf;
+#endif
 	    }
 
 	    buf[i] = input;
@@ -510,6 +891,20 @@ void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkw
 	}
     }
 
+#ifndef NANO_TINY
+    if (map != NULL) {
+	/* Text after the last newline is made into a line the usual
+	 * way, as there's no room to end it in the file mapping. */
+	if (len > 0) {
+	    if (len >= bufx)
+		buf = charealloc(buf, len + 1);
+	    memcpy(buf, text, len);
+	    buf[len] = '\0';
+	}
+	finish_map(map);
+    }
+#endif
+
     /* Perhaps this could use some better handling. */
     if (ferror(f))
 	nperror(filename);
@@ -577,6 +972,9 @@ void read_file(FILE *f, int fd, const char *filename, bool undoable, bool checkw
 	    charmove(openfile->current->data + len,
 		openfile->current->data, current_len + 1);
 	    strncpy(openfile->current->data, fileptr->data, len);
+#ifndef NANO_TINY
+	    measure_line(openfile->current);
+#endif
 
 	    /* Don't destroy fileage, edittop, or filebot! */
 	    if (fileptr == openfile->fileage)
@@ -1420,6 +1818,110 @@ int copy_file(FILE *inn, FILE *out)
     return retval;
 }
 
+/* Write the count pieces in iov to fd, going on where a partial write
+ * left off.  Return FALSE if that fails. */
+static bool write_pieces(int fd, struct iovec *iov, int count)
+{
+    while (count > 0) {
+	ssize_t written = writev(fd, iov, count);
+
+	if (written == -1) {
+	    if (errno == EINTR)
+		continue;
+	    return FALSE;
+	}
+
+	/* Skip what was written, which may end partway into a piece. */
+	while (count > 0 && (size_t)written >= iov->iov_len) {
+	    written -= iov->iov_len;
+	    iov++;
+	    count--;
+	}
+	if (count > 0) {
+	    iov->iov_base = (char *)iov->iov_base + written;
+	    iov->iov_len -= written;
+	}
+    }
+
+    return TRUE;
+}
+
+/* Write the lines from fileptr to the end of the current buffer to fd,
+ * each but the last followed by the line ending of the buffer's format,
+ * and add the number of lines written to *lineswritten.  writev() is
+ * pointed straight at the text of the lines, in batches, with the
+ * lengths that the lines remember where they're known.  NULs in the
+ * file are kept as newlines in the buffer, so they're written from a
+ * constant instead of converting the line in place.  Return FALSE if
+ * the writing fails. */
+static bool write_lines(int fd, const filestruct *fileptr, size_t
+	*lineswritten)
+{
+    static char nul[] = "", eols[] = "\r\n";
+    char *eol = eols + 1;
+    size_t eol_len = 1;
+    struct iovec iov[MAX_WRITE_PIECES];
+    int count = 0;
+
+#ifndef NANO_TINY
+    if (openfile->fmt == DOS_FILE) {
+	eol = eols;
+	eol_len = 2;
+    } else if (openfile->fmt == MAC_FILE)
+	eol = eols;
+#endif
+
+    for (; fileptr != NULL; fileptr = fileptr->next) {
+	char *data = fileptr->data;
+	size_t left = line_len(fileptr);
+
+	while (TRUE) {
+	    char *nul_at = (char *)memchr(data, '\n', left);
+	    size_t len = (nul_at != NULL) ? nul_at - data : left;
+
+	    /* Each time around takes up at most two pieces: the text
+	     * and the NUL or the line ending after it. */
+	    if (count > MAX_WRITE_PIECES - 2) {
+		if (!write_pieces(fd, iov, count))
+		    return FALSE;
+		count = 0;
+	    }
+
+	    if (len > 0) {
+		iov[count].iov_base = data;
+		iov[count].iov_len = len;
+		count++;
+	    }
+
+	    if (nul_at == NULL)
+		break;
+
+	    iov[count].iov_base = nul;
+	    iov[count].iov_len = 1;
+	    count++;
+	    data += len + 1;
+	    left -= len + 1;
+	}
+
+	/* If we're on the last line of the file, don't write a newline
+	 * character after it.  If the last line of the file is blank,
+	 * this means that zero bytes are written, in which case we
+	 * don't count the last line in the total lines written. */
+	if (fileptr == openfile->filebot) {
+	    if (fileptr->data[0] == '\0')
+		(*lineswritten)--;
+	} else {
+	    iov[count].iov_base = eol;
+	    iov[count].iov_len = eol_len;
+	    count++;
+	}
+
+	(*lineswritten)++;
+    }
+
+    return write_pieces(fd, iov, count);
+}
+
 /* Write a file out to disk.  If f_open isn't NULL, we assume that it is
  * a stream associated with the file, and we don't try to open it
  * ourselves.  If tmp is TRUE, we set the umask to disallow anyone else
@@ -1783,59 +2285,12 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
      * a selection. */
     assert(openfile->fileage != NULL && openfile->filebot != NULL);
 
-    while (fileptr != NULL) {
-	size_t data_len = strlen(fileptr->data), size;
-
-	/* Convert newlines to nulls, just before we write to disk. */
-	sunder(fileptr->data);
-
-	size = fwrite(fileptr->data, sizeof(char), data_len, f);
-
-	/* Convert nulls to newlines.  data_len is the string's real
-	 * length. */
-	unsunder(fileptr->data, data_len);
-
-	if (size < data_len) {
-	    statusbar(_("Error writing %s: %s"), realname,
-		strerror(errno));
-	    fclose(f);
-	    goto cleanup_and_exit;
-	}
-
-	/* If we're on the last line of the file, don't write a newline
-	 * character after it.  If the last line of the file is blank,
-	 * this means that zero bytes are written, in which case we
-	 * don't count the last line in the total lines written. */
-	if (fileptr == openfile->filebot) {
-	    if (fileptr->data[0] == '\0')
-		lineswritten--;
-	} else {
-#ifndef NANO_TINY
-	    if (openfile->fmt == DOS_FILE || openfile->fmt ==
-		MAC_FILE) {
-		if (putc('\r', f) == EOF) {
-		    statusbar(_("Error writing %s: %s"), realname,
-			strerror(errno));
-		    fclose(f);
-		    goto cleanup_and_exit;
-		}
-	    }
-
-	    if (openfile->fmt != MAC_FILE) {
-#endif
-		if (putc('\n', f) == EOF) {
-		    statusbar(_("Error writing %s: %s"), realname,
-			strerror(errno));
-		    fclose(f);
-		    goto cleanup_and_exit;
-		}
-#ifndef NANO_TINY
-	    }
-#endif
-	}
-
-	fileptr = fileptr->next;
-	lineswritten++;
+    /* Anything already in the stream must come first. */
+    if (fflush(f) != 0 || !write_lines(fileno(f), fileptr,
+	&lineswritten)) {
+	statusbar(_("Error writing %s: %s"), realname, strerror(errno));
+	fclose(f);
+	goto cleanup_and_exit;
     }
 
     /* If we're prepending, open the temp file, and append it to f. */
@@ -1895,6 +2350,12 @@ bool write_file(const char *name, FILE *f_open, bool tmp, append_type
 	    openfile->current_stat =
 		(struct stat *)nmalloc(sizeof(struct stat));
 	stat(realname, openfile->current_stat);
+
+	/* The journal starts over from the file as it is now, unless
+	 * only part of the buffer was written. */
+	if (filepart == NULL && (!nonamechange ||
+		openfile->journal_name != NULL))
+	    restart_journal();
 #endif
 
 	statusbar(P_("Wrote %lu line", "Wrote %lu lines",
@@ -2211,24 +2672,783 @@ void do_writeout_void(void)
     display_main_list();
 }
 
-/* Return a malloc()ed string containing the actual directory, used to
- * convert ~user/ and ~/ notation. */
-char *real_dir_from_tilde(const char *buf)
+#ifndef NANO_TINY
+/* Read the file filename into a buffer of its own, replace all the
+ * matches of needle in it with answer, and, if anything was replaced,
+ * write it back, making a backup first if backups are turned on.  Put
+ * the number of replacements, or what went wrong, in result. */
+static void replace_in_file(const char *filename, const char *needle,
+	replaceresult *result)
 {
-    char *retval;
+    FILE *f;
+    int fd;
 
-    assert(buf != NULL);
+    result->count = -1;
+    result->errnum = 0;
 
-    if (*buf == '~') {
-	size_t i = 1;
-	char *tilde_dir;
+    errno = 0;
+    fd = open_file(filename, FALSE, &f);
+    if (fd <= 0) {
+	result->errnum = errno;
+	return;
+    }
 
-	/* Figure out how much of the string we need to compare. */
-	for (; buf[i] != '/' && buf[i] != '\0'; i++)
-	    ;
+    make_new_buffer();
+    openfile->filename = mallocstrcpy(openfile->filename, filename);
+    read_file(f, fd, filename, FALSE, FALSE);
 
-	/* Get the home directory. */
-	if (i == 1) {
+    openfile->current_stat = (struct stat *)nmalloc(sizeof(struct stat));
+    stat(filename, openfile->current_stat);
+
+    /* Replacing doesn't keep the lengths of lines up to date. */
+    hold_lengths();
+
+    result->count = replace_in_buffer(needle);
+
+    if (result->count > 0) {
+	errno = 0;
+	if (!write_file(filename, NULL, FALSE, OVERWRITE, TRUE)) {
+	    result->count = -2;
+	    result->errnum = errno;
+	}
+    }
+
+    release_lengths();
+
+    delete_opennode(openfile);
+    openfile = NULL;
+}
+
+/* Do the replacements in the files whose numbers come through the pipe
+ * tasks, and send the results back through the pipe results, until
+ * there are no more files.  This is what each worker process does. */
+static void replace_worker(char **names, const char *needle, int tasks,
+	int results)
+{
+    size_t i;
+
+    while (read(tasks, &i, sizeof(i)) == sizeof(i)) {
+	replaceresult result;
+
+	replace_in_file(names[i], needle, &result);
+	result.index = i;
+
+	if (write(results, &result, sizeof(result)) != sizeof(result))
+	    break;
+    }
+}
+
+/* Add the regular files in the directory path to names, which holds
+ * *count of them so far, in the order the file browser would list
+ * them.  Return the new names. */
+static char **add_directory_files(char **names, size_t *count, const
+	char *path)
+{
+    DIR *dir = opendir(path);
+    const struct dirent *entry;
+    size_t first = *count;
+
+    if (dir == NULL)
+	return names;
+
+    while ((entry = readdir(dir)) != NULL) {
+	char *name = charalloc(strlen(path) + strlen(entry->d_name) + 2);
+	struct stat fileinfo;
+
+	sprintf(name, "%s/%s", path, entry->d_name);
+
+	if (stat(name, &fileinfo) == -1 || !S_ISREG(fileinfo.st_mode)) {
+	    free(name);
+	    continue;
+	}
+
+	names = (char **)nrealloc(names, (*count + 1) * sizeof(char *));
+	names[(*count)++] = name;
+    }
+
+    closedir(dir);
+
+#if !defined(DISABLE_TABCOMP) || !defined(DISABLE_BROWSER)
+    qsort(names + first, *count - first, sizeof(char *), diralphasort);
+#endif
+
+    return names;
+}
+
+/* Replace all the matches of needle with replacement in the files named
+ * in args, without starting curses, and say on standard output how many
+ * replacements were made in each.  A directory stands for the regular
+ * files in it.  Each file is read, changed and written by the usual
+ * read_file(), replace_all() and write_file(), so the search options
+ * and backups work as in the editor.  The files are handed out to a
+ * pool of worker processes, one per processor, since all of those work
+ * on the current buffer.  Return the exit status: 0 if every file was
+ * handled, 1 otherwise. */
+int replace_in_files(const char *needle, const char *replacement, char
+	**args, int nargs)
+{
+    char **names = NULL;
+    size_t count = 0, nworkers, started = 0, i, sent = 0, got = 0;
+    size_t total = 0;
+    replaceresult *results;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int tasks[2], done[2], status = 0;
+    int n;
+
+    for (n = 0; n < nargs; n++) {
+	struct stat fileinfo;
+
+	/* Skip the +LINE,COLUMN arguments. */
+	if (args[n][0] == '+')
+	    continue;
+
+	if (stat(args[n], &fileinfo) != -1 && S_ISDIR(fileinfo.st_mode))
+	    names = add_directory_files(names, &count, args[n]);
+	else {
+	    names = (char **)nrealloc(names, (count + 1) *
+		sizeof(char *));
+	    names[count++] = mallocstrcpy(NULL, args[n]);
+	}
+    }
+
+    if (count == 0) {
+	fprintf(stderr, _("No files to replace in\n"));
+	return 1;
+    }
+
+#ifdef HAVE_REGEX_H
+    if (ISSET(USE_REGEXP)) {
+	char *errmsg = NULL;
+
+	search_regexp = regexp_cache_get(needle, REG_EXTENDED |
+		(ISSET(CASE_SENSITIVE) ? 0 : REG_ICASE), &errmsg);
+	if (search_regexp == NULL) {
+	    fprintf(stderr, _("Bad regex \"%s\": %s"), needle, errmsg);
+	    fprintf(stderr, "\n");
+	    return 1;
+	}
+    }
+#endif
+
+    /* Each buffer is thrown away after writing it, so there's nothing
+     * to undo and no other buffer to read into. */
+    UNSET(UNDOABLE);
+#ifdef ENABLE_MULTIBUFFER
+    UNSET(MULTIBUFFER);
+#endif
+    answer = mallocstrcpy(answer, replacement);
+    last_replace = mallocstrcpy(last_replace, replacement);
+
+    results = (replaceresult *)nmalloc(count * sizeof(replaceresult));
+
+    nworkers = (ncpus < 1) ? 1 : ncpus;
+    if (nworkers > count)
+	nworkers = count;
+
+    /* A file that no worker reports on counts as unreadable. */
+    for (i = 0; i < count; i++) {
+	results[i].count = -1;
+	results[i].errnum = 0;
+    }
+
+    if (nworkers > 1) {
+	if (pipe(tasks) == -1)
+	    nworkers = 1;
+	else if (pipe(done) == -1) {
+	    close(tasks[0]);
+	    close(tasks[1]);
+	    nworkers = 1;
+	}
+    }
+
+    if (nworkers > 1) {
+	for (; started < nworkers; started++) {
+	    pid_t pid = fork();
+
+	    if (pid == 0) {
+		close(tasks[1]);
+		close(done[0]);
+		replace_worker(names, needle, tasks[0], done[1]);
+		_exit(0);
+	    } else if (pid == -1)
+		break;
+	}
+
+	close(tasks[0]);
+	close(done[1]);
+
+	if (started == 0) {
+	    close(tasks[1]);
+	    close(done[0]);
+	}
+    }
+
+    if (started > 0) {
+	/* If the workers are all gone, writing to them shouldn't kill
+	 * us. */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Hand out the file numbers while collecting the results, so
+	 * that neither pipe can fill up with nobody reading it.  Each
+	 * number and each result is written in one go, so the workers
+	 * can share the pipes. */
+	while (got < count) {
+	    struct pollfd fds[2];
+	    nfds_t nfds = 0;
+
+	    fds[nfds].fd = done[0];
+	    fds[nfds++].events = POLLIN;
+	    if (sent < count) {
+		fds[nfds].fd = tasks[1];
+		fds[nfds++].events = POLLOUT;
+	    }
+
+	    if (poll(fds, nfds, -1) == -1) {
+		if (errno == EINTR)
+		    continue;
+		break;
+	    }
+
+	    if (nfds > 1 && (fds[1].revents & POLLOUT)) {
+		if (write(tasks[1], &sent, sizeof(sent)) != sizeof(sent))
+		    break;
+		if (++sent == count)
+		    close(tasks[1]);
+	    }
+
+	    if (fds[0].revents & (POLLIN | POLLHUP)) {
+		replaceresult result;
+
+		if (read(done[0], &result, sizeof(result)) !=
+			sizeof(result))
+		    break;
+		results[result.index] = result;
+		got++;
+	    }
+	}
+
+	if (sent < count)
+	    close(tasks[1]);
+	close(done[0]);
+
+	while (wait(NULL) > 0)
+	    ;
+    } else {
+	for (i = 0; i < count; i++) {
+	    replace_in_file(names[i], needle, &results[i]);
+	    results[i].index = i;
+	}
+    }
+
+    for (i = 0; i < count; i++) {
+	if (results[i].count >= 0) {
+	    printf(P_("%s: %ld replacement\n", "%s: %ld replacements\n",
+		(unsigned long)results[i].count), names[i],
+		(long)results[i].count);
+	    total += results[i].count;
+	} else {
+	    fprintf(stderr, (results[i].count == -1) ?
+		_("%s: could not be read") : _("%s: could not be written"),
+		names[i]);
+	    if (results[i].errnum != 0)
+		fprintf(stderr, ": %s", strerror(results[i].errnum));
+	    fprintf(stderr, "\n");
+	    status = 1;
+	}
+    }
+
+    printf(P_("Replaced %lu occurrence in %lu file(s)\n",
+	"Replaced %lu occurrences in %lu file(s)\n",
+	(unsigned long)total), (unsigned long)total,
+	(unsigned long)count);
+
+#ifdef HAVE_REGEX_H
+    regexp_cleanup();
+#endif
+    free(results);
+    for (i = 0; i < count; i++)
+	free(names[i]);
+    free(names);
+
+    return status;
+}
+#endif /* !NANO_TINY */
+
+#ifndef NANO_TINY
+/* What every journal starts with. */
+static const char journal_magic[] = "GNU nano journal 1\n";
+
+/* Write the length of s and then s itself to the journal f.  Return
+ * FALSE if that fails. */
+static bool journal_put_line(FILE *f, const char *s)
+{
+    size_t len = strlen(s);
+
+    return (fwrite(&len, sizeof(size_t), 1, f) == 1 &&
+	fwrite(s, 1, len, f) == len);
+}
+
+/* Read a line written by journal_put_line() from the journal f into a
+ * new node after *bot, and make that node the new *bot.  Return FALSE
+ * if that fails. */
+static bool journal_get_line(FILE *f, filestruct **bot)
+{
+    filestruct *line;
+    size_t len;
+
+    if (fread(&len, sizeof(size_t), 1, f) != 1)
+	return FALSE;
+
+    line = make_new_node(*bot);
+    line->data = charalloc(len + 1);
+
+    if (fread(line->data, 1, len, f) != len) {
+	delete_node(line);
+	return FALSE;
+    }
+
+    line->data[len] = '\0';
+    if (*bot != NULL)
+	(*bot)->next = line;
+    *bot = line;
+
+    return TRUE;
+}
+
+/* Get the size and modification time of the current file as it is on
+ * disk, or zeroes if it isn't there. */
+static void journal_stamp(off_t *size, time_t *mtime)
+{
+    *size = 0;
+    *mtime = 0;
+
+    if (openfile->current_stat != NULL) {
+	*size = openfile->current_stat->st_size;
+	*mtime = openfile->current_stat->st_mtime;
+    }
+}
+
+/* Note that the journal of the current buffer has seen all of its text
+ * as it is now. */
+static void journal_caught_up(void)
+{
+    openfile->journal_lines = openfile->filebot->lineno;
+    openfile->journal_changed.head = (size_t)-1;
+    openfile->journal_changed.tail = (size_t)-1;
+    openfile->journal_version = openfile->version;
+}
+
+/* Work out the name of the journal of the current buffer.  Return FALSE
+ * if the buffer shouldn't have a journal. */
+static bool name_journal(void)
+{
+    if (!ISSET(JOURNAL) || ISSET(RESTRICTED) || ISSET(VIEW_MODE) ||
+	openfile->filename[0] == '\0')
+	return FALSE;
+
+    openfile->journal_name = charalloc(strlen(openfile->filename) + 9);
+    sprintf(openfile->journal_name, "%s.journal", openfile->filename);
+
+    return TRUE;
+}
+
+/* Stop keeping a journal for the current buffer, and delete the journal
+ * if remove is TRUE and we made it or took it over. */
+static void stop_journal(bool remove)
+{
+    if (openfile->journal != NULL) {
+	if (remove)
+	    unlink(openfile->journal_name);
+	fclose(openfile->journal);
+	openfile->journal = NULL;
+    }
+
+    if (openfile->journal_name != NULL) {
+	free(openfile->journal_name);
+	openfile->journal_name = NULL;
+    }
+
+    openfile->journal_failed = FALSE;
+    openfile->journal_lines = 0;
+}
+
+/* Make the journal of the current buffer, holding nothing yet but which
+ * file on disk it's for.  Return FALSE if that can't be done, in which
+ * case the buffer goes without a journal. */
+static bool start_journal(void)
+{
+    FILE *f = NULL;
+    off_t size;
+    time_t mtime;
+    int fd;
+
+    journal_stamp(&size, &mtime);
+
+    /* The journal holds the text of the file, so it's only for us.  One
+     * that is there already was made by another nano, which may still
+     * be adding to it, or may have left it behind for recovery. */
+    fd = open(openfile->journal_name, O_WRONLY | O_CREAT | O_EXCL,
+	S_IRUSR | S_IWUSR);
+    if (fd == -1 && errno == EEXIST) {
+	statusbar(_("Journal %s is in use, so it was left alone"),
+		openfile->journal_name);
+	stop_journal(FALSE);
+	return FALSE;
+    }
+
+    /* Hold the journal for as long as we add to it, so that another
+     * nano can tell that it's not left behind. */
+    if (fd != -1 && (flock(fd, LOCK_EX | LOCK_NB) == -1 ||
+	(f = fdopen(fd, "wb")) == NULL))
+	close(fd);
+
+    if (f == NULL || fwrite(journal_magic, 1, sizeof(journal_magic) - 1,
+	f) != sizeof(journal_magic) - 1 || fwrite(&size, sizeof(off_t),
+	1, f) != 1 || fwrite(&mtime, sizeof(time_t), 1, f) != 1 ||
+	fflush(f) != 0) {
+	statusbar(_("Error writing journal %s: %s"),
+		openfile->journal_name, strerror(errno));
+	if (fd != -1)
+	    unlink(openfile->journal_name);
+	if (f != NULL)
+	    fclose(f);
+	stop_journal(FALSE);
+	return FALSE;
+    }
+
+    openfile->journal = f;
+
+    return TRUE;
+}
+
+/* Return TRUE if the journal f is for the file of the current buffer as
+ * it is on disk now. */
+static bool journal_fits(FILE *f)
+{
+    char magic[sizeof(journal_magic) - 1];
+    off_t size, disk_size;
+    time_t mtime, disk_mtime;
+
+    journal_stamp(&disk_size, &disk_mtime);
+
+    return (fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+	memcmp(magic, journal_magic, sizeof(magic)) == 0 &&
+	fread(&size, sizeof(off_t), 1, f) == 1 &&
+	fread(&mtime, sizeof(time_t), 1, f) == 1 &&
+	size == disk_size && mtime == disk_mtime);
+}
+
+/* Apply the changes kept in the journal f, from just after what
+ * journal_fits() read on, to the current buffer, which holds the file
+ * as it is on disk.  Set *good to the end of the last change that could
+ * be read in full, and *count to the number of changes. */
+static void replay_journal(FILE *f, off_t *good, size_t *count)
+{
+    filestruct *line = openfile->fileage;
+	/* The line at index pos. */
+    size_t nlines = openfile->filebot->lineno, pos = 0;
+
+    *good = ftello(f);
+    *count = 0;
+
+    while (TRUE) {
+	filestruct *top = NULL, *bot = NULL, *prev, *next;
+	size_t at, oldcount, newcount, total, i;
+
+	if (fread(&at, sizeof(size_t), 1, f) != 1 ||
+		fread(&oldcount, sizeof(size_t), 1, f) != 1 ||
+		fread(&newcount, sizeof(size_t), 1, f) != 1)
+	    break;
+
+	for (i = 0; i < newcount; i++) {
+	    if (!journal_get_line(f, &bot))
+		break;
+	    if (top == NULL)
+		top = bot;
+	}
+
+	/* A change that was cut short when nano died, or that doesn't
+	 * fit, is where the journal ends. */
+	if (i < newcount || fread(&total, sizeof(size_t), 1, f) != 1 ||
+		at > nlines || oldcount > nlines - at || total !=
+		nlines - oldcount + newcount || total == 0) {
+	    if (top != NULL)
+		free_filestruct(top);
+	    break;
+	}
+
+	while (pos < at) {
+	    line = line->next;
+	    pos++;
+	}
+	while (pos > at) {
+	    line = (line == NULL) ? openfile->filebot : line->prev;
+	    pos--;
+	}
+
+	prev = (line != NULL) ? line->prev : openfile->filebot;
+	for (i = 0; i < oldcount; i++) {
+	    next = line->next;
+	    delete_node(line);
+	    line = next;
+	}
+	next = line;
+
+	if (top != NULL) {
+	    top->prev = prev;
+	    bot->next = next;
+	    line = top;
+	} else {
+	    top = next;
+	    bot = prev;
+	}
+	if (prev != NULL)
+	    prev->next = top;
+	else
+	    openfile->fileage = top;
+	if (next != NULL)
+	    next->prev = bot;
+	else
+	    openfile->filebot = bot;
+
+	nlines = total;
+	*good = ftello(f);
+	(*count)++;
+    }
+
+    renumber(openfile->fileage);
+    openfile->totsize = get_totsize(openfile->fileage,
+	openfile->filebot);
+    openfile->current = openfile->fileage;
+    openfile->edittop = openfile->fileage;
+    openfile->current_x = 0;
+    openfile->placewewant = 0;
+    if (*count > 0) {
+	openfile->modified = TRUE;
+	openfile->version++;
+	mark_changed(openfile->fileage, openfile->filebot);
+    }
+}
+
+/* Stop looking at the journal f of the current buffer, which another
+ * nano made, and go without one, saying why with msg. */
+static void leave_journal(FILE *f, const char *msg)
+{
+    fclose(f);
+    statusbar(msg, openfile->journal_name);
+    free(openfile->journal_name);
+    openfile->journal_name = NULL;
+}
+
+/* Start keeping a journal of the changes made to the current buffer,
+ * if journals are turned on and the buffer has a name.  The journal
+ * itself is only made once there is a change to put in it.  If it is
+ * already there, because nano died before the changes in it were
+ * saved, offer to apply those changes to the buffer first. */
+void open_journal(void)
+{
+    FILE *f;
+    off_t good;
+    size_t count;
+    int fd;
+
+    if (!name_journal())
+	return;
+
+    journal_caught_up();
+
+    fd = open(openfile->journal_name, O_RDWR);
+    if (fd == -1)
+	return;
+
+    /* A journal that another nano still holds is not left behind. */
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1 || (f = fdopen(fd,
+	"r+b")) == NULL) {
+	close(fd);
+	statusbar(_("Journal %s is in use, so it was left alone"),
+		openfile->journal_name);
+	free(openfile->journal_name);
+	openfile->journal_name = NULL;
+	return;
+    }
+
+    /* An undo item may refer to the lines the journal would change, so
+     * only a freshly read file is recovered. */
+    if (openfile->undotop != NULL || !journal_fits(f)) {
+	leave_journal(f,
+		_("Journal %s is not for this file, so it was left alone"));
+	return;
+    }
+
+    if (do_yesno_prompt(FALSE,
+	_("Unsaved changes to this file were kept, recover them ? ")) != 1) {
+	leave_journal(f, _("Journal %s was left alone"));
+	return;
+    }
+
+    replay_journal(f, &good, &count);
+
+    /* Drop any change that was cut short, and add on after the rest. */
+    if (ftruncate(fileno(f), good) == -1 || fseeko(f, good,
+	SEEK_SET) == -1) {
+	statusbar(_("Error writing journal %s: %s"),
+		openfile->journal_name, strerror(errno));
+	fclose(f);
+	free(openfile->journal_name);
+	openfile->journal_name = NULL;
+	return;
+    }
+
+    openfile->journal = f;
+    journal_caught_up();
+
+    statusbar(P_("Recovered %lu change from %s",
+	"Recovered %lu changes from %s", (unsigned long)count),
+	(unsigned long)count, openfile->journal_name);
+}
+
+/* Write the lines of the current buffer that have changed since its
+ * journal last saw them to the end of the journal, as one change: the
+ * first and the last of those lines, and everything in between, making
+ * the journal first if there isn't one yet.  Return TRUE if the journal
+ * now has all the changes to the buffer. */
+bool flush_journal(void)
+{
+    FILE *f;
+    const filestruct *first;
+    size_t n, m = openfile->journal_lines;
+    size_t top = openfile->journal_changed.head;
+    size_t bottom = openfile->journal_changed.tail;
+    size_t oldcount, newcount, i;
+    bool ok;
+
+    if (openfile->journal_name == NULL || openfile->journal_failed)
+	return FALSE;
+
+    if (openfile->journal_version == openfile->version)
+	return TRUE;
+
+    n = openfile->filebot->lineno;
+
+    /* Whatever was noted beyond the ends of the buffer, now or as the
+     * journal last saw it, doesn't count. */
+    if (top > m)
+	top = m;
+    if (top > n)
+	top = n;
+    if (bottom > (m < n ? m : n) - top)
+	bottom = (m < n ? m : n) - top;
+
+    if (m == n && top + bottom == n) {
+	journal_caught_up();
+	return TRUE;
+    }
+
+    if (openfile->journal == NULL && !start_journal())
+	return FALSE;
+
+    f = openfile->journal;
+    oldcount = m - top - bottom;
+    newcount = n - top - bottom;
+
+    /* Go to the first changed line from whichever end is nearer. */
+    if (top < n / 2)
+	for (first = openfile->fileage, i = 0; i < top; i++)
+	    first = first->next;
+    else
+	for (first = openfile->filebot, i = n - 1; i > top; i--)
+	    first = first->prev;
+
+    ok = (fwrite(&top, sizeof(size_t), 1, f) == 1 &&
+	fwrite(&oldcount, sizeof(size_t), 1, f) == 1 &&
+	fwrite(&newcount, sizeof(size_t), 1, f) == 1);
+    for (i = 0; ok && i < newcount; first = first->next, i++)
+	ok = journal_put_line(f, first->data);
+    if (ok)
+	ok = (fwrite(&n, sizeof(size_t), 1, f) == 1 && fflush(f) == 0);
+
+    if (!ok) {
+	/* Keep what the journal has so far, but don't add to it. */
+	statusbar(_("Error writing journal %s: %s"),
+		openfile->journal_name, strerror(errno));
+	openfile->journal_failed = TRUE;
+	return FALSE;
+    }
+
+    journal_caught_up();
+
+    return TRUE;
+}
+
+/* Return TRUE if the journal of any buffer is missing some changes. */
+bool journals_pending(void)
+{
+    const openfilestruct *of = openfile;
+
+    if (of == NULL || filepart != NULL)
+	return FALSE;
+
+    do {
+	if (of->journal_name != NULL && !of->journal_failed &&
+		of->journal_version != of->version)
+	    return TRUE;
+	of = of->next;
+    } while (of != openfile);
+
+    return FALSE;
+}
+
+/* Bring the journals of all buffers up to date. */
+void flush_journals(void)
+{
+    openfilestruct *start = openfile;
+
+    /* The journal has to see the line with the gap at the cursor as
+     * one piece. */
+    close_gap();
+
+    do {
+	flush_journal();
+	openfile = openfile->next;
+    } while (openfile != start);
+}
+
+/* Start the journal of the current buffer over, now that the whole
+ * buffer has been written out, possibly under another name. */
+void restart_journal(void)
+{
+    stop_journal(TRUE);
+
+    if (name_journal())
+	journal_caught_up();
+}
+
+/* Delete the journal of the current buffer, as its changes are either
+ * saved or not wanted. */
+void discard_journal(void)
+{
+    stop_journal(TRUE);
+}
+#endif /* !NANO_TINY */
+
+/* Return a malloc()ed string containing the actual directory, used to
+ * convert ~user/ and ~/ notation. */
+char *real_dir_from_tilde(const char *buf)
+{
+    char *retval;
+
+    assert(buf != NULL);
+
+    if (*buf == '~') {
+	size_t i = 1;
+	char *tilde_dir;
+
+	/* Figure out how much of the string we need to compare. */
+	for (; buf[i] != '/' && buf[i] != '\0'; i++)
+	    ;
+
+	/* Get the home directory. */
+	if (i == 1) {
 	    get_homedir();
 	    tilde_dir = mallocstrcpy(NULL, homedir);
 	} else {
@@ -2724,7 +3944,9 @@ void load_history(void)
 }
 
 /* Write the lines of a history list, starting with the line at h, to
- * the open file at hist.  Return TRUE if the write succeeded, and FALSE
+ * the open file at hist.  NULs in an entry are kept as newlines, so
+ * they're written as NULs piece by piece instead of converting the
+ * entry in place.  Return TRUE if the write succeeded, and FALSE
  * otherwise. */
 bool writehist(FILE *hist, filestruct *h)
 {
@@ -2733,12 +3955,21 @@ bool writehist(FILE *hist, filestruct *h)
     /* Write a history list from the oldest entry to the newest.  Assume
      * the last history entry is a blank line. */
     for (p = h; p != NULL; p = p->next) {
-	size_t p_len = strlen(p->data);
+	const char *data = p->data;
 
-	sunder(p->data);
+	while (TRUE) {
+	    size_t len = strcspn(data, "\n");
+
+	    if (fwrite(data, sizeof(char), len, hist) < len)
+		return FALSE;
+	    if (data[len] == '\0')
+		break;
+	    if (putc('\0', hist) == EOF)
+		return FALSE;
+	    data += len + 1;
+	}
 
-	if (fwrite(p->data, sizeof(char), p_len, hist) < p_len ||
-		putc('\n', hist) == EOF)
+	if (putc('\n', hist) == EOF)
 	    return FALSE;
     }
 
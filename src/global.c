@@ -90,6 +90,24 @@ openfilestruct *openfile = NULL;
 char *matchbrackets = NULL;
 	/* The opening and closing brackets that can be found by bracket
 	 * searches. */
+ssize_t undo_budget = UNDO_BUDGET;
+	/* How many kilobytes the undo items of a buffer may take up in
+	 * memory, or zero for no limit. */
+ssize_t cut_budget = CUT_BUDGET;
+	/* How many kilobytes the cutbuffer may take up in memory, or zero
+	 * for no limit. */
+FILE *cut_spill = NULL;
+	/* The file where the text of a cutbuffer that's too big is
+	 * written out to. */
+spillrange *cut_spill_range = NULL;
+	/* The range of the cut spill file that the text of the cutbuffer
+	 * is in, if any. */
+size_t cut_spill_lines = 0;
+	/* How many lines of text come before the cutbuffer, from the cut
+	 * spill file. */
+filemap *filemaps = NULL;
+	/* The mappings that files were read into, while lines still have
+	 * their text in them. */
 #endif
 
 #if !defined(NANO_TINY) && defined(ENABLE_NANORC)
@@ -153,6 +171,8 @@ syntaxtype *syntaxes = NULL;
 	/* The global list of color syntaxes. */
 char *syntaxstr = NULL;
 	/* The color syntax name specified on the command line. */
+int most_multis = 0;
+	/* The most multi-line regexes that any syntax has. */
 
 #endif
 
@@ -187,7 +207,7 @@ filestruct *replacebot = NULL;
 
 /* Regular expressions. */
 #ifdef HAVE_REGEX_H
-regex_t search_regexp;
+regex_t *search_regexp = NULL;
 	/* The compiled regular expression to use in searches. */
 regmatch_t regmatches[10];
 	/* The match positions for parenthetical subexpressions, 10
@@ -662,6 +682,13 @@ void shortcut_init(bool unjustify)
 #ifndef NANO_TINY
     const char *nano_mark_msg = N_("Mark text at the cursor position");
     const char *nano_whereis_next_msg = N_("Repeat last search");
+    const char *nano_findall_msg =
+	N_("Count all occurrences of the last search string");
+#ifdef ENABLE_MULTIBUFFER
+    const char *nano_findinbuffers_msg =
+	N_("List the occurrences of the last search string in all buffers");
+    const char *nano_exitlist_msg = N_("Exit from the list of occurrences");
+#endif
     const char *nano_copy_msg =
 	N_("Copy the current line and store it in the cutbuffer");
     const char *nano_indent_msg = N_("Indent the current line");
@@ -803,6 +830,10 @@ void shortcut_init(bool unjustify)
 #ifndef DISABLE_BROWSER
     add_to_funcs(DO_EXIT, MBROWSER, exit_msg, IFSCHELP(nano_exitbrowser_msg), FALSE, VIEW);
 #endif
+#if !defined(NANO_TINY) && defined(ENABLE_MULTIBUFFER)
+    add_to_funcs(DO_EXIT, MFINDLIST, exit_msg, IFSCHELP(nano_exitlist_msg),
+	FALSE, VIEW);
+#endif
 
     /* TRANSLATORS: Try to keep this at most 10 characters. */
     add_to_funcs(DO_WRITEOUT_VOID, MMAIN, N_("WriteOut"),
@@ -832,9 +863,9 @@ void shortcut_init(bool unjustify)
     add_to_funcs(DO_SEARCH, MMAIN|MBROWSER, whereis_msg,
 	IFSCHELP(nano_whereis_msg), FALSE, VIEW);
 
-    add_to_funcs(DO_PAGE_UP, MMAIN|MHELP|MBROWSER,
+    add_to_funcs(DO_PAGE_UP, MMAIN|MHELP|MBROWSER|MFINDLIST,
 	prev_page_msg, IFSCHELP(nano_prevpage_msg), FALSE, VIEW);
-    add_to_funcs(DO_PAGE_DOWN, MMAIN|MHELP|MBROWSER,
+    add_to_funcs(DO_PAGE_DOWN, MMAIN|MHELP|MBROWSER|MFINDLIST,
 	next_page_msg, IFSCHELP(nano_nextpage_msg), TRUE, VIEW);
 
     add_to_funcs(directory, MMOST, N_("directory"), IFSCHELP(directoryy), TOGETHER, VIEW);
@@ -903,6 +934,14 @@ void shortcut_init(bool unjustify)
     add_to_funcs(DO_RESEARCH, (MMAIN|MBROWSER), whereis_next_msg,
 	IFSCHELP(nano_whereis_next_msg), TRUE, VIEW);
 
+    add_to_funcs(DO_FIND_ALL, MMAIN, N_("Find All"),
+	IFSCHELP(nano_findall_msg), FALSE, VIEW);
+
+#ifdef ENABLE_MULTIBUFFER
+    add_to_funcs(DO_FIND_IN_BUFFERS, MMAIN, N_("Find in Buffers"),
+	IFSCHELP(nano_findinbuffers_msg), FALSE, VIEW);
+#endif
+
     add_to_funcs(DO_COPY_TEXT, MMAIN, N_("Copy Text"),
 	IFSCHELP(nano_copy_msg), FALSE, NOVIEW);
 
@@ -950,10 +989,10 @@ void shortcut_init(bool unjustify)
 	IFSCHELP(nano_prevword_msg), FALSE, VIEW);
 #endif
 
-    add_to_funcs(DO_UP_VOID, (MMAIN|MHELP|MBROWSER), N_("Prev Line"),
+    add_to_funcs(DO_UP_VOID, (MMAIN|MHELP|MBROWSER|MFINDLIST), N_("Prev Line"),
 	IFSCHELP(nano_prevline_msg), FALSE, VIEW);
 
-    add_to_funcs(DO_DOWN_VOID, (MMAIN|MHELP|MBROWSER), N_("Next Line"),
+    add_to_funcs(DO_DOWN_VOID, (MMAIN|MHELP|MBROWSER|MFINDLIST), N_("Next Line"),
 	IFSCHELP(nano_nextline_msg), TRUE, VIEW);
 
     add_to_funcs(DO_HOME, MMAIN, N_("Home"), IFSCHELP(nano_home_msg),
@@ -1162,8 +1201,8 @@ void shortcut_init(bool unjustify)
 	"^G", DO_HELP_VOID, 0, TRUE);
     add_to_sclist(MMAIN|MWHEREIS|MREPLACE|MREPLACE2|MGOTOLINE|MWRITEFILE|MINSERTFILE|MEXTCMD|MSPELL|MBROWSER|MWHEREISFILE|MGOTODIR,
 	"F1", DO_HELP_VOID, 0, TRUE);
-    add_to_sclist(MMAIN|MHELP|MBROWSER, "^X", DO_EXIT, 0, TRUE);
-    add_to_sclist(MMAIN|MHELP|MBROWSER, "F2", DO_EXIT, 0, TRUE);
+    add_to_sclist(MMAIN|MHELP|MBROWSER|MFINDLIST, "^X", DO_EXIT, 0, TRUE);
+    add_to_sclist(MMAIN|MHELP|MBROWSER|MFINDLIST, "F2", DO_EXIT, 0, TRUE);
     add_to_sclist(MMAIN, "^N", 0, directory, 0);	
     add_to_sclist(MMAIN, "^_", DO_GOTOLINECOLUMN_VOID, 0, TRUE);
     add_to_sclist(MMAIN, "F13", DO_GOTOLINECOLUMN_VOID, 0, TRUE);
@@ -1179,12 +1218,12 @@ void shortcut_init(bool unjustify)
     add_to_sclist(MMAIN, "kinsert", DO_INSERTFILE_VOID, 0, TRUE);
     add_to_sclist(MMAIN|MBROWSER, "^W", DO_SEARCH, 0, TRUE);
     add_to_sclist(MMAIN|MBROWSER, "F6", DO_SEARCH, 0, TRUE);
-    add_to_sclist(MMAIN|MBROWSER|MHELP|MWHEREISFILE, "^Y", DO_PAGE_UP, 0, TRUE);
-    add_to_sclist(MMAIN|MBROWSER|MHELP|MWHEREISFILE, "F7", DO_PAGE_UP, 0, TRUE);
-    add_to_sclist(MMAIN|MBROWSER|MHELP|MWHEREISFILE, "kpup", DO_PAGE_UP, 0, TRUE);
-    add_to_sclist(MMAIN|MBROWSER|MHELP|MWHEREISFILE, "^V", DO_PAGE_DOWN, 0, TRUE);
-    add_to_sclist(MMAIN|MBROWSER|MHELP|MWHEREISFILE, "F8", DO_PAGE_DOWN, 0, TRUE);
-    add_to_sclist(MMAIN|MBROWSER|MHELP|MWHEREISFILE, "kpdown", DO_PAGE_DOWN, 0, TRUE);
+    add_to_sclist(MMAIN|MBROWSER|MHELP|MWHEREISFILE|MFINDLIST, "^Y", DO_PAGE_UP, 0, TRUE);
+    add_to_sclist(MMAIN|MBROWSER|MHELP|MWHEREISFILE|MFINDLIST, "F7", DO_PAGE_UP, 0, TRUE);
+    add_to_sclist(MMAIN|MBROWSER|MHELP|MWHEREISFILE|MFINDLIST, "kpup", DO_PAGE_UP, 0, TRUE);
+    add_to_sclist(MMAIN|MBROWSER|MHELP|MWHEREISFILE|MFINDLIST, "^V", DO_PAGE_DOWN, 0, TRUE);
+    add_to_sclist(MMAIN|MBROWSER|MHELP|MWHEREISFILE|MFINDLIST, "F8", DO_PAGE_DOWN, 0, TRUE);
+    add_to_sclist(MMAIN|MBROWSER|MHELP|MWHEREISFILE|MFINDLIST, "kpdown", DO_PAGE_DOWN, 0, TRUE);
     add_to_sclist(MMAIN, "^K", DO_CUT_TEXT_VOID, 0, TRUE);
     add_to_sclist(MMAIN, "F9", DO_CUT_TEXT_VOID, 0, TRUE);
     add_to_sclist(MMAIN, "^U", DO_UNCUT_TEXT, 0, TRUE);
@@ -1208,6 +1247,10 @@ void shortcut_init(bool unjustify)
     add_to_sclist(MMAIN, "M-A", DO_MARK, 0, TRUE);
     add_to_sclist(MMAIN|MBROWSER, "M-W", DO_RESEARCH, 0, TRUE);
     add_to_sclist(MMAIN|MBROWSER, "F16", DO_RESEARCH, 0, TRUE);
+    add_to_sclist(MMAIN, "M-7", DO_FIND_ALL, 0, TRUE);
+#ifdef ENABLE_MULTIBUFFER
+    add_to_sclist(MMAIN, "M-8", DO_FIND_IN_BUFFERS, 0, TRUE);
+#endif
     add_to_sclist(MMAIN, "M-^", DO_COPY_TEXT, 0, TRUE);
     add_to_sclist(MMAIN, "M-6", DO_COPY_TEXT, 0, TRUE);
     add_to_sclist(MMAIN, "M-}", DO_INDENT_VOID, 0, TRUE);
@@ -1225,10 +1268,10 @@ void shortcut_init(bool unjustify)
     add_to_sclist(MALL, "kleft", DO_LEFT, 0, TRUE);
     add_to_sclist(MMAIN, "^Q", XON_COMPLAINT, 0, TRUE);
     add_to_sclist(MMAIN, "^S", XOFF_COMPLAINT, 0, TRUE);
-    add_to_sclist(MMAIN|MHELP|MBROWSER, "^P", DO_UP_VOID, 0, TRUE);
-    add_to_sclist(MMAIN|MHELP|MBROWSER, "kup", DO_UP_VOID, 0, TRUE);
-    add_to_sclist(MMAIN|MHELP|MBROWSER, "^N", DO_DOWN_VOID, 0, TRUE);
-    add_to_sclist(MMAIN|MHELP|MBROWSER, "kdown", DO_DOWN_VOID, 0, TRUE);
+    add_to_sclist(MMAIN|MHELP|MBROWSER|MFINDLIST, "^P", DO_UP_VOID, 0, TRUE);
+    add_to_sclist(MMAIN|MHELP|MBROWSER|MFINDLIST, "kup", DO_UP_VOID, 0, TRUE);
+    add_to_sclist(MMAIN|MHELP|MBROWSER|MFINDLIST, "^N", DO_DOWN_VOID, 0, TRUE);
+    add_to_sclist(MMAIN|MHELP|MBROWSER|MFINDLIST, "kdown", DO_DOWN_VOID, 0, TRUE);
     add_to_sclist(MALL, "^A", DO_HOME, 0, TRUE);
     add_to_sclist(MALL, "khome", DO_HOME, 0, TRUE);
     add_to_sclist(MALL, "^E", DO_END, 0, TRUE);
@@ -1332,8 +1375,8 @@ void shortcut_init(bool unjustify)
     add_to_sclist(MMAIN, "^Z", DO_SUSPEND_VOID, 0, FALSE);
     add_to_sclist(MMAIN, "^L", TOTAL_REFRESH, 0, TRUE);
     add_to_sclist(MALL, "^I", DO_TAB, 0, TRUE);
-    add_to_sclist(MALL, "^M", DO_ENTER, 0, TRUE);
-    add_to_sclist(MALL, "kenter", DO_ENTER, 0, TRUE);
+    add_to_sclist(MALL|MFINDLIST, "^M", DO_ENTER, 0, TRUE);
+    add_to_sclist(MALL|MFINDLIST, "kenter", DO_ENTER, 0, TRUE);
     add_to_sclist(MALL, "^D", DO_DELETE, 0, TRUE);
     add_to_sclist(MALL, "kdel", DO_DELETE, 0, TRUE);
     add_to_sclist(MALL, "^H", DO_BACKSPACE, 0, TRUE);
@@ -1442,6 +1485,12 @@ void iso_me_harder_funcmap(short func)
 	do_mark();
     else if (func == DO_RESEARCH)
 	do_research();
+    else if (func == DO_FIND_ALL)
+	do_find_all();
+#ifdef ENABLE_MULTIBUFFER
+    else if (func == DO_FIND_IN_BUFFERS)
+	do_find_in_buffers();
+#endif
     else if (func == DO_COPY_TEXT)
 	do_copy_text();
     else if (func == DO_INDENT_VOID)
@@ -1601,6 +1650,12 @@ sc *strtosc(int menu, char *input)
     else if (!strcasecmp(input, "searchagain") ||
 		!strcasecmp(input, "research"))
 	s->scfunc = DO_RESEARCH;
+    else if (!strcasecmp(input, "findall"))
+	s->scfunc = DO_FIND_ALL;
+#ifdef ENABLE_MULTIBUFFER
+    else if (!strcasecmp(input, "findinbuffers"))
+	s->scfunc = DO_FIND_IN_BUFFERS;
+#endif
     else if (!strcasecmp(input, "copytext"))
 	s->scfunc = DO_COPY_TEXT;
     else if (!strcasecmp(input, "indent"))
@@ -1888,10 +1943,8 @@ void thanks_for_all_the_fish(void)
 
 	    syntaxes->extensions = bob->next;
 	    free(bob->ext_regex);
-	    if (bob->ext != NULL) {
-		regfree(bob->ext);
-		free(bob->ext);
-	    }
+	    if (bob->ext != NULL)
+		regexp_cache_release(bob->ext);
 	    free(bob);
 	}
 	while (syntaxes->color != NULL) {
@@ -1899,22 +1952,24 @@ void thanks_for_all_the_fish(void)
 
 	    syntaxes->color = bob->next;
 	    free(bob->start_regex);
-	    if (bob->start != NULL) {
-		regfree(bob->start);
-		free(bob->start);
-	    }
+	    if (bob->start != NULL)
+		regexp_cache_release(bob->start);
 	    if (bob->end_regex != NULL)
 		free(bob->end_regex);
-	    if (bob->end != NULL) {
-		regfree(bob->end);
-		free(bob->end);
-	    }
+	    if (bob->end != NULL)
+		regexp_cache_release(bob->end);
 	    free(bob);
 	}
 	syntaxes = syntaxes->next;
 	free(bill);
     }
 #endif /* ENABLE_COLOR */
+#ifndef NANO_TINY
+    set_match_highlight(NULL);
+#endif
+#ifdef HAVE_REGEX_H
+    regexp_cache_free();
+#endif
 #ifndef NANO_TINY
     /* Free the search and replace history lists. */
     if (searchage != NULL)
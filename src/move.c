@@ -194,7 +194,7 @@ void do_para_end(bool allow_update)
 	openfile->current_x = 0;
 	openfile->placewewant = 0;
     } else {
-	openfile->current_x = strlen(openfile->current->data);
+	openfile->current_x = line_len(openfile->current);
 	openfile->placewewant = xplustabs();
     }
 
@@ -475,7 +475,7 @@ void do_end(void)
 {
     size_t pww_save = openfile->placewewant;
 
-    openfile->current_x = strlen(openfile->current->data);
+    openfile->current_x = line_len(openfile->current);
     openfile->placewewant = xplustabs();
 
     if (need_horizontal_update(pww_save))
@@ -639,7 +639,7 @@ void do_left(void)
 		openfile->current_x);
     else if (openfile->current != openfile->fileage) {
 	do_up_void();
-	openfile->current_x = strlen(openfile->current->data);
+	openfile->current_x = line_len(openfile->current);
     }
 
     openfile->placewewant = xplustabs();
@@ -42,6 +42,7 @@
 #endif
 #ifndef NANO_TINY
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #endif
 
 #ifndef DISABLE_MOUSE
@@ -67,9 +68,15 @@ filestruct *make_new_node(filestruct *prevnode)
     newnode->prev = prevnode;
     newnode->next = NULL;
     newnode->lineno = (prevnode != NULL) ? prevnode->lineno + 1 : 1;
+#ifndef NANO_TINY
+    newnode->handle = NULL;
+    newnode->sharers = NULL;
+    newnode->len_stamp = 0;
+#endif
 
 #ifdef ENABLE_COLOR
-    newnode->multidata = NULL;
+    memset(newnode->multidata, -1, sizeof(newnode->multidata));
+    newnode->multimore = NULL;
 #endif
 
     return newnode;
@@ -88,13 +95,164 @@ filestruct *copy_node(const filestruct *src)
     dst->next = src->next;
     dst->prev = src->prev;
     dst->lineno = src->lineno;
+#ifndef NANO_TINY
+    dst->handle = NULL;
+    dst->sharers = NULL;
+    dst->len = src->len;
+    dst->chars = src->chars;
+    dst->len_stamp = src->len_stamp;
+#endif
+#ifdef ENABLE_COLOR
+    memset(dst->multidata, -1, sizeof(dst->multidata));
+    dst->multimore = NULL;
+#endif
+
+    return dst;
+}
+
+#ifndef NANO_TINY
+/* Make a copy of a filestruct node that shares its text with the
+ * original, instead of having a copy of it. */
+filestruct *share_node(filestruct *src)
+{
+    filestruct *dst;
+
+    assert(src != NULL);
+
+    if (src->sharers == NULL) {
+	src->sharers = (size_t *)nmalloc(sizeof(size_t));
+	*src->sharers = 1;
+    }
+    (*src->sharers)++;
+
+    dst = (filestruct *)nmalloc(sizeof(filestruct));
+
+    dst->data = src->data;
+    dst->next = src->next;
+    dst->prev = src->prev;
+    dst->lineno = src->lineno;
+    dst->handle = NULL;
+    dst->sharers = src->sharers;
+    dst->len = src->len;
+    dst->chars = src->chars;
+    dst->len_stamp = src->len_stamp;
 #ifdef ENABLE_COLOR
-    dst->multidata = NULL;
+    memset(dst->multidata, -1, sizeof(dst->multidata));
+    dst->multimore = NULL;
 #endif
 
     return dst;
 }
 
+/* Return the file mapping that lines whose count of sharers is at
+ * sharers have their text in, or NULL if their text isn't in one. */
+static filemap *find_filemap(const size_t *sharers)
+{
+    filemap *map;
+
+    for (map = filemaps; map != NULL; map = map->next) {
+	if (&map->refs == sharers)
+	    break;
+    }
+
+    return map;
+}
+
+/* Let go of a line's claim on the text in the file mapping map, and
+ * unmap the file once no line has its text in it anymore. */
+static void release_filemap(filemap *map)
+{
+    filemap **mapptr;
+
+    if (--map->refs > 0)
+	return;
+
+    for (mapptr = &filemaps; *mapptr != map; mapptr = &(*mapptr)->next)
+	;
+    *mapptr = map->next;
+
+    munmap(map->addr, map->len);
+    free(map);
+}
+
+/* Give a filestruct node its own copy of its text, if it shares it with
+ * other nodes or has it in a file mapping, so that the text can be
+ * changed. */
+void unshare_node(filestruct *fileptr)
+{
+    filemap *map;
+
+    assert(fileptr != NULL);
+
+    if (fileptr->sharers == NULL)
+	return;
+
+    map = find_filemap(fileptr->sharers);
+
+    if (map != NULL) {
+	fileptr->data = mallocstrcpy(NULL, fileptr->data);
+	release_filemap(map);
+    } else if (*fileptr->sharers > 1) {
+	(*fileptr->sharers)--;
+	fileptr->data = mallocstrcpy(NULL, fileptr->data);
+    } else
+	free(fileptr->sharers);
+
+    fileptr->sharers = NULL;
+}
+
+/* Give the current line and the lines on either side of it their own
+ * copies of their text, which is enough for typing, Enter, Backspace
+ * and Delete, as they don't change any other lines. */
+void unshare_current_lines(void)
+{
+    unshare_node(openfile->current);
+    if (openfile->current->prev != NULL)
+	unshare_node(openfile->current->prev);
+    if (openfile->current->next != NULL)
+	unshare_node(openfile->current->next);
+}
+
+/* Give every line of the current buffer that shares its text with the
+ * cutbuffer or with undo items its own copy of it.  This has to be
+ * done before anything else changes the text, as lines are edited in
+ * place all over. */
+void unshare_lines(void)
+{
+    filestruct *fileptr;
+
+    if (!openfile->shared_lines)
+	return;
+
+    for (fileptr = openfile->fileage; fileptr != NULL; fileptr =
+	fileptr->next)
+	unshare_node(fileptr);
+
+    openfile->shared_lines = FALSE;
+}
+
+/* Return TRUE if the function func gives the lines it changes their own
+ * copies of their text itself, so that they needn't all be unshared
+ * before it runs. */
+static bool unshares_itself(short func)
+{
+    return (func == DO_UNCUT_TEXT || func == DO_WRITEOUT_VOID ||
+	func == DO_UNDO || func == DO_REDO || func == DO_INDENT_VOID ||
+	func == DO_UNINDENT || func == DO_JUSTIFY_VOID || func ==
+	DO_FULL_JUSTIFY || func == DO_SPELL);
+}
+
+/* Return TRUE if the function func, which isn't allowed in view mode,
+ * either keeps the lengths of the lines it changes up to date itself,
+ * or doesn't change the text at all. */
+static bool keeps_lengths(short func)
+{
+    return (func == DO_ENTER || func == DO_BACKSPACE || func ==
+	DO_DELETE || func == DO_TAB || func == DO_UNDO || func ==
+	DO_REDO || func == DO_WRITEOUT_VOID);
+}
+#endif
+
 /* Splice a node into an existing filestruct. */
 void splice_node(filestruct *begin, filestruct *newnode, filestruct
 	*end)
@@ -119,36 +277,315 @@ void unlink_node(const filestruct *fileptr)
 	fileptr->next->prev = fileptr->prev;
 }
 
+#ifndef NANO_TINY
+/* The line that has a gap at the cursor, if any.  Its text before the
+ * gap ends at gap_start with a null terminator, so that it reads as the
+ * text before the cursor, and its text after the gap starts at
+ * gap_end.  Typing into the gap or deleting next to it doesn't move the
+ * rest of a long line each time; the gap moves along with the cursor,
+ * and is closed again before anything else looks at the line. */
+static filestruct *gap_line = NULL;
+static size_t gap_start = 0, gap_end = 0;
+
+/* Return TRUE if the current line may have a gap at the cursor: it has
+ * to be long, and nothing may look at its text after the cursor while
+ * text is typed, as wrapping, softwrapping, the mark, the constant
+ * cursor position display, match highlighting and syntax coloring
+ * do. */
+static bool gap_allowed(void)
+{
+    if (gap_line != openfile->current && strlen(openfile->current->data)
+	< LINE_GAP_MIN)
+	return FALSE;
+
+    return (
+#ifndef DISABLE_WRAPPING
+	ISSET(NO_WRAP) &&
+#endif
+	!ISSET(SOFTWRAP) && !ISSET(CONST_UPDATE) &&
+	!ISSET(HIGHLIGHT_MATCHES) && !openfile->mark_set &&
+#ifdef ENABLE_COLOR
+	openfile->colorstrings == NULL &&
+#endif
+	filepart == NULL);
+}
+
+/* Move the gap so that it starts at x in the text of its line. */
+static void move_gap(size_t x)
+{
+    char *data = gap_line->data;
+
+    if (x < gap_start) {
+	charmove(data + gap_end - (gap_start - x), data + x, gap_start -
+		x);
+	gap_end -= gap_start - x;
+    } else if (x > gap_start) {
+	charmove(data + gap_start, data + gap_end, x - gap_start);
+	gap_end += x - gap_start;
+    }
+
+    gap_start = x;
+    data[gap_start] = '\0';
+}
+
+/* Make sure that the current line has a gap of more than room bytes at
+ * the cursor, if it may have one.  Return FALSE, with no gap in any
+ * line, if it may not. */
+bool make_gap(size_t room)
+{
+    size_t tail_len;
+
+    if (!gap_allowed()) {
+	close_gap();
+	return FALSE;
+    }
+
+    /* A new gap starts out empty, and gets room below. */
+    if (gap_line != openfile->current) {
+	close_gap();
+	gap_line = openfile->current;
+	gap_start = gap_end = openfile->current_x;
+    } else
+	move_gap(openfile->current_x);
+
+    if (gap_end - gap_start > room)
+	return TRUE;
+
+    /* Grow the gap by a part of the line's length, so that a long run
+     * of typing moves the text after the gap only now and then. */
+    tail_len = strlen(gap_line->data + gap_end);
+    room += (gap_start + tail_len) / 16 + 1;
+    gap_line->data = charealloc(gap_line->data, gap_start + room +
+	tail_len + 1);
+    charmove(gap_line->data + gap_start + room, gap_line->data +
+	gap_end, tail_len + 1);
+    gap_end = gap_start + room;
+    gap_line->data[gap_start] = '\0';
+
+    return TRUE;
+}
+
+/* Put the len bytes of text into the gap that make_gap() made, before
+ * the cursor. */
+void gap_insert(const char *text, size_t len)
+{
+    assert(gap_line == openfile->current && gap_end - gap_start > len);
+
+    strncpy(gap_line->data + gap_start, text, len);
+    gap_start += len;
+    gap_line->data[gap_start] = '\0';
+}
+
+/* Move the character after the gap that make_gap() made to before it,
+ * where the undo code can see it, and return its length, or zero if
+ * the gap is at the end of the line. */
+size_t gap_expose(void)
+{
+    size_t char_len;
+
+    assert(gap_line == openfile->current);
+
+    if (gap_line->data[gap_end] == '\0')
+	return 0;
+
+    char_len = parse_mbchar(gap_line->data + gap_end, NULL, NULL);
+    move_gap(gap_start + char_len);
+
+    return char_len;
+}
+
+/* Let the gap take in the len bytes just before it. */
+void gap_erase(size_t len)
+{
+    assert(gap_line == openfile->current && gap_start >= len);
+
+    gap_start -= len;
+    gap_line->data[gap_start] = '\0';
+}
+
+/* Return the text after the gap in fileptr, or NULL if it has none. */
+const char *gap_tail(const filestruct *fileptr)
+{
+    return (fileptr == gap_line) ? gap_line->data + gap_end : NULL;
+}
+
+/* Put the text of the line with the gap back together. */
+void close_gap(void)
+{
+    size_t tail_len;
+
+    if (gap_line == NULL)
+	return;
+
+    tail_len = strlen(gap_line->data + gap_end);
+    charmove(gap_line->data + gap_start, gap_line->data + gap_end,
+	tail_len + 1);
+    gap_line->data = charealloc(gap_line->data, gap_start + tail_len +
+	1);
+    gap_line = NULL;
+}
+#endif /* !NANO_TINY */
+
+#ifndef NANO_TINY
+/* The stamp that the remembered lengths of lines carry while they're
+ * right.  While the lengths aren't held, only do_output(), do_enter(),
+ * do_delete() and do_wrap() change the text, and they keep the lengths
+ * of the lines they change up to date.  Everything else that changes
+ * the text holds them first, and releasing them moves the stamp on,
+ * which drops all the lengths remembered before. */
+static size_t length_stamp = 1;
+/* How many holds on the lengths of lines haven't been released. */
+static int lengths_held = 0;
+
+/* Stop trusting and remembering the lengths of lines, as the text is
+ * about to change without them being kept up to date. */
+void hold_lengths(void)
+{
+    lengths_held++;
+}
+
+/* Let go of a hold on the lengths of lines, and forget all the lengths
+ * remembered before it. */
+void release_lengths(void)
+{
+    assert(lengths_held > 0);
+
+    lengths_held--;
+    length_stamp++;
+}
+
+/* Return TRUE if the remembered lengths of fileptr are right. */
+static bool line_len_known(const filestruct *fileptr)
+{
+    return (lengths_held == 0 && fileptr->len_stamp == length_stamp);
+}
+
+/* Remember that fileptr->data is len bytes and chars characters
+ * long. */
+void set_line_len(filestruct *fileptr, size_t len, size_t chars)
+{
+    if (lengths_held > 0)
+	return;
+
+    fileptr->len = len;
+    fileptr->chars = chars;
+    fileptr->len_stamp = length_stamp;
+}
+
+/* Remember the lengths of fileptr->data, measured anew. */
+void measure_line(filestruct *fileptr)
+{
+    assert(gap_tail(fileptr) == NULL);
+
+    if (lengths_held == 0)
+	set_line_len(fileptr, strlen(fileptr->data),
+		mbstrlen(fileptr->data));
+}
+
+/* Add len bytes and chars characters, either of which may be negative,
+ * to the remembered lengths of fileptr, if they're known. */
+void adjust_line_len(filestruct *fileptr, ssize_t len, ssize_t chars)
+{
+    if (!line_len_known(fileptr))
+	return;
+
+    fileptr->len += len;
+    fileptr->chars += chars;
+}
+#endif /* !NANO_TINY */
+
+/* Return the length of fileptr->data in bytes. */
+size_t line_len(const filestruct *fileptr)
+{
+#ifndef NANO_TINY
+    if (line_len_known(fileptr))
+	return fileptr->len;
+#endif
+
+    return strlen(fileptr->data);
+}
+
+/* Return the length of fileptr->data in characters, and remember its
+ * lengths if they aren't known yet. */
+size_t line_chars(filestruct *fileptr)
+{
+#ifndef NANO_TINY
+    if (lengths_held == 0) {
+	if (fileptr->len_stamp != length_stamp)
+	    measure_line(fileptr);
+	return fileptr->chars;
+    }
+#endif
+
+    return mbstrlen(fileptr->data);
+}
+
 /* Delete a node from the filestruct. */
 void delete_node(filestruct *fileptr)
 {
     assert(fileptr != NULL && fileptr->data != NULL);
 
+#ifndef NANO_TINY
+    /* Shared text is freed along with the last line that has it, and
+     * text in a file mapping along with the mapping. */
+    if (fileptr->sharers != NULL) {
+	filemap *map = find_filemap(fileptr->sharers);
+
+	if (map != NULL) {
+	    fileptr->data = NULL;
+	    release_filemap(map);
+	} else if (--*fileptr->sharers > 0)
+	    fileptr->data = NULL;
+	else
+	    free(fileptr->sharers);
+    }
+#endif
+
+#ifndef NANO_TINY
+    if (fileptr == gap_line)
+	gap_line = NULL;
+#endif
+
     if (fileptr->data != NULL)
 	free(fileptr->data);
 
+#ifndef NANO_TINY
+    /* Let any undo item that refers to this line know it's gone. */
+    if (fileptr->handle != NULL)
+	fileptr->handle->line = NULL;
+#endif
+
 #ifdef ENABLE_COLOR
-    if (fileptr->multidata)
-	free(fileptr->multidata);
+    if (fileptr->multimore != NULL)
+	free(fileptr->multimore);
 #endif
 
     free(fileptr);
 }
 
-/* Duplicate a whole filestruct. */
-filestruct *copy_filestruct(const filestruct *src)
+/* Duplicate a whole filestruct.  Except with NANO_TINY, the lines of
+ * the duplicate share their text with the original ones. */
+filestruct *copy_filestruct(filestruct *src)
 {
     filestruct *head, *copy;
 
     assert(src != NULL);
 
+#ifndef NANO_TINY
+    copy = share_node(src);
+#else
     copy = copy_node(src);
+#endif
     copy->prev = NULL;
     head = copy;
     src = src->next;
 
     while (src != NULL) {
+#ifndef NANO_TINY
+	copy->next = share_node(src);
+#else
 	copy->next = copy_node(src);
+#endif
 	copy->next->prev = copy;
 	copy = copy->next;
 
@@ -188,6 +625,99 @@ void renumber(filestruct *fileptr)
 	fileptr->lineno = ++line;
 }
 
+/* Whether the lines after the ones that renumber_partly() numbered
+ * still have to be renumbered. */
+static bool renumber_pending = FALSE;
+
+/* Renumber the entries in the current filestruct, starting with
+ * fileptr, up to the last one that can be on the screen, and adjust
+ * the number of the last line by added, the number of lines that have
+ * been added before it, which may be negative.  The lines in between
+ * are renumbered later by finish_renumbering(), so that a run of
+ * Enters or Backspaces doesn't take time proportional to the length
+ * of the file for each keystroke.  When the mark is set, its line
+ * has to be numbered right, so renumber everything then. */
+void renumber_partly(filestruct *fileptr, ssize_t added)
+{
+    int i;
+
+    assert(fileptr != NULL);
+
+#ifndef NANO_TINY
+    if (openfile->mark_set) {
+	renumber(fileptr);
+	renumber_pending = FALSE;
+	return;
+    }
+#endif
+
+    fileptr->lineno = (fileptr->prev == NULL) ? 1 :
+	fileptr->prev->lineno + 1;
+
+    /* Renumber down to the current line, and then as many lines as
+     * fit on the screen below it. */
+    for (; fileptr != openfile->current && fileptr->next != NULL;
+	fileptr = fileptr->next)
+	fileptr->next->lineno = fileptr->lineno + 1;
+    for (i = editwinrows; i > 0 && fileptr->next != NULL;
+	fileptr = fileptr->next, i--)
+	fileptr->next->lineno = fileptr->lineno + 1;
+
+    if (fileptr->next != NULL) {
+	openfile->filebot->lineno += added;
+	renumber_pending = TRUE;
+    }
+}
+
+/* Renumber the lines that renumber_partly() left misnumbered, if
+ * any. */
+void finish_renumbering(void)
+{
+    if (!renumber_pending)
+	return;
+
+    renumber_pending = FALSE;
+    renumber(openfile->current);
+}
+
+#ifndef NANO_TINY
+/* Widen the lines that c holds to have changed to take in all but the
+ * first head and the last tail lines. */
+static void widen_changed(changedlines *c, size_t head, size_t tail)
+{
+    if (head < c->head)
+	c->head = head;
+    if (tail < c->tail)
+	c->tail = tail;
+}
+
+/* Note that the lines of the current buffer have changed, apart from
+ * the first head and the last tail ones, in everything that keeps track
+ * of which lines have changed. */
+static void note_changed(size_t head, size_t tail)
+{
+    if (openfile->brackets != NULL)
+	widen_changed(&openfile->brackets->changed, head, tail);
+    if (openfile->journal_name != NULL)
+	widen_changed(&openfile->journal_changed, head, tail);
+}
+
+/* Note that the lines of the current buffer from top down to bot have
+ * changed.  Since only the lines before top and after bot count, this
+ * can be done before lines between them are taken out as well as after
+ * lines are put in, as long as top, bot and filebot are numbered right
+ * at the time.  A change inside a partition is noted as one to all of
+ * it when the partition is undone. */
+void mark_changed(const filestruct *top, const filestruct *bot)
+{
+    if (filepart != NULL)
+	return;
+
+    note_changed(top->lineno - 1, openfile->filebot->lineno -
+	bot->lineno);
+}
+#endif
+
 /* Partition a filestruct so that it begins at (top, top_x) and ends at
  * (bot, bot_x). */
 partition *partition_filestruct(filestruct *top, size_t top_x,
@@ -197,8 +727,20 @@ partition *partition_filestruct(filestruct *top, size_t top_x,
 
     assert(top != NULL && bot != NULL && openfile->fileage != NULL && openfile->filebot != NULL);
 
+#ifndef NANO_TINY
+    /* The text of top and bot is cut short below, until the partition
+     * is undone. */
+    unshare_node(top);
+    unshare_node(bot);
+    hold_lengths();
+#endif
+
     /* Initialize the partition. */
     p = (partition *)nmalloc(sizeof(partition));
+#ifndef NANO_TINY
+    p->head = top->lineno - 1;
+    p->tail = openfile->filebot->lineno - bot->lineno;
+#endif
 
     /* If the top and bottom of the partition are different from the top
      * and bottom of the filestruct, save the latter and then set them
@@ -246,9 +788,18 @@ partition *partition_filestruct(filestruct *top, size_t top_x,
 void unpartition_filestruct(partition **p)
 {
     char *tmp;
+#ifndef NANO_TINY
+    size_t head = (*p)->head, tail = (*p)->tail;
+#endif
 
     assert(p != NULL && openfile->fileage != NULL && openfile->filebot != NULL);
 
+#ifndef NANO_TINY
+    /* The text of the top and bottom lines is added to below. */
+    unshare_node(openfile->fileage);
+    unshare_node(openfile->filebot);
+#endif
+
     /* Reattach the line above the top of the partition, and restore the
      * text before top_x from top_data.  Free top_data when we're done
      * with it. */
@@ -284,6 +835,13 @@ void unpartition_filestruct(partition **p)
     /* Uninitialize the partition. */
     free(*p);
     *p = NULL;
+
+#ifndef NANO_TINY
+    release_lengths();
+
+    /* Anything in the partition may have been changed. */
+    note_changed(head, tail);
+#endif
 }
 
 /* Move all the text between (top, top_x) and (bot, bot_x) in the
@@ -297,6 +855,8 @@ void move_to_filestruct(filestruct **file_top, filestruct **file_bot,
     bool edittop_inside;
 #ifndef NANO_TINY
     bool mark_inside = FALSE;
+    filestruct *fileptr;
+    linehandle *top_handle;
 #endif
 
     assert(file_top != NULL && file_bot != NULL && top != NULL && bot != NULL);
@@ -323,6 +883,20 @@ void move_to_filestruct(filestruct **file_top, filestruct **file_bot,
 		openfile->mark_begin_x >= top_x) &&
 		(openfile->mark_begin != openfile->filebot ||
 		openfile->mark_begin_x <= bot_x));
+
+    /* The lines leave the buffer, so undo items can't refer to them
+     * anymore.  The top line is replaced by a new one below, which
+     * takes its handle over. */
+    top_handle = openfile->fileage->handle;
+    openfile->fileage->handle = NULL;
+
+    for (fileptr = openfile->fileage->next; fileptr != NULL; fileptr =
+	fileptr->next) {
+	if (fileptr->handle != NULL) {
+	    fileptr->handle->line = NULL;
+	    fileptr->handle = NULL;
+	}
+    }
 #endif
 
     /* Get the number of characters in the text, and subtract it from
@@ -343,6 +917,9 @@ void move_to_filestruct(filestruct **file_top, filestruct **file_bot,
 
 	/* Otherwise, tack the text in top onto the text at the end of
 	 * file_bot. */
+#ifndef NANO_TINY
+	unshare_node(*file_bot);
+#endif
 	(*file_bot)->data = charealloc((*file_bot)->data,
 		strlen((*file_bot)->data) +
 		strlen(openfile->fileage->data) + 1);
@@ -368,9 +945,18 @@ void move_to_filestruct(filestruct **file_top, filestruct **file_bot,
     openfile->fileage = (filestruct *)nmalloc(sizeof(filestruct));
     openfile->fileage->data = mallocstrcpy(NULL, "");
     openfile->filebot = openfile->fileage;
+#ifndef NANO_TINY
+    openfile->fileage->handle = top_handle;
+    if (top_handle != NULL)
+	top_handle->line = openfile->fileage;
+    openfile->fileage->sharers = NULL;
+    openfile->fileage->len_stamp = 0;
+#endif
 
 #ifdef ENABLE_COLOR
-    openfile->fileage->multidata = NULL;
+    memset(openfile->fileage->multidata, -1,
+	sizeof(openfile->fileage->multidata));
+    openfile->fileage->multimore = NULL;
 #endif
 
     /* Restore the current line and cursor position.  If the mark begins
@@ -406,6 +992,61 @@ void move_to_filestruct(filestruct **file_top, filestruct **file_bot,
 	new_magicline();
 }
 
+#ifndef NANO_TINY
+/* Copy all text from the current filestruct between top at top_x and
+ * bot at bot_x to the end of the filestruct beginning with file_top and
+ * ending with file_bot, just as move_to_filestruct() would move it
+ * there, but leaving the current filestruct alone. */
+void copy_to_filestruct(filestruct **file_top, filestruct **file_bot,
+	filestruct *top, size_t top_x, filestruct *bot, size_t bot_x)
+{
+    filestruct *fileptr;
+    size_t line_len, len;
+
+    assert(top != NULL && bot != NULL);
+
+    if (*file_top == NULL) {
+	*file_top = make_new_node(NULL);
+	(*file_top)->data = mallocstrcpy(NULL, "");
+	*file_bot = *file_top;
+    }
+
+    /* Tack the text in top onto the text at the end of file_bot. */
+    unshare_node(*file_bot);
+    len = ((top == bot) ? bot_x : strlen(top->data)) - top_x;
+    line_len = strlen((*file_bot)->data);
+    (*file_bot)->data = charealloc((*file_bot)->data, line_len + len +
+	1);
+    strncpy((*file_bot)->data + line_len, top->data + top_x, len);
+    (*file_bot)->data[line_len + len] = '\0';
+
+    if (top == bot)
+	return;
+
+    /* Add copies of the lines after top, down to the text of bot before
+     * bot_x.  Whole lines share their text with the original ones. */
+    for (fileptr = top->next; fileptr != bot->next; fileptr =
+	fileptr->next) {
+	filestruct *copy;
+
+	if (fileptr != bot || bot_x == strlen(bot->data)) {
+	    copy = share_node(fileptr);
+	    openfile->shared_lines = TRUE;
+	} else {
+	    copy = make_new_node(NULL);
+	    copy->data = mallocstrncpy(NULL, fileptr->data, bot_x + 1);
+	    copy->data[bot_x] = '\0';
+	}
+
+	copy->prev = *file_bot;
+	copy->next = NULL;
+	copy->lineno = (*file_bot)->lineno + 1;
+	(*file_bot)->next = copy;
+	*file_bot = copy;
+    }
+}
+#endif
+
 /* Copy all the text from the filestruct beginning with file_top and
  * ending with file_bot to the current filestruct at the current cursor
  * position. */
@@ -416,6 +1057,7 @@ void copy_from_filestruct(filestruct *file_top, filestruct *file_bot)
     bool edittop_inside;
 #ifndef NANO_TINY
     bool right_side_up = FALSE, single_line = FALSE;
+    linehandle *handle;
 #endif
 
     assert(file_top != NULL && file_bot != NULL);
@@ -441,9 +1083,24 @@ void copy_from_filestruct(filestruct *file_top, filestruct *file_bot)
 	openfile->current_x, openfile->current, openfile->current_x);
     edittop_inside = (openfile->edittop == openfile->fileage);
 
+#ifndef NANO_TINY
+    /* The current line is replaced by the copy of file_top, which gets
+     * its text back, so the copy takes over its undo handle too. */
+    handle = openfile->fileage->handle;
+    openfile->fileage->handle = NULL;
+#endif
+
     /* Put the top and bottom of the filestruct at copies of file_top
      * and file_bot. */
     openfile->fileage = copy_filestruct(file_top);
+#ifndef NANO_TINY
+    openfile->fileage->handle = handle;
+    if (handle != NULL)
+	handle->line = openfile->fileage;
+
+    /* The copies share their text with file_top and the rest. */
+    openfile->shared_lines = TRUE;
+#endif
     openfile->filebot = openfile->fileage;
     while (openfile->filebot->next != NULL)
 	openfile->filebot = openfile->filebot->next;
@@ -520,6 +1177,15 @@ openfilestruct *make_new_opennode(void)
 #ifndef NANO_TINY
     newnode->current_stat = NULL;
     newnode->last_action = OTHER;
+    newnode->version = 0;
+    newnode->found = NULL;
+    newnode->brackets = NULL;
+    newnode->undo_spill = NULL;
+    newnode->journal = NULL;
+    newnode->journal_name = NULL;
+    newnode->journal_failed = FALSE;
+    newnode->journal_lines = 0;
+    newnode->journal_version = 0;
 #endif
 
     return newnode;
@@ -556,10 +1222,23 @@ void delete_opennode(openfilestruct *fileptr)
     assert(fileptr != NULL && fileptr->filename != NULL && fileptr->fileage != NULL);
 
     free(fileptr->filename);
+#ifndef NANO_TINY
+    free_undo_stack(fileptr->undotop);
+#endif
     free_filestruct(fileptr->fileage);
 #ifndef NANO_TINY
     if (fileptr->current_stat != NULL)
 	free(fileptr->current_stat);
+    if (fileptr->found != NULL)
+	free_matchindex(fileptr->found);
+    if (fileptr->brackets != NULL)
+	free_bracketindex(fileptr->brackets);
+    if (fileptr->undo_spill != NULL)
+	fclose(fileptr->undo_spill);
+    if (fileptr->journal != NULL)
+	fclose(fileptr->journal);
+    if (fileptr->journal_name != NULL)
+	free(fileptr->journal_name);
 #endif
 
     free(fileptr);
@@ -620,6 +1299,11 @@ void die(const char *msg, ...)
 {
     va_list ap;
 
+#ifndef NANO_TINY
+    /* The text may be halfway through a change. */
+    hold_lengths();
+#endif
+
     endwin();
 
     /* Restore the old terminal settings. */
@@ -635,6 +1319,19 @@ void die(const char *msg, ...)
 	if (filepart != NULL)
 	    unpartition_filestruct(&filepart);
 
+#ifndef NANO_TINY
+	/* If a line has a gap at the cursor, put it back together. */
+	close_gap();
+#endif
+
+#ifndef NANO_TINY
+	/* If the buffer has a journal, only the changes that it doesn't
+	 * have yet need to be written out. */
+	if (flush_journal())
+	    fprintf(stderr, _("\nChanges kept in %s\n"),
+		openfile->journal_name);
+	else
+#endif
 	die_save_file(openfile->filename
 #ifndef NANO_TINY
 		, openfile->current_stat
@@ -651,12 +1348,19 @@ void die(const char *msg, ...)
 	    openfile = openfile->next;
 
 	    /* Save the current file buffer if it's been modified. */
-	    if (openfile->modified)
+	    if (openfile->modified) {
+#ifndef NANO_TINY
+		if (flush_journal())
+		    fprintf(stderr, _("\nChanges kept in %s\n"),
+			openfile->journal_name);
+		else
+#endif
 		die_save_file(openfile->filename
 #ifndef NANO_TINY
 			, openfile->current_stat
 #endif
 			);
+	    }
 	}
     }
 #endif
@@ -875,10 +1579,16 @@ void usage(void)
 #ifndef NANO_TINY
     print_opt("-W", "--wordbounds",
 	N_("Detect word boundaries more accurately"));
+    print_opt(_("-X <str>"), _("--replace=<str>"),
+	N_("Replace <str> in the given files and exit"));
 #endif
 #ifdef ENABLE_COLOR
     print_opt(_("-Y <str>"), _("--syntax=<str>"),
 	N_("Syntax definition to use for coloring"));
+#endif
+#ifndef NANO_TINY
+    print_opt(_("-Z <str>"), _("--with=<str>"),
+	N_("Replacement for the string given with -X"));
 #endif
     print_opt("-c", "--const", N_("Constantly show cursor position"));
     print_opt("-d", "--rebinddelete",
@@ -1050,6 +1760,10 @@ void do_exit(void)
     /* If the user chose not to save, or if the user chose to save and
      * the save succeeded, we're ready to exit. */
     if (i == 0 || (i == 1 && do_writeout(TRUE))) {
+#ifndef NANO_TINY
+	/* Nothing is left to recover. */
+	discard_journal();
+#endif
 #ifdef ENABLE_MULTIBUFFER
 	/* Exit only if there are no more open file buffers. */
 	if (!close_buffer())
@@ -1283,6 +1997,9 @@ RETSIGTYPE handle_sigwinch(int signal)
     if (filepart != NULL)
 	unpartition_filestruct(&filepart);
 
+    /* The screen may get taller, so number all lines right. */
+    finish_renumbering();
+
 #ifdef USE_SLANG
     /* Slang curses emulation brain damage, part 1: If we just do what
      * curses does here, it'll only work properly if the resize made the
@@ -1314,6 +2031,15 @@ RETSIGTYPE handle_sigwinch(int signal)
     currmenu = MMAIN;
     total_refresh();
 
+#ifndef NANO_TINY
+    /* A jump back to main() leaves behind whatever was holding the
+     * lengths of lines. */
+    if (jump_buf_main) {
+	lengths_held = 0;
+	length_stamp++;
+    }
+#endif
+
     /* Jump back to either main() or the unjustify routine in
      * do_justify(). */
     siglongjmp(jump_buf, 1);
@@ -1510,6 +2236,10 @@ int do_input(bool *meta_key, bool *func_key, bool *s_or_t, bool
 	/* Are we cutting or copying text? */
     const sc *s;
     bool have_shortcut;
+#ifndef NANO_TINY
+    bool held = FALSE;
+	/* Are we holding the lengths of lines? */
+#endif
 
     *s_or_t = FALSE;
     *ran_func = FALSE;
@@ -1523,6 +2253,9 @@ int do_input(bool *meta_key, bool *func_key, bool *s_or_t, bool
 	/* If we got a mouse click and it was on a shortcut, read in the
 	 * shortcut character. */
 	if (*func_key && input == KEY_MOUSE) {
+#ifndef NANO_TINY
+	    close_gap();
+#endif
 	    if (do_mouse() == 1)
 		input = get_kbinput(edit, meta_key, func_key);
 	    else {
@@ -1541,6 +2274,25 @@ int do_input(bool *meta_key, bool *func_key, bool *s_or_t, bool
      * edit window shortcut, set have_shortcut to TRUE. */
     have_shortcut = (s != NULL);
 
+    /* If we're going to run a shortcut for cutting or copying text,
+     * indicate this.  Anything else ends a run of cuts first. */
+    if (allow_funcs && have_shortcut && (s->scfunc == DO_CUT_TEXT_VOID
+#ifndef NANO_TINY
+	|| s->scfunc == DO_COPY_TEXT || s->scfunc == DO_CUT_TILL_END
+#endif
+	))
+	cut_copy = TRUE;
+    else
+	finish_cut();
+
+    /* Typing only renumbers the lines on the screen.  Anything else
+     * gets the whole file numbered right first. */
+    if (!cut_copy && (!allow_funcs || (have_shortcut && s->scfunc !=
+	DO_ENTER && s->scfunc != DO_BACKSPACE && s->scfunc !=
+	DO_DELETE && s->scfunc != DO_TAB && s->scfunc !=
+	DO_VERBATIM_INPUT)))
+	finish_renumbering();
+
     /* If we got a non-high-bit control key, a meta key sequence, or a
      * function key, and it's not a shortcut or toggle, throw it out. */
     if (!have_shortcut) {
@@ -1595,6 +2347,9 @@ int do_input(bool *meta_key, bool *func_key, bool *s_or_t, bool
 		    output[i] = (char)kbinput[i];
 		output[i] = '\0';
 
+#ifndef NANO_TINY
+		unshare_current_lines();
+#endif
 		do_output(output, kbinput_len, FALSE);
 
 		free(output);
@@ -1614,19 +2369,16 @@ int do_input(bool *meta_key, bool *func_key, bool *s_or_t, bool
 		 * that we're done after running or trying to run their
 		 * associated functions. */
 		default:
-		    /* If the function associated with this shortcut is
-		     * cutting or copying text, indicate this. */
-		    if (s->scfunc == DO_CUT_TEXT_VOID
-#ifndef NANO_TINY
-			|| s->scfunc == DO_COPY_TEXT || s->scfunc ==
-			DO_CUT_TILL_END
-#endif
-			)
-			cut_copy = TRUE;
-
 		    if (s->scfunc != 0) {
 			const subnfunc *f = sctofunc((sc *) s);
 			*ran_func = TRUE;
+#ifndef NANO_TINY
+			/* Only typing and deleting characters work on a
+			 * line with a gap at the cursor. */
+			if (s->scfunc != DO_BACKSPACE && s->scfunc !=
+				DO_DELETE && s->scfunc != DO_TAB)
+			    close_gap();
+#endif
 			if (ISSET(VIEW_MODE) && f && !f->viewok)
 			    print_view_warning();
 			else {
@@ -1636,8 +2388,41 @@ int do_input(bool *meta_key, bool *func_key, bool *s_or_t, bool
 			    else {
 #else
 			    {
+#endif
+#ifndef NANO_TINY
+				/* Typing only changes the lines around the
+				 * cursor.  Cutting, copying, pasting, undoing,
+				 * indenting, justifying and spell checking
+				 * unshare just the lines they change, as do
+				 * inserting a file and replacing, which are
+				 * allowed in view mode.  Writing out and the
+				 * other functions allowed in view mode don't
+				 * change the text at all. */
+				if (s->scfunc == DO_ENTER || s->scfunc ==
+					DO_BACKSPACE || s->scfunc == DO_DELETE ||
+					s->scfunc == DO_TAB || s->scfunc ==
+					DO_VERBATIM_INPUT)
+				    unshare_current_lines();
+				else if (!cut_copy && (f == NULL ||
+					!f->viewok) &&
+					!unshares_itself(s->scfunc))
+				    unshare_lines();
+
+				/* Only typing and undoing keep the lengths of
+				 * the lines they change up to date.  Of the
+				 * functions allowed in view mode, inserting a
+				 * file partitions the text, which holds them,
+				 * and replacing holds them itself. */
+				held = (f == NULL || !f->viewok) &&
+					!keeps_lengths(s->scfunc);
+				if (held)
+				    hold_lengths();
 #endif
 				iso_me_harder_funcmap(s->scfunc);
+#ifndef NANO_TINY
+				if (held)
+				    release_lengths();
+#endif
 #ifdef ENABLE_COLOR
 				if (f && !f->viewok && openfile->syntax != NULL
 					&& openfile->syntax->nmultis > 0) {
@@ -1762,12 +2547,6 @@ int do_mouse(void)
 #endif /* !DISABLE_MOUSE */
 
 #ifdef ENABLE_COLOR
-void alloc_multidata_if_needed(filestruct *fileptr)
-{
-    if (!fileptr->multidata)
-	fileptr->multidata = (short *) nmalloc(openfile->syntax->nmultis * sizeof(short));
-}
-
 /* Precalculate the multi-line start and end regex info so we can speed up
    rendering (with any hope at all...) */
 void precalc_multicolorinfo(void)
@@ -1807,7 +2586,8 @@ void precalc_multicolorinfo(void)
 	    fprintf(stderr, "working on lineno %lu\n", (unsigned long) fileptr->lineno);
 #endif
 
-		alloc_multidata_if_needed(fileptr);
+		/* Start from no flags, as they're ORed in below. */
+		*multidata_for(fileptr, tmpcolor->id) = 0;
 
 		if ((cur_check = time(NULL)) - last_check > 1) {
 		    last_check = cur_check;
@@ -1826,7 +2606,7 @@ void precalc_multicolorinfo(void)
 		    /* Look on this line first for end */
 		    if (regexec(tmpcolor->end, &fileptr->data[startx], 1, &endmatch, 0)  == 0) {
 			startx += endmatch.rm_eo;
-			fileptr->multidata[tmpcolor->id] |= CSTARTENDHERE;
+			*multidata_for(fileptr, tmpcolor->id) |= CSTARTENDHERE;
 #ifdef DEBUG
 	    fprintf(stderr, "end found on this line\n");
 #endif
@@ -1863,22 +2643,20 @@ void precalc_multicolorinfo(void)
 
 		    /* We found it, we found it, la la la la la.  Mark all the
 			lines in between and the ends properly */
-		    fileptr->multidata[tmpcolor->id] |= CENDAFTER;
+		    *multidata_for(fileptr, tmpcolor->id) |= CENDAFTER;
 #ifdef DEBUG
 		    fprintf(stderr, "marking line %lu as CENDAFTER\n", (unsigned long) fileptr->lineno);
 #endif
 		    for (fileptr = fileptr->next; fileptr != endptr; fileptr = fileptr->next) {
-			alloc_multidata_if_needed(fileptr);
-			fileptr->multidata[tmpcolor->id] = CWHOLELINE;
+			*multidata_for(fileptr, tmpcolor->id) = CWHOLELINE;
 #ifdef DEBUG
 			fprintf(stderr, "marking intermediary line %lu as CWHOLELINE\n", (unsigned long) fileptr->lineno);
 #endif
 		    }
-		    alloc_multidata_if_needed(endptr);
 #ifdef DEBUG
 		    fprintf(stderr, "marking line %lu as BEGINBEFORE\n", (unsigned long) fileptr->lineno);
 #endif
-		    endptr->multidata[tmpcolor->id] |= CBEGINBEFORE;
+		    *multidata_for(endptr, tmpcolor->id) = CBEGINBEFORE;
 		    /* We should be able to skip all the way to the line of the match.
 			This may introduce more bugs but it's the Right Thing to do */
 		    fileptr = endptr;
@@ -1891,7 +2669,7 @@ void precalc_multicolorinfo(void)
 #ifdef DEBUG
 		    fprintf(stderr, "no start found on line %lu, continuing\n", (unsigned long) fileptr->lineno);
 #endif
-		    fileptr->multidata[tmpcolor->id] = CNONE;
+		    *multidata_for(fileptr, tmpcolor->id) = CNONE;
 		    continue;
 		}
 	    }
@@ -1907,13 +2685,13 @@ precalc_cleanup:
  * TRUE. */
 void do_output(char *output, size_t output_len, bool allow_cntrls)
 {
-    size_t current_len, orig_lenpt, i = 0;
+    size_t current_len, orig_lenpt, i = 0, run_start, run_end, run_len;
+    size_t run_chars;
     char *char_buf = charalloc(mb_cur_max());
     int char_buf_len;
 
     assert(openfile->current != NULL && openfile->current->data != NULL);
 
-    current_len = strlen(openfile->current->data);
     if (ISSET(SOFTWRAP))
 	orig_lenpt = strlenpt(openfile->current->data);
 
@@ -1926,6 +2704,9 @@ void do_output(char *output, size_t output_len, bool allow_cntrls)
 		output[i] = '\n';
 	    /* Newline to Enter, if needed. */
 	    else if (output[i] == '\n') {
+#ifndef NANO_TINY
+		close_gap();
+#endif
 		do_enter(FALSE);
 		i++;
 		continue;
@@ -1949,33 +2730,72 @@ void do_output(char *output, size_t output_len, bool allow_cntrls)
 		openfile->current)
 	    new_magicline();
 
-	/* More dangerousness fun =) */
-	openfile->current->data = charealloc(openfile->current->data,
-		current_len + (char_buf_len * 2));
-
-	assert(openfile->current_x <= current_len);
+	/* Take the characters that follow this one along with it, up to
+	 * the next one that needs special handling, so that a burst of
+	 * input, such as pasted text, is put into the line with one
+	 * move of the text after the cursor rather than one move per
+	 * character.  When wrapping, each character may wrap the line,
+	 * so it has to go in on its own. */
+	run_start = i - char_buf_len;
+#ifndef DISABLE_WRAPPING
+	if (ISSET(NO_WRAP))
+#endif
+	    while (i < output_len && (allow_cntrls ? (output[i] !=
+		'\0' && output[i] != '\n') :
+		!is_ascii_cntrl_char(output[i])))
+		i += parse_mbchar(output + i, NULL, NULL);
+	run_len = i - run_start;
 
-	charmove(openfile->current->data + openfile->current_x +
-		char_buf_len, openfile->current->data +
-		openfile->current_x, current_len - openfile->current_x +
-		char_buf_len);
-	strncpy(openfile->current->data + openfile->current_x, char_buf,
-		char_buf_len);
-	current_len += char_buf_len;
-	openfile->totsize++;
+#ifndef NANO_TINY
+	/* A long line gets a gap at the cursor, so that the text after
+	 * the cursor doesn't move for every burst of typing. */
+	if (make_gap(run_len))
+	    gap_insert(output + run_start, run_len);
+	else
+#endif
+	{
+	    current_len = strlen(openfile->current->data);
+
+	    /* More dangerousness fun =) */
+	    openfile->current->data =
+		charealloc(openfile->current->data, current_len +
+		run_len + 1);
+
+	    assert(openfile->current_x <= current_len);
+
+	    charmove(openfile->current->data + openfile->current_x +
+		run_len, openfile->current->data + openfile->current_x,
+		current_len - openfile->current_x + 1);
+	    strncpy(openfile->current->data + openfile->current_x,
+		output + run_start, run_len);
+	}
 	set_modified();
 
+	/* Account for the characters one by one, as the undo item and
+	 * the mark need them. */
+	for (run_end = i, i = run_start, run_chars = 0; i < run_end; i +=
+		char_buf_len, run_chars++) {
+	    char_buf_len = parse_mbchar(output + i, NULL, NULL);
+	    openfile->totsize++;
+
 #ifndef NANO_TINY
-	update_undo(ADD);
+	    update_undo(ADD);
 
-	/* Note that current_x has not yet been incremented. */
-	if (openfile->mark_set && openfile->current ==
+	    /* Note that current_x has not yet been incremented. */
+	    if (openfile->mark_set && openfile->current ==
 		openfile->mark_begin && openfile->current_x <
 		openfile->mark_begin_x)
-	    openfile->mark_begin_x += char_buf_len;
+		openfile->mark_begin_x += char_buf_len;
 #endif
 
-	openfile->current_x += char_buf_len;
+	    openfile->current_x += char_buf_len;
+	}
+	i = run_end;
+
+#ifndef NANO_TINY
+	adjust_line_len(openfile->current, run_len, run_chars);
+	mark_changed(openfile->current, openfile->current);
+#endif
 
 #ifndef DISABLE_WRAPPING
 	/* If we're wrapping text, we need to call edit_refresh(). */
@@ -2029,6 +2849,11 @@ int main(int argc, char **argv)
 	/* The old value of the multibuffer option, restored after we
 	 * load all files on the command line. */
 #endif
+#ifndef NANO_TINY
+    char *replace_needle = NULL, *replace_with = NULL;
+	/* The string to replace in the files on the command line, and
+	 * what to replace it with, if we're not going to edit them. */
+#endif
 #ifdef HAVE_GETOPT_LONG
     const struct option long_options[] = {
 	{"directory", 0, NULL, 'N'},    
@@ -2087,6 +2912,8 @@ int main(int argc, char **argv)
 	{"quickblank", 0, NULL, 'U'},
 	{"undo", 0, NULL, 'u'},
 	{"wordbounds", 0, NULL, 'W'},
+	{"replace", 1, NULL, 'X'},
+	{"with", 1, NULL, 'Z'},
 	{"autoindent", 0, NULL, 'i'},
 	{"cut", 0, NULL, 'k'},
 	{"softwrap", 0, NULL, '$'},
@@ -2128,11 +2955,11 @@ int main(int argc, char **argv)
     while ((optchr =
 #ifdef HAVE_GETOPT_LONG
 	getopt_long(argc, argv,
-		"h?ABC:DEFHIKLNOQ:RST:UVWY:abcdefgijklmo:pqr:s:tuvwxz$",
+		"h?ABC:DEFHIKLNOQ:RST:UVWX:Y:Z:abcdefgijklmo:pqr:s:tuvwxz$",
 		long_options, NULL)
 #else
 	getopt(argc, argv,
-		"h?ABC:DEFHIKLNOQ:RST:UVWY:abcdefgijklmo:pqr:s:tuvwxz$")
+		"h?ABC:DEFHIKLNOQ:RST:UVWX:Y:Z:abcdefgijklmo:pqr:s:tuvwxz$")
 #endif
 		) != -1) {
 	switch (optchr) {
@@ -2224,11 +3051,19 @@ int main(int argc, char **argv)
 	    case 'W':
 		SET(WORD_BOUNDS);
 		break;
+	    case 'X':
+		replace_needle = mallocstrcpy(replace_needle, optarg);
+		break;
 #endif
 #ifdef ENABLE_COLOR
 	    case 'Y':
 		syntaxstr = mallocstrcpy(syntaxstr, optarg);
 		break;
+#endif
+#ifndef NANO_TINY
+	    case 'Z':
+		replace_with = mallocstrcpy(replace_with, optarg);
+		break;
 #endif
 	    case 'c':
 		SET(CONST_UPDATE);
@@ -2529,6 +3364,21 @@ int main(int argc, char **argv)
     if (tabsize == -1)
 	tabsize = WIDTH_OF_TAB;
 
+#ifndef NANO_TINY
+    /* If we've been asked to replace a string in the files on the
+     * command line, do just that, without starting curses, and get
+     * out. */
+    if (replace_needle != NULL) {
+	if (replace_with == NULL) {
+	    fprintf(stderr, _("No replacement given with -Z"));
+	    fprintf(stderr, "\n");
+	    exit(1);
+	}
+	exit(replace_in_files(replace_needle, replace_with, argv +
+		optind, argc - optind));
+    }
+#endif
+
     /* Back up the old terminal settings so that they can be restored. */
     tcgetattr(0, &oldterm);
 
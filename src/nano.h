@@ -186,7 +186,8 @@ typedef enum {
 }  function_type;
 
 typedef enum {
-    ADD, DEL, REPLACE, SPLIT, UNSPLIT, CUT, UNCUT, ENTER, INSERT, OTHER
+    ADD, DEL, REPLACE, REPLACEALL, SPLIT, UNSPLIT, CUT, UNCUT, ENTER,
+    INSERT, GROUP, OTHER
 } undo_type;
 
 #ifdef ENABLE_COLOR
@@ -253,6 +254,10 @@ typedef struct syntaxtype {
 #define CWTF		(1<<6)
 	/* Something else */
 
+#define MAX_MULTIS 8
+	/* How many multi-line regexes have their info kept in each line
+	 * itself; the info on any more of them is kept in an array. */
+
 #endif /* ENABLE_COLOR */
 
 
@@ -266,11 +271,75 @@ typedef struct filestruct {
 	/* Next node. */
     struct filestruct *prev;
 	/* Previous node. */
+#ifndef NANO_TINY
+    struct linehandle *handle;
+	/* The handle by which undo items refer to this line, if any. */
+    size_t *sharers;
+	/* How many lines have the same text as this one, if data is
+	 * shared with other lines, or NULL if it isn't. */
+    size_t len;
+	/* The length of data in bytes, if len_stamp is current. */
+    size_t chars;
+	/* The length of data in characters, likewise. */
+    size_t len_stamp;
+	/* The stamp that len and chars were set under, or zero if they
+	 * never were; see hold_lengths(). */
+#endif
 #ifdef ENABLE_COLOR
-    short *multidata;		/* Array of which multi-line regexes apply to this line */
+    signed char multidata[MAX_MULTIS];
+	/* Which multi-line regexes apply to this line, indexed by their
+	 * id, as a combination of the C* flags above, or -1 if that
+	 * hasn't been worked out yet. */
+    signed char *multimore;
+	/* The same for the multi-line regexes whose id is MAX_MULTIS or
+	 * more, or NULL if no syntax has that many or they haven't been
+	 * looked at for this line yet. */
 #endif
 } filestruct;
 
+#ifndef NANO_TINY
+typedef struct linehandle {
+    filestruct *line;
+	/* The line, or NULL once it has left the buffer. */
+    size_t refs;
+	/* How many undo items hold this handle. */
+} linehandle;
+
+typedef struct filemap {
+    size_t refs;
+	/* How many lines have their text in this mapping.  The sharers
+	 * of those lines point here. */
+    char *addr;
+	/* Where the mapping is. */
+    size_t len;
+	/* How long the mapping is. */
+    struct filemap *next;
+	/* Next mapping. */
+} filemap;
+
+typedef struct readchunk {
+    char *start;
+	/* Where this piece of a file mapping begins. */
+    char *end;
+	/* Where it ends, just after a newline. */
+    bool convert;
+	/* Whether a lone '\r' ends a line in it, and "\r\n"s are looked
+	 * for, as in a DOS or Mac file. */
+    size_t *sharers;
+	/* What the lines made from it point their sharers at. */
+    filestruct *first;
+	/* The first line made from it. */
+    filestruct *last;
+	/* The last line made from it. */
+    size_t lines;
+	/* How many lines were made from it. */
+    bool dos;
+	/* Was a line ending in "\r\n" found in it? */
+    bool mac;
+	/* Was a line ending in a lone '\r' found in it? */
+} readchunk;
+#endif
+
 typedef struct partition {
     filestruct *fileage;
 	/* The top line of this portion of the file. */
@@ -287,17 +356,60 @@ typedef struct partition {
     char *bot_data;
 	/* The text after the end of the bottom line of this portion of
 	 * the file. */
+#ifndef NANO_TINY
+    size_t head;
+	/* How many lines of the file come before this portion. */
+    size_t tail;
+	/* How many lines of the file come after this portion. */
+#endif
 } partition;
 
+#ifdef HAVE_REGEX_H
+typedef struct regexcachetype {
+    char *regex;
+	/* The uncompiled regex string. */
+    int cflags;
+	/* The flags it was compiled with. */
+    regex_t preg;
+	/* The compiled regex. */
+    int refcount;
+	/* How many users are holding on to the compiled regex. */
+    struct regexcachetype *prev;
+	/* The more recently used entry. */
+    struct regexcachetype *next;
+	/* The less recently used entry. */
+} regexcachetype;
+#endif
+
 #ifndef NANO_TINY
+typedef struct spillrange {
+    off_t start;
+	/* Where in the cut spill file the lines of this range begin */
+    off_t end;
+	/* Where they end */
+    size_t refs;
+	/* How many of the cutbuffer and the undo items refer to them */
+    struct spillrange *prev;
+	/* The range written out before this one */
+} spillrange;
+
 typedef struct undo {
     ssize_t lineno;
+    linehandle *handle;
+	/* The line at lineno, as long as it stays around */
     undo_type type;
 	/* What type of undo was this */
     int begin;
 	/* Where did this  action begin or end */
     char *strdata;
 	/* String type data we will use for ccopying the affected line back */
+    size_t datalen;
+	/* For ADD and DEL, the length of strdata */
+    size_t dataroom;
+	/* For ADD and DEL, how much room strdata has */
+    size_t datagap;
+	/* For DEL, how much of that room comes before the text, while
+	 * backspacing adds to its start */
     char *strdata2;
 	/* Sigh, need this too it looks like */
     int xflags;
@@ -308,6 +420,8 @@ typedef struct undo {
 	/* Copy of the cutbuffer */
     filestruct *cutbottom;
 	/* Copy of cutbottom */
+    size_t cutsize;
+	/* How much memory the lines from cutbuffer on take up */
     bool mark_set;
 	/* was the marker set when we cut */
     bool to_end;
@@ -316,10 +430,126 @@ typedef struct undo {
 	/* copy copy copy */
     ssize_t mark_begin_x;
 	/* Another shadow variable */
+    ssize_t lines;
+	/* For GROUP, how many lines follow the changed lines while the
+	 * group is open, and how many changed lines there are after */
+    size_t size;
+	/* How much memory this item takes up */
+    bool spilled;
+	/* Whether the text of this item has been written out to the
+	 * undo spill file, and freed */
+    off_t spill_offset;
+	/* Where in the undo spill file that text is */
+    size_t cut_lines;
+	/* For CUT and UNCUT, how many lines of the text come before
+	 * cutbuffer, from the cut spill file */
+    spillrange *cut_range;
+	/* The range of the cut spill file that those lines are in */
+    size_t serial;
+	/* How many undo items were made before this one */
     struct undo *next;
+    struct undo *prev;
+	/* The newer item above this one */
 } undo;
 
 
+typedef struct matchtype {
+    ssize_t lineno;
+	/* The number of the line the match is on. */
+    size_t x;
+	/* Where in that line the match begins. */
+} matchtype;
+
+typedef struct matchindex {
+    char *needle;
+	/* The search string these matches are for. */
+    bool case_sensitive;
+	/* Was the search case sensitive? */
+    bool regexp;
+	/* Was the search string a regex? */
+    unsigned long version;
+	/* The version of the buffer the matches were found in. */
+    matchtype *matches;
+	/* All the matches in the buffer, in order. */
+    size_t count;
+	/* How many matches there are. */
+} matchindex;
+
+typedef struct findallchunk {
+    const filestruct *first;
+	/* The first line of this chunk of the buffer. */
+    size_t lines;
+	/* How many lines this chunk has. */
+    matchtype *matches;
+	/* The matches found in this chunk, in order. */
+    size_t count;
+	/* How many matches were found in this chunk. */
+    size_t size;
+	/* How many matches there's room for. */
+} findallchunk;
+
+typedef struct replaceresult {
+    size_t index;
+	/* The number of the file in the list of files to replace in. */
+    ssize_t count;
+	/* How many replacements were made in it, or -1 if it couldn't
+	 * be read, or -2 if it couldn't be written. */
+    int errnum;
+	/* The errno value of what went wrong, if anything. */
+} replaceresult;
+
+typedef struct linematches {
+    const filestruct *line;
+	/* The line these matches were found in. */
+    unsigned long version;
+	/* The version of the buffer they were found at. */
+    size_t *spans;
+	/* Where each match begins and ends, in pairs. */
+    size_t count;
+	/* How many matches there are. */
+    size_t size;
+	/* How many matches there's room for. */
+} linematches;
+
+typedef struct changedlines {
+    size_t head;
+	/* How many lines at the start of the buffer haven't changed. */
+    size_t tail;
+	/* How many lines at the end of the buffer haven't changed. */
+} changedlines;
+
+typedef struct bracketsummary {
+    ssize_t net;
+	/* How many more opening brackets than closing ones there are. */
+    ssize_t low;
+	/* The lowest that this count gets when going from the start
+	 * onward, which is never above zero. */
+} bracketsummary;
+
+typedef struct bracketindex {
+    char *bracket_set;
+	/* The opening bracket followed by the closing one. */
+    size_t open_len;
+	/* The length of the opening bracket. */
+    bool bytewise;
+	/* Whether both brackets are single bytes. */
+    changedlines changed;
+	/* Which lines have changed since the index was last brought up
+	 * to date. */
+    size_t nlines;
+	/* How many lines the buffer has. */
+    bracketsummary *lines;
+	/* The summary of each line. */
+    size_t nblocks;
+	/* Into how many blocks of lines the buffer is divided. */
+    const filestruct **blockfirst;
+	/* The first line of each block. */
+    size_t leaves;
+	/* The number of leaves of the tree, a power of two. */
+    bracketsummary *tree;
+	/* The summaries of the blocks, and of each pair of neighbouring
+	 * subtrees above them. */
+} bracketindex;
 #endif /* NANO_TINY */
 
 
@@ -361,6 +591,40 @@ typedef struct openfilestruct {
     undo *current_undo;
 	/* The current (i.e. n ext) level of undo */
     undo_type last_action;
+    size_t undo_size;
+	/* How much memory the undo items of the current file take up. */
+    undo *undo_trim;
+	/* The oldest undo item whose text trim_undo() may still write
+	 * out; the text of the ones below it has been written out, or
+	 * they have none. */
+    FILE *undo_spill;
+	/* The temporary file that the text of the oldest undo items is
+	 * written out to, if any. */
+    bool shared_lines;
+	/* Whether some of its lines may share their text with the
+	 * cutbuffer or with undo items, and so can't be edited in place
+	 * yet. */
+    unsigned long version;
+	/* How many times the text has been changed, so that anything
+	 * we remember about it can tell whether it's still valid. */
+    matchindex *found;
+	/* The matches of the last "find all" search, if any. */
+    bracketindex *brackets;
+	/* What we know about the brackets in it, if anything. */
+    FILE *journal;
+	/* The file that the changes to it are written to as they're
+	 * made, if any. */
+    char *journal_name;
+	/* The name of that file. */
+    bool journal_failed;
+	/* Whether writing to that file has gone wrong, so that it's no
+	 * longer added to. */
+    size_t journal_lines;
+	/* How many lines the journal last saw. */
+    changedlines journal_changed;
+	/* Which lines have changed since the journal last saw them. */
+    unsigned long journal_version;
+	/* The version of the text that the journal last saw. */
 #endif
 #ifdef ENABLE_COLOR
     syntaxtype *syntax;
@@ -495,7 +759,11 @@ enum
     BOLD_TEXT,
     QUIET,
     UNDOABLE,
-    SOFTWRAP
+    SOFTWRAP,
+    HIGHLIGHT_MATCHES,
+    INCREMENTAL_SEARCH,
+    JOURNAL,
+    MAP_FILES
 };
 
 /* Flags for which menus in which a given function should be present */
@@ -513,6 +781,7 @@ enum
 #define	MWHEREISFILE			(1<<11)
 #define MGOTODIR			(1<<12)
 #define MYESNO				(1<<13)
+#define MFINDLIST			(1<<14)
 /* This really isnt all but close enough */
 #define	MALL				(MMAIN|MWHEREIS|MREPLACE|MREPLACE2|MGOTOLINE|MWRITEFILE|MINSERTFILE|MEXTCMD|MSPELL|MBROWSER|MWHEREISFILE|MGOTODIR|MHELP)
 
@@ -746,6 +1015,8 @@ enum
 #define UNDO_DEL_DEL		(1<<0)
 #define UNDO_DEL_BACKSPACE	(1<<1)
 #define UNDO_SPLIT_MADENEW	(1<<2)
+#define UNDO_GROUP_INDENT	(1<<3)
+#define UNDO_GROUP_JUSTIFY	(1<<4)
 
 /* Since in ISO C you can't pass around function pointers anymore,
   let's make some integer macros for function names, and then I
@@ -904,6 +1175,8 @@ enum
 #define DO_CUT_TEXT 149
 #define DO_NEXT_WORD 150
 #define DO_PREV_WORD 151
+#define DO_FIND_ALL 152
+#define DO_FIND_IN_BUFFERS 153
 
 
 
@@ -926,10 +1199,55 @@ enum
 /* The default width of a tab in spaces. */
 #define WIDTH_OF_TAB 8
 
+/* The default number of kilobytes that the undo items of a buffer may
+ * take up in memory before the oldest ones are written out to a
+ * temporary file. */
+#define UNDO_BUDGET 65536
+
+/* The default number of kilobytes that the cutbuffer may take up in
+ * memory before its text is written out to a temporary file. */
+#define CUT_BUDGET 65536
+
+/* The number of milliseconds that nothing may be typed before the
+ * journals of the buffers are brought up to date. */
+#define JOURNAL_DELAY 1000
+
 /* The maximum number of search/replace history strings saved, not
  * counting the blank lines at their ends. */
 #define MAX_SEARCH_HISTORY 100
 
+/* The maximum number of compiled regexes that nobody is using which
+ * we keep around in case they're asked for again. */
+#define MAX_REGEXP_CACHE 64
+
+/* The most pieces of text that write_file() hands to writev() at
+ * once. */
+#define MAX_WRITE_PIECES 1024
+
+/* The number of lines in each piece of the buffer that a "find all"
+ * search hands to a thread, and the most threads it will use. */
+#define FINDALL_CHUNK_LINES 4096
+#define FINDALL_MAX_THREADS 16
+
+/* The smallest piece of a file that read_file() hands to a thread, and
+ * the most threads it will use. */
+#define READ_CHUNK_MIN 1048576
+#define READ_MAX_THREADS 16
+
+/* The number of lines whose search matches we keep around for
+ * highlighting. */
+#define MATCH_CACHE_SIZE 256
+
+/* The number of lines that an incremental search goes through between
+ * checks for a new keystroke. */
+#define INCSEARCH_CHECK_LINES 1024
+
+/* The number of lines in each block of the bracket index. */
+#define BRACKET_BLOCK_LINES 256
+
+/* The shortest line that gets a gap at the cursor to type into. */
+#define LINE_GAP_MIN 4096
+
 /* The maximum number of bytes buffered at one time. */
 #define MAX_BUF_SIZE 128
 
@@ -930,6 +930,9 @@ const sc *get_prompt_string(int *actual, bool allow_tabs,
 	/* The length of the original string that we're trying to
 	 * tab complete, if any. */
 #endif
+    char *searched = NULL;
+	/* The answer as it was when we last looked for it, if we're
+	 * searching as it's typed. */
 #endif /* !NANO_TINY */
 
     answer = mallocstrcpy(answer, curranswer);
@@ -955,6 +958,11 @@ const sc *get_prompt_string(int *actual, bool allow_tabs,
 
     currmenu = menu;
 
+#ifndef NANO_TINY
+    if (menu == MWHEREIS && ISSET(INCREMENTAL_SEARCH))
+	searched = mallocstrcpy(NULL, answer);
+#endif
+
 #ifdef DEBUG
 fprintf(stderr, "get_prompt_string: answer = \"%s\", statusbar_x = %lu\n", answer, (unsigned long) statusbar_x);
 #endif
@@ -1092,6 +1100,14 @@ fprintf(stderr, "get_prompt_string: answer = \"%s\", statusbar_x = %lu\n", answe
 	last_kbinput = kbinput;
 #endif
 
+#ifndef NANO_TINY
+	/* Look for the answer again whenever it has changed. */
+	if (searched != NULL && strcmp(answer, searched) != 0) {
+	    searched = mallocstrcpy(searched, answer);
+	    incremental_search(answer);
+	}
+#endif
+
 	reset_statusbar_cursor();
 	wnoutrefresh(bottomwin);
     }
@@ -1106,6 +1122,9 @@ fprintf(stderr, "get_prompt_string: answer = \"%s\", statusbar_x = %lu\n", answe
 	if (magichistory != NULL)
 	    free(magichistory);
     }
+
+    if (searched != NULL)
+	free(searched);
 #endif
 
 
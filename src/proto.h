@@ -58,6 +58,12 @@ extern openfilestruct *openfile;
 
 #ifndef NANO_TINY
 extern char *matchbrackets;
+extern ssize_t undo_budget;
+extern ssize_t cut_budget;
+extern FILE *cut_spill;
+extern spillrange *cut_spill_range;
+extern size_t cut_spill_lines;
+extern filemap *filemaps;
 #endif
 
 #if !defined(NANO_TINY) && defined(ENABLE_NANORC)
@@ -100,6 +106,7 @@ extern subnfunc *allfuncs;
 #ifdef ENABLE_COLOR
 extern syntaxtype *syntaxes;
 extern char *syntaxstr;
+extern int most_multis;
 #endif
 
 extern bool edit_refresh_needed;
@@ -116,7 +123,7 @@ extern filestruct *replacebot;
 #endif
 
 #ifdef HAVE_REGEX_H
-extern regex_t search_regexp;
+extern regex_t *search_regexp;
 extern regmatch_t regmatches[10];
 #endif
 
@@ -230,10 +237,20 @@ bool is_valid_mbstring(const char *s);
 void set_colorpairs(void);
 void color_init(void);
 void color_update(void);
+signed char *multidata_for(filestruct *fileptr, int id);
+void clear_multidata(filestruct *fileptr);
 #endif
 
 /* All functions in cut.c. */
 void cutbuffer_reset(void);
+void free_cutbuffer(void);
+#ifndef NANO_TINY
+spillrange *hold_spill_range(spillrange *range);
+void release_spill_range(spillrange *range);
+filestruct *unspill_cut(const spillrange *range, size_t nlines,
+	filestruct *top, filestruct **bot);
+#endif
+void finish_cut(void);
 void cut_line(void);
 #ifndef NANO_TINY
 void cut_marked(void);
@@ -242,7 +259,7 @@ void cut_to_eof(void);
 #endif
 void do_cut_text(
 #ifndef NANO_TINY
-	bool copy_text, bool cut_till_end, bool undoing
+	bool cut_till_end, bool undoing
 #else
 	void
 #endif
@@ -301,6 +318,16 @@ bool write_marked_file(const char *name, FILE *f_open, bool tmp,
 #endif
 bool do_writeout(bool exiting);
 void do_writeout_void(void);
+#ifndef NANO_TINY
+int replace_in_files(const char *needle, const char *replacement, char
+	**args, int nargs);
+void open_journal(void);
+bool flush_journal(void);
+bool journals_pending(void);
+void flush_journals(void);
+void restart_journal(void);
+void discard_journal(void);
+#endif
 char *real_dir_from_tilde(const char *buf);
 #if !defined(DISABLE_TABCOMP) || !defined(DISABLE_BROWSER)
 int diralphasort(const void *va, const void *vb);
@@ -407,18 +434,48 @@ void do_right(void);
 /* All functions in nano.c. */
 filestruct *make_new_node(filestruct *prevnode);
 filestruct *copy_node(const filestruct *src);
+#ifndef NANO_TINY
+filestruct *share_node(filestruct *src);
+void unshare_node(filestruct *fileptr);
+void unshare_current_lines(void);
+void unshare_lines(void);
+#endif
 void splice_node(filestruct *begin, filestruct *newnode, filestruct
 	*end);
 void unlink_node(const filestruct *fileptr);
+#ifndef NANO_TINY
+bool make_gap(size_t room);
+void gap_insert(const char *text, size_t len);
+size_t gap_expose(void);
+void gap_erase(size_t len);
+const char *gap_tail(const filestruct *fileptr);
+void close_gap(void);
+void hold_lengths(void);
+void release_lengths(void);
+void set_line_len(filestruct *fileptr, size_t len, size_t chars);
+void measure_line(filestruct *fileptr);
+void adjust_line_len(filestruct *fileptr, ssize_t len, ssize_t chars);
+#endif
+size_t line_len(const filestruct *fileptr);
+size_t line_chars(filestruct *fileptr);
 void delete_node(filestruct *fileptr);
-filestruct *copy_filestruct(const filestruct *src);
+filestruct *copy_filestruct(filestruct *src);
 void free_filestruct(filestruct *src);
 void renumber(filestruct *fileptr);
+void renumber_partly(filestruct *fileptr, ssize_t added);
+void finish_renumbering(void);
+#ifndef NANO_TINY
+void mark_changed(const filestruct *top, const filestruct *bot);
+#endif
 partition *partition_filestruct(filestruct *top, size_t top_x,
 	filestruct *bot, size_t bot_x);
 void unpartition_filestruct(partition **p);
 void move_to_filestruct(filestruct **file_top, filestruct **file_bot,
 	filestruct *top, size_t top_x, filestruct *bot, size_t bot_x);
+#ifndef NANO_TINY
+void copy_to_filestruct(filestruct **file_top, filestruct **file_bot,
+	filestruct *top, size_t top_x, filestruct *bot, size_t bot_x);
+#endif
 void copy_from_filestruct(filestruct *file_top, filestruct *file_bot);
 openfilestruct *make_new_opennode(void);
 void splice_opennode(openfilestruct *begin, openfilestruct *newnode,
@@ -479,6 +536,9 @@ int do_input(bool *meta_key, bool *func_key, bool *have_shortcut, bool
 #ifndef DISABLE_MOUSE
 int do_mouse(void);
 #endif
+#ifdef ENABLE_COLOR
+void precalc_multicolorinfo(void);
+#endif
 void do_output(char *output, size_t output_len, bool allow_cntrls);
 
 /* All functions in prompt.c. */
@@ -553,7 +613,6 @@ void parse_include(char *ptr);
 short color_to_short(const char *colorname, bool *bright);
 void parse_colors(char *ptr, bool icase);
 void reset_multis(filestruct *fileptr, bool force);
-void alloc_multidata_if_needed(filestruct *fileptr);
 #endif
 void parse_rcfile(FILE *rcstream
 #ifdef ENABLE_COLOR
@@ -579,14 +638,26 @@ bool findnextstr(
 	bool no_sameline, const filestruct *begin, size_t begin_x, const
 	char *needle, size_t *needle_len);
 void findnextstr_wrap_reset(void);
+#ifndef NANO_TINY
+void incremental_search(const char *needle);
+#endif
 void do_search(void);
 #ifndef NANO_TINY
+void free_matchindex(matchindex *mi);
+bool find_all(openfilestruct *file, const char *needle);
+void do_find_all(void);
 void do_research(void);
+#ifdef ENABLE_MULTIBUFFER
+void do_find_in_buffers(void);
+#endif
 #endif
 #ifdef HAVE_REGEX_H
 int replace_regexp(char *string, bool create);
 #endif
 char *replace_line(const char *needle);
+#ifndef NANO_TINY
+ssize_t replace_in_buffer(const char *needle);
+#endif
 ssize_t do_replace_loop(
 #ifndef DISABLE_SPELLER
 	bool whole_word,
@@ -603,6 +674,7 @@ void do_gotopos(ssize_t pos_line, size_t pos_x, ssize_t pos_y, size_t
 #endif
 #ifndef NANO_TINY
 bool find_bracket_match(bool reverse, const char *bracket_set);
+void free_bracketindex(bracketindex *bi);
 void do_find_bracket(void);
 #ifdef ENABLE_NANORC
 bool history_has_changed(void);
@@ -630,6 +702,8 @@ void do_tab(void);
 void do_indent(ssize_t cols);
 void do_indent_void(void);
 void do_unindent(void);
+bool spill_string(FILE *f, const char *s, size_t len);
+bool unspill_string(FILE *f, char **s, size_t *len);
 void do_undo(void);
 void do_redo(void);
 #endif
@@ -697,6 +771,12 @@ ssize_t ngetdelim(char **lineptr, size_t *n, int delim, FILE *stream);
 #endif
 #ifdef HAVE_REGEX_H
 bool regexp_bol_or_eol(const regex_t *preg, const char *string);
+regex_t *regexp_cache_get(const char *regex, int cflags, char
+	**errmsg);
+void regexp_cache_release(regex_t *preg);
+#ifdef DEBUG
+void regexp_cache_free(void);
+#endif
 const char *fixbounds(const char *r);
 #endif
 #ifndef DISABLE_SPELLER
@@ -720,10 +800,18 @@ void new_magicline(void);
 void remove_magicline(void);
 void mark_order(const filestruct **top, size_t *top_x, const filestruct
 	**bot, size_t *bot_x, bool *right_side_up);
+void account_undo(undo *u);
+size_t undo_line_size(const filestruct *f);
+void free_undo_stack(undo *u);
+void set_undo_line(undo *u, filestruct *line);
 void add_undo(undo_type current_action);
 void update_undo(undo_type action);
+void begin_undo_group(filestruct *top, const filestruct *bot, int
+	xflags);
+void commit_undo_group(void);
+void discard_undo_group(void);
 #endif
-size_t get_totsize(const filestruct *begin, const filestruct *end);
+size_t get_totsize(filestruct *begin, const filestruct *end);
 filestruct *fsfromline(ssize_t lineno);
 #ifdef DEBUG
 void dump_filestruct(const filestruct *inptr);
@@ -771,6 +859,9 @@ void statusbar(const char *msg, ...);
 void bottombars(int menu);
 void onekey(const char *keystroke, const char *desc, size_t len);
 void reset_cursor(void);
+#ifndef NANO_TINY
+bool set_match_highlight(const char *needle);
+#endif
 void edit_draw(filestruct *fileptr, const char *converted, int
 	line, size_t start);
 int update_line(filestruct *fileptr, size_t index);
@@ -82,7 +82,12 @@ static const rcoption rcopts[] = {
     {"backwards", BACKWARDS_SEARCH},
     {"casesensitive", CASE_SENSITIVE},
     {"cut", CUT_TO_END},
+    {"cutbudget", 0},
+    {"highlightmatches", HIGHLIGHT_MATCHES},
     {"historylog", HISTORYLOG},
+    {"incrementalsearch", INCREMENTAL_SEARCH},
+    {"journal", JOURNAL},
+    {"mapfiles", MAP_FILES},
     {"matchbrackets", 0},
     {"noconvert", NO_CONVERT},
     {"quiet", QUIET},
@@ -91,6 +96,7 @@ static const rcoption rcopts[] = {
     {"smooth", SMOOTH_SCROLL},
     {"tabstospaces", TABS_TO_SPACES},
     {"undo", UNDOABLE},
+    {"undobudget", 0},
     {"whitespace", 0},
     {"wordbounds", WORD_BOUNDS},
     {"softwrap", SOFTWRAP},
@@ -223,24 +229,24 @@ char *parse_next_regex(char *ptr)
 }
 
 /* Compile the regular expression regex to see if it's valid.  Return
- * TRUE if it is, or FALSE otherwise. */
+ * TRUE if it is, or FALSE otherwise.  The compiled form stays in the
+ * regex cache, so that color_update() doesn't have to compile it
+ * again. */
 bool nregcomp(const char *regex, int eflags)
 {
-    regex_t preg;
     const char *r = fixbounds(regex);
-    int rc = regcomp(&preg, r, REG_EXTENDED | eflags);
-
-    if (rc != 0) {
-	size_t len = regerror(rc, &preg, NULL, 0);
-	char *str = charalloc(len);
-
-	regerror(rc, &preg, str, len);
-	rcfile_error(N_("Bad regex \"%s\": %s"), r, str);
-	free(str);
+    char *errmsg = NULL;
+    regex_t *preg = regexp_cache_get(r, REG_EXTENDED | eflags,
+	&errmsg);
+
+    if (preg == NULL) {
+	rcfile_error(N_("Bad regex \"%s\": %s"), r, errmsg);
+	free(errmsg);
+	return FALSE;
     }
 
-    regfree(&preg);
-    return (rc == 0);
+    regexp_cache_release(preg);
+    return TRUE;
 }
 
 /* Parse the next syntax string from the line at ptr, and add it to the
@@ -788,6 +794,8 @@ void parse_colors(char *ptr, bool icase)
 	    /* Lame way to skip another static counter */
             newcolor->id = endsyntax->nmultis;
             endsyntax->nmultis++;
+	    if (endsyntax->nmultis > most_multis)
+		most_multis = endsyntax->nmultis;
 	}
     }
 }
@@ -833,7 +841,7 @@ void parse_headers(char *ptr)
 	newheader = (exttype *)nmalloc(sizeof(exttype));
 
 	/* Save the regex string if it's valid */
-	if (nregcomp(regstr, 0)) {
+	if (nregcomp(regstr, REG_NOSUB)) {
 	    newheader->ext_regex = mallocstrcpy(NULL, regstr);
 	    newheader->ext = NULL;
 	    newheader->next = NULL;
@@ -1056,6 +1064,26 @@ void parse_rcfile(FILE *rcstream
 					parse_mbchar(whitespace +
 					whitespace_len[0], NULL, NULL);
 			    }
+			} else if (strcasecmp(rcopts[i].name,
+				"undobudget") == 0) {
+			    if (!parse_num(option, &undo_budget) ||
+				undo_budget < 0) {
+				rcfile_error(
+					N_("Requested undo budget \"%s\" is invalid"),
+					option);
+				undo_budget = UNDO_BUDGET;
+			    } else
+				free(option);
+			} else if (strcasecmp(rcopts[i].name,
+				"cutbudget") == 0) {
+			    if (!parse_num(option, &cut_budget) ||
+				cut_budget < 0) {
+				rcfile_error(
+					N_("Requested cut budget \"%s\" is invalid"),
+					option);
+				cut_budget = CUT_BUDGET;
+			    } else
+				free(option);
 			} else
 #endif
 #ifndef DISABLE_JUSTIFY
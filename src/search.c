@@ -29,6 +29,10 @@
 #include <ctype.h>
 #include <errno.h>
 #include <time.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#endif
 
 static bool search_last_line = FALSE;
 	/* Have we gone past the last line while searching? */
@@ -37,46 +41,38 @@ static bool history_changed = FALSE;
 	/* Have any of the history lists changed? */
 #endif
 #ifdef HAVE_REGEX_H
-static bool regexp_compiled = FALSE;
-	/* Have we compiled any regular expressions? */
-
 /* Compile the regular expression regexp to see if it's valid.  Return
- * TRUE if it is, or FALSE otherwise. */
+ * TRUE if it is, or FALSE otherwise.  The compiled form comes from the
+ * regex cache, so searching for the same regex again is cheap. */
 bool regexp_init(const char *regexp)
 {
-    int rc;
+    char *errmsg = NULL;
 
-    assert(!regexp_compiled);
+    assert(search_regexp == NULL);
 
-    rc = regcomp(&search_regexp, regexp, REG_EXTENDED
+    search_regexp = regexp_cache_get(regexp, REG_EXTENDED
 #ifndef NANO_TINY
 	| (ISSET(CASE_SENSITIVE) ? 0 : REG_ICASE)
 #endif
-	);
+	, &errmsg);
 
-    if (rc != 0) {
-	size_t len = regerror(rc, &search_regexp, NULL, 0);
-	char *str = charalloc(len);
-
-	regerror(rc, &search_regexp, str, len);
-	statusbar(_("Bad regex \"%s\": %s"), regexp, str);
-	free(str);
+    if (search_regexp == NULL) {
+	statusbar(_("Bad regex \"%s\": %s"), regexp, errmsg);
+	free(errmsg);
 
 	return FALSE;
     }
 
-    regexp_compiled = TRUE;
-
     return TRUE;
 }
 
-/* Decompile the compiled regular expression we used in the last
+/* Give back the compiled regular expression we used in the last
  * search, if any. */
 void regexp_cleanup(void)
 {
-    if (regexp_compiled) {
-	regexp_compiled = FALSE;
-	regfree(&search_regexp);
+    if (search_regexp != NULL) {
+	regexp_cache_release(search_regexp);
+	search_regexp = NULL;
     }
 }
 #endif
@@ -124,6 +120,278 @@ void search_init_globals(void)
 	last_replace = mallocstrcpy(NULL, "");
 }
 
+#ifndef NANO_TINY
+static bool incsearch_active = FALSE;
+	/* Are we searching as the search string is typed? */
+static filestruct *incsearch_top = NULL;
+	/* The first line of the edit window when the search began. */
+static filestruct *incsearch_origin = NULL;
+	/* The line the cursor was on when the search began. */
+static size_t incsearch_origin_x = 0, incsearch_origin_pww = 0;
+	/* The place of the cursor on that line, and where it wanted to
+	 * be. */
+static char *incsearch_needle = NULL;
+	/* The last string that was searched for all the way through, or
+	 * NULL if there isn't one yet. */
+static filestruct *incsearch_line = NULL;
+	/* The line of the match of incsearch_needle, or NULL if it wasn't
+	 * found. */
+static size_t incsearch_x = 0;
+	/* The place of that match in its line. */
+static bool incsearch_shown = FALSE;
+	/* Is that match highlighted at the cursor? */
+
+/* Return TRUE if a key is waiting to be read at the statusbar prompt.
+ * We peek at the keystroke buffer in nodelay mode, just as when
+ * checking for Cancel, but leave the key there for the prompt. */
+static bool incsearch_key_pending(void)
+{
+    enable_nodelay();
+    get_key_buffer(bottomwin);
+    disable_nodelay();
+
+    return (get_key_buffer_len() > 0);
+}
+
+/* Look for needle in the search direction, starting at x in line and
+ * wrapping around at most once.  x is the first place in line where a
+ * match may start, and may be one character before the start or after
+ * the end of it.  Return 1 and set *found_line, *found_x and *found_len
+ * if we found a match, 0 if there isn't any, and -1 if a key was
+ * pressed before we could finish. */
+static int incsearch_find(const char *needle, filestruct *line, size_t
+	x, filestruct **found_line, size_t *found_x, size_t *found_len)
+{
+    filestruct *fileptr = line;
+    const char *start = line->data + x, *found;
+    bool backwards = ISSET(BACKWARDS_SEARCH), last_line = FALSE;
+    size_t checked = 0;
+
+    while (TRUE) {
+	found = strstrwrapper(fileptr->data, needle, start);
+
+	/* Back on the line we started on, only the part we skipped at
+	 * first is left to search. */
+	if (found != NULL && last_line && (backwards ?
+		(ssize_t)(found - fileptr->data) <= (ssize_t)x :
+		(size_t)(found - fileptr->data) >= x))
+	    found = NULL;
+
+	if (found != NULL) {
+	    *found_line = fileptr;
+	    *found_x = found - fileptr->data;
+	    *found_len =
+#ifdef HAVE_REGEX_H
+		ISSET(USE_REGEXP) ?
+		regmatches[0].rm_eo - regmatches[0].rm_so :
+#endif
+		strlen(needle);
+	    return 1;
+	}
+
+	if (last_line)
+	    return 0;
+
+	/* Give up as soon as the search string changes again. */
+	if (++checked % INCSEARCH_CHECK_LINES == 0 &&
+		incsearch_key_pending())
+	    return -1;
+
+	fileptr = backwards ? fileptr->prev : fileptr->next;
+
+	if (fileptr == NULL)
+	    fileptr = backwards ? openfile->filebot : openfile->fileage;
+
+	if (fileptr == line)
+	    last_line = TRUE;
+
+	start = fileptr->data;
+	if (backwards)
+	    start += strlen(fileptr->data);
+    }
+}
+
+/* Take the highlighting off the match at the cursor, if it's there. */
+static void incsearch_unshow(void)
+{
+    if (incsearch_shown) {
+	update_line(openfile->current, openfile->current_x);
+	incsearch_shown = FALSE;
+    }
+}
+
+/* Put the cursor back where it was when the search began, with the edit
+ * window as it was then.  If later is TRUE, leave redrawing the edit
+ * window for after the command, as the real search is about to move
+ * the cursor again. */
+static void incsearch_restore(bool later)
+{
+    incsearch_unshow();
+
+    openfile->current = incsearch_origin;
+    openfile->current_x = incsearch_origin_x;
+    openfile->placewewant = incsearch_origin_pww;
+
+    if (openfile->edittop != incsearch_top) {
+	openfile->edittop = incsearch_top;
+	if (later)
+	    edit_refresh_needed = TRUE;
+	else
+	    edit_refresh();
+    }
+}
+
+/* Start an incremental search from the cursor, if they're turned on.
+ * If needle isn't blank, which happens when we come back to the prompt
+ * after a toggle, look for it right away. */
+static void incsearch_begin(const char *needle)
+{
+    if (!ISSET(INCREMENTAL_SEARCH))
+	return;
+
+    incsearch_active = TRUE;
+    incsearch_top = openfile->edittop;
+    incsearch_origin = openfile->current;
+    incsearch_origin_x = openfile->current_x;
+    incsearch_origin_pww = openfile->placewewant;
+
+    if (*needle != '\0')
+	incremental_search(needle);
+}
+
+/* Finish the incremental search, and put the cursor back where it was,
+ * so that the real search starts from there and finds the same match.
+ * keep is TRUE when the real search follows. */
+static void incsearch_end(bool keep)
+{
+    if (!incsearch_active)
+	return;
+
+    incsearch_restore(keep);
+
+    free(incsearch_needle);
+    incsearch_needle = NULL;
+    incsearch_line = NULL;
+    incsearch_active = FALSE;
+}
+
+/* Look for needle while it's being typed at the search prompt, and show
+ * the match that the real search would go to.  If needle just adds to
+ * the string we found last time, we carry on from that match instead
+ * of from the cursor, since no earlier place can match the longer
+ * string; and if that string wasn't found, this one won't be either.
+ * A keystroke arriving during the search cuts it short. */
+void incremental_search(const char *needle)
+{
+    filestruct *line = incsearch_origin, *found_line;
+    size_t x, found_x, found_len, xpt;
+    filestruct *old_current = openfile->current;
+    size_t old_pww = openfile->placewewant;
+#ifdef HAVE_REGEX_H
+    regex_t *old_regexp = search_regexp;
+#endif
+    char *exp_word;
+    int result;
+
+    if (!incsearch_active)
+	return;
+
+    /* Start over from the cursor when the search string is erased. */
+    if (*needle == '\0') {
+	incsearch_restore(FALSE);
+	free(incsearch_needle);
+	incsearch_needle = NULL;
+	if (set_match_highlight(NULL))
+	    edit_refresh();
+	wnoutrefresh(edit);
+	return;
+    }
+
+    x = ISSET(BACKWARDS_SEARCH) ? incsearch_origin_x - 1 :
+	incsearch_origin_x + 1;
+
+    if (incsearch_needle != NULL &&
+#ifdef HAVE_REGEX_H
+	!ISSET(USE_REGEXP) &&
+#endif
+	strncmp(needle, incsearch_needle,
+	strlen(incsearch_needle)) == 0) {
+	if (incsearch_line == NULL)
+	    return;
+
+	line = incsearch_line;
+	x = incsearch_x;
+    }
+
+#ifdef HAVE_REGEX_H
+    if (ISSET(USE_REGEXP)) {
+	/* A regex that is still being typed needn't be valid yet, so
+	 * leave things as they are until it is. */
+	search_regexp = regexp_cache_get(needle, REG_EXTENDED |
+		(ISSET(CASE_SENSITIVE) ? 0 : REG_ICASE), NULL);
+	if (search_regexp == NULL) {
+	    search_regexp = old_regexp;
+	    return;
+	}
+    }
+#endif
+
+    result = incsearch_find(needle, line, x, &found_line, &found_x,
+	&found_len);
+
+#ifdef HAVE_REGEX_H
+    if (ISSET(USE_REGEXP)) {
+	regexp_cache_release(search_regexp);
+	search_regexp = old_regexp;
+    }
+#endif
+
+    /* The search string has changed again, so leave the screen alone
+     * and let the next search take over. */
+    if (result == -1)
+	return;
+
+    incsearch_needle = mallocstrcpy(incsearch_needle, needle);
+
+    if (result == 0) {
+	incsearch_line = NULL;
+	incsearch_restore(FALSE);
+    } else {
+	incsearch_line = found_line;
+	incsearch_x = found_x;
+
+	incsearch_unshow();
+
+	openfile->current = found_line;
+	openfile->current_x = found_x;
+	openfile->placewewant = xplustabs();
+	edit_redraw(old_current, old_pww);
+    }
+
+    if (ISSET(HIGHLIGHT_MATCHES) && set_match_highlight(needle))
+	edit_refresh_needed = TRUE;
+
+    if (edit_refresh_needed) {
+	edit_refresh();
+	edit_refresh_needed = FALSE;
+    }
+
+    if (result == 1) {
+	xpt = xplustabs();
+	exp_word = display_string(openfile->current->data, xpt,
+		strnlenpt(openfile->current->data, openfile->current_x +
+		found_len) - xpt, FALSE);
+
+	do_replace_highlight(TRUE, exp_word);
+	incsearch_shown = TRUE;
+
+	free(exp_word);
+    }
+
+    wnoutrefresh(edit);
+}
+#endif /* !NANO_TINY */
+
 /* Set up the system variables for a search or replace.  If use_answer
  * is TRUE, only set backupstring to answer.  Return -2 to run the
  * opposite program (search -> replace, replace -> search), return -1 if
@@ -172,6 +440,12 @@ int search_init(bool replacing, bool use_answer)
     } else
 	buf = mallocstrcpy(NULL, "");
 
+#ifndef NANO_TINY
+    /* Show the matches as the search string is typed, if asked to. */
+    if (!replacing)
+	incsearch_begin(backupstring);
+#endif
+
     /* This is now one simple call.  It just does a lot. */
     i = do_prompt(FALSE,
 #ifndef DISABLE_TABCOMP
@@ -208,6 +482,10 @@ int search_init(bool replacing, bool use_answer)
 
     fflush(stderr);
 
+#ifndef NANO_TINY
+    incsearch_end(i == 0);
+#endif
+
     /* Release buf now that we don't need it anymore. */
     free(buf);
 
@@ -455,11 +733,16 @@ void do_search(void)
 
     i = search_init(FALSE, FALSE);
 
-    if (i == -1)
+    if (i == -1) {
 	/* Cancel, Go to Line, blank search string, or regcomp()
 	 * failed. */
 	search_replace_abort();
-    else if (i == -2)
+#ifndef NANO_TINY
+	/* Stop highlighting the matches of the last search. */
+	if (set_match_highlight(NULL))
+	    edit_refresh();
+#endif
+    } else if (i == -2)
 	/* Replace. */
 	do_replace();
 #if !defined(NANO_TINY) || defined(HAVE_REGEX_H)
@@ -501,7 +784,7 @@ void do_search(void)
 	 * that we find one only once per line.  We should only end up
 	 * back at the same position if the string isn't found again, in
 	 * which case it's the only occurrence. */
-	if (ISSET(USE_REGEXP) && regexp_bol_or_eol(&search_regexp,
+	if (ISSET(USE_REGEXP) && regexp_bol_or_eol(search_regexp,
 		last_search)) {
 	    didfind = findnextstr(
 #ifndef DISABLE_SPELLER
@@ -522,10 +805,560 @@ void do_search(void)
 
     openfile->placewewant = xplustabs();
     edit_redraw(fileptr, pww_save);
+#ifndef NANO_TINY
+    if (ISSET(HIGHLIGHT_MATCHES) && set_match_highlight(last_search))
+	edit_refresh();
+#endif
     search_replace_abort();
 }
 
 #ifndef NANO_TINY
+static findallchunk *findall_chunks = NULL;
+	/* The pieces of the buffer that a "find all" search goes
+	 * through. */
+static size_t findall_nchunks = 0;
+	/* How many pieces there are. */
+static size_t findall_next = 0;
+	/* The first piece that nobody has started on yet. */
+static volatile bool findall_cancelled = FALSE;
+	/* Has the user cancelled the "find all" search? */
+static const char *findall_needle = NULL;
+	/* The string that the "find all" search is looking for. */
+#ifdef HAVE_REGEX_H
+static const regex_t *findall_regexp = NULL;
+	/* The compiled form of the string, if it's a regex or if case
+	 * doesn't matter. */
+static char *findall_pattern = NULL;
+	/* The string that findall_regexp was compiled from. */
+static int findall_cflags = 0;
+	/* The flags that findall_regexp was compiled with. */
+#endif
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t findall_mutex = PTHREAD_MUTEX_INITIALIZER;
+	/* Guards findall_next and findall_running. */
+static pthread_cond_t findall_cond = PTHREAD_COND_INITIALIZER;
+	/* Signaled when a thread is done. */
+static size_t findall_running = 0;
+	/* How many threads are still searching. */
+#endif
+
+/* Return TRUE if the user has pressed Cancel.  The keys are read as
+ * in the search prompt, since ^C means something else in the edit
+ * window.  The edit window should be in nodelay mode, so that we don't
+ * wait for a key. */
+static bool cancel_requested(void)
+{
+    int oldmenu = currmenu;
+    const subnfunc *f;
+
+    currmenu = MWHEREIS;
+    f = getfuncfromkey(edit);
+    currmenu = oldmenu;
+
+    return (f != NULL && f->scfunc == CANCEL_MSG);
+}
+
+#ifdef HAVE_REGEX_H
+/* Return a copy of string with all the characters that mean something
+ * in an extended regex escaped, so that it only matches itself. */
+static char *regexp_escape(const char *string)
+{
+    char *escaped = charalloc(strlen(string) * 2 + 1), *p = escaped;
+
+    for (; *string != '\0'; string++) {
+	if (strchr("\\^$.[]|()*+?{}", *string) != NULL)
+	    *(p++) = '\\';
+	*(p++) = *string;
+    }
+    *p = '\0';
+
+    return escaped;
+}
+#endif
+
+/* Return the first match of the "find all" search string in line that
+ * begins at or after start, or NULL if there isn't one.  preg is the
+ * compiled regex to use, if any. */
+static const char *findall_strstr(const char *line, const char *start
+#ifdef HAVE_REGEX_H
+	, const regex_t *preg
+#endif
+	)
+{
+#ifdef HAVE_REGEX_H
+    if (preg != NULL) {
+	regmatch_t match;
+
+	if (regexec(preg, start, 1, &match, (start > line) ?
+		REG_NOTBOL : 0) != 0)
+	    return NULL;
+
+	return start + match.rm_so;
+    }
+#endif
+    if (ISSET(CASE_SENSITIVE))
+	return strstr(start, findall_needle);
+    else
+	return mbstrcasestr(start, findall_needle);
+}
+
+/* Collect all the matches in the lines of chunk, in order.  After each
+ * match we look again one character further on, just like a repeated
+ * findnextstr() would.  We step over a multibyte character by hand,
+ * since the functions in chars.c that do it aren't safe to call from
+ * several threads at once. */
+static void findall_chunk(findallchunk *chunk
+#ifdef HAVE_REGEX_H
+	, const regex_t *preg
+#endif
+	)
+{
+    const filestruct *fileptr = chunk->first;
+    size_t i;
+
+    for (i = 0; i < chunk->lines && !findall_cancelled; i++,
+	fileptr = fileptr->next) {
+	const char *found = fileptr->data;
+
+	while ((found = findall_strstr(fileptr->data, found
+#ifdef HAVE_REGEX_H
+		, preg
+#endif
+		)) != NULL) {
+	    if (chunk->count == chunk->size) {
+		chunk->size = (chunk->size == 0) ? 32 : chunk->size * 2;
+		chunk->matches = (matchtype *)nrealloc(chunk->matches,
+			chunk->size * sizeof(matchtype));
+	    }
+
+	    chunk->matches[chunk->count].lineno = fileptr->lineno;
+	    chunk->matches[chunk->count].x = found - fileptr->data;
+	    chunk->count++;
+
+	    /* An empty match at the end of the line is the last one. */
+	    if (*found == '\0')
+		break;
+
+	    found++;
+	    if (using_utf8())
+		while ((*found & 0xC0) == 0x80)
+		    found++;
+	}
+    }
+}
+
+#ifdef HAVE_PTHREAD_H
+/* Take pieces of the buffer one at a time and search them, until there
+ * are none left or the user has cancelled.  Each thread compiles the
+ * regex for itself if it can, since threads sharing one compiled regex
+ * would only take turns using it. */
+static void *findall_thread(void *dummy)
+{
+#ifdef HAVE_REGEX_H
+    regex_t own_regexp;
+    const regex_t *preg = findall_regexp;
+
+    if (preg != NULL && regcomp(&own_regexp, findall_pattern,
+	findall_cflags) == 0)
+	preg = &own_regexp;
+#endif
+
+    while (TRUE) {
+	findallchunk *chunk = NULL;
+
+	pthread_mutex_lock(&findall_mutex);
+	if (findall_next < findall_nchunks && !findall_cancelled)
+	    chunk = &findall_chunks[findall_next++];
+	pthread_mutex_unlock(&findall_mutex);
+
+	if (chunk == NULL)
+	    break;
+
+	findall_chunk(chunk
+#ifdef HAVE_REGEX_H
+		, preg
+#endif
+		);
+    }
+
+#ifdef HAVE_REGEX_H
+    if (preg == &own_regexp)
+	regfree(&own_regexp);
+#endif
+
+    pthread_mutex_lock(&findall_mutex);
+    findall_running--;
+    pthread_cond_signal(&findall_cond);
+    pthread_mutex_unlock(&findall_mutex);
+
+    return NULL;
+}
+
+/* Search the pieces of the buffer with up to nthreads threads, checking
+ * now and then whether the user wants to cancel.  Return FALSE if no
+ * thread could be started, in which case nothing has been searched. */
+static bool findall_threads(size_t nthreads)
+{
+    pthread_t threads[FINDALL_MAX_THREADS];
+    sigset_t allsigs, oldsigs;
+    size_t i, started = 0;
+
+    /* Keep all signals away from the threads; only we handle them. */
+    sigfillset(&allsigs);
+    pthread_sigmask(SIG_SETMASK, &allsigs, &oldsigs);
+
+    pthread_mutex_lock(&findall_mutex);
+    for (i = 0; i < nthreads; i++) {
+	if (pthread_create(&threads[started], NULL, findall_thread,
+		NULL) == 0) {
+	    started++;
+	    findall_running++;
+	}
+    }
+    pthread_mutex_unlock(&findall_mutex);
+
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+    if (started == 0)
+	return FALSE;
+
+    enable_nodelay();
+
+    pthread_mutex_lock(&findall_mutex);
+    while (findall_running > 0) {
+	struct timespec wakeup;
+
+	clock_gettime(CLOCK_REALTIME, &wakeup);
+	wakeup.tv_nsec += 100000000;
+	if (wakeup.tv_nsec >= 1000000000) {
+	    wakeup.tv_sec++;
+	    wakeup.tv_nsec -= 1000000000;
+	}
+
+	if (pthread_cond_timedwait(&findall_cond, &findall_mutex,
+		&wakeup) == ETIMEDOUT && !findall_cancelled) {
+	    pthread_mutex_unlock(&findall_mutex);
+	    if (cancel_requested())
+		findall_cancelled = TRUE;
+	    pthread_mutex_lock(&findall_mutex);
+	}
+    }
+    pthread_mutex_unlock(&findall_mutex);
+
+    disable_nodelay();
+
+    for (i = 0; i < started; i++)
+	pthread_join(threads[i], NULL);
+
+    return TRUE;
+}
+#endif /* HAVE_PTHREAD_H */
+
+/* Free the match index mi. */
+void free_matchindex(matchindex *mi)
+{
+    free(mi->needle);
+    free(mi->matches);
+    free(mi);
+}
+
+/* Search the pieces in findall_chunks for needle, with as many threads
+ * as there are processors, or by ourselves when that isn't possible.
+ * search_regexp must already be compiled if we're doing a regex search.
+ * Return FALSE if the user cancelled. */
+static bool findall_search(const char *needle)
+{
+    bool searched = FALSE;
+    size_t i;
+#ifdef HAVE_PTHREAD_H
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    bool thread_safe = ISSET(CASE_SENSITIVE);
+#endif
+
+    findall_next = 0;
+    findall_cancelled = FALSE;
+    findall_needle = needle;
+
+#ifdef HAVE_REGEX_H
+    /* A literal search that ignores case is done with an escaped regex,
+     * since the multibyte case-insensitive comparison isn't safe to do
+     * from several threads at once. */
+    findall_regexp = NULL;
+    findall_pattern = NULL;
+    if (ISSET(USE_REGEXP)) {
+	findall_regexp = search_regexp;
+	findall_pattern = mallocstrcpy(NULL, needle);
+	findall_cflags = REG_EXTENDED | (ISSET(CASE_SENSITIVE) ? 0 :
+		REG_ICASE);
+    } else if (!ISSET(CASE_SENSITIVE)) {
+	findall_pattern = regexp_escape(needle);
+	findall_cflags = REG_EXTENDED | REG_ICASE;
+	findall_regexp = regexp_cache_get(findall_pattern,
+		findall_cflags, NULL);
+    }
+#ifdef HAVE_PTHREAD_H
+    if (findall_regexp != NULL)
+	thread_safe = TRUE;
+#endif
+#endif
+
+#ifdef HAVE_PTHREAD_H
+    if (ncpus > FINDALL_MAX_THREADS)
+	ncpus = FINDALL_MAX_THREADS;
+    if (ncpus > (long)findall_nchunks)
+	ncpus = findall_nchunks;
+
+    if (thread_safe && ncpus > 1)
+	searched = findall_threads(ncpus);
+#endif
+
+    /* Otherwise, search the pieces one after the other ourselves. */
+    if (!searched) {
+	time_t lastkbcheck = time(NULL);
+
+	enable_nodelay();
+	for (i = 0; i < findall_nchunks && !findall_cancelled; i++) {
+	    findall_chunk(&findall_chunks[i]
+#ifdef HAVE_REGEX_H
+		, findall_regexp
+#endif
+		);
+
+	    if (time(NULL) - lastkbcheck > 1) {
+		lastkbcheck = time(NULL);
+		if (cancel_requested())
+		    findall_cancelled = TRUE;
+	    }
+	}
+	disable_nodelay();
+    }
+
+#ifdef HAVE_REGEX_H
+    if (findall_regexp != NULL && findall_regexp != search_regexp)
+	regexp_cache_release((regex_t *)findall_regexp);
+    findall_regexp = NULL;
+    free(findall_pattern);
+    findall_pattern = NULL;
+#endif
+    findall_needle = NULL;
+
+    return !findall_cancelled;
+}
+
+/* Gather the matches found in the n pieces of findall_chunks starting
+ * at first into a new match index for needle in file, and put it in
+ * place of file's old one. */
+static void findall_collect(openfilestruct *file, const char *needle,
+	size_t first, size_t n)
+{
+    matchindex *mi = (matchindex *)nmalloc(sizeof(matchindex));
+    size_t i, count = 0;
+
+    for (i = first; i < first + n; i++)
+	count += findall_chunks[i].count;
+
+    mi->needle = mallocstrcpy(NULL, needle);
+    mi->case_sensitive = ISSET(CASE_SENSITIVE);
+    mi->regexp = ISSET(USE_REGEXP);
+    mi->version = file->version;
+    mi->matches = (matchtype *)nmalloc(count * sizeof(matchtype));
+    mi->count = 0;
+
+    for (i = first; i < first + n; i++) {
+	memcpy(mi->matches + mi->count, findall_chunks[i].matches,
+		findall_chunks[i].count * sizeof(matchtype));
+	mi->count += findall_chunks[i].count;
+    }
+
+    if (file->found != NULL)
+	free_matchindex(file->found);
+    file->found = mi;
+}
+
+/* Free the pieces in findall_chunks, along with their matches. */
+static void findall_free_chunks(void)
+{
+    size_t i;
+
+    for (i = 0; i < findall_nchunks; i++)
+	free(findall_chunks[i].matches);
+    free(findall_chunks);
+    findall_chunks = NULL;
+    findall_nchunks = 0;
+}
+
+/* Find all the matches of needle in file, and remember them in file's
+ * match index, so that do_research() can step through them without
+ * searching again.  The buffer is cut into pieces of
+ * FINDALL_CHUNK_LINES lines, which are handed out to as many threads as
+ * there are processors.  search_regexp must already be compiled if
+ * we're doing a regex search.  Return FALSE if the user cancelled, in
+ * which case file's match index is left alone. */
+bool find_all(openfilestruct *file, const char *needle)
+{
+    const filestruct *fileptr = file->fileage;
+    size_t nlines = file->filebot->lineno, i;
+    bool done;
+
+    assert(file != NULL && needle != NULL);
+
+    findall_nchunks = (nlines + FINDALL_CHUNK_LINES - 1) /
+	FINDALL_CHUNK_LINES;
+    findall_chunks = (findallchunk *)nmalloc(findall_nchunks *
+	sizeof(findallchunk));
+
+    for (i = 0; i < findall_nchunks; i++) {
+	size_t j;
+
+	findall_chunks[i].first = fileptr;
+	findall_chunks[i].lines = (nlines > FINDALL_CHUNK_LINES) ?
+		FINDALL_CHUNK_LINES : nlines;
+	findall_chunks[i].matches = NULL;
+	findall_chunks[i].count = 0;
+	findall_chunks[i].size = 0;
+
+	nlines -= findall_chunks[i].lines;
+	for (j = 0; j < findall_chunks[i].lines && fileptr != NULL; j++)
+	    fileptr = fileptr->next;
+    }
+
+    done = findall_search(needle);
+
+    if (done)
+	findall_collect(file, needle, 0, findall_nchunks);
+
+    findall_free_chunks();
+
+    return done;
+}
+
+/* Count all the matches of the last search string in the current
+ * buffer, and remember where they are. */
+void do_find_all(void)
+{
+    search_init_globals();
+
+    if (last_search[0] == '\0') {
+	statusbar(_("No current search pattern"));
+	return;
+    }
+
+#ifdef HAVE_REGEX_H
+    if (ISSET(USE_REGEXP) && !regexp_init(last_search))
+	return;
+#endif
+
+    if (!find_all(openfile, last_search))
+	statusbar(_("Cancelled"));
+    else if (openfile->found->count == 0)
+	not_found_msg(last_search);
+    else
+	statusbar(P_("Found %lu occurrence", "Found %lu occurrences",
+		(unsigned long)openfile->found->count),
+		(unsigned long)openfile->found->count);
+
+    if (ISSET(HIGHLIGHT_MATCHES) && set_match_highlight(last_search))
+	edit_refresh();
+    search_replace_abort();
+}
+
+/* Return TRUE if file's match index was made for needle with the
+ * current search options, and the text hasn't changed since. */
+static bool matchindex_current(const openfilestruct *file, const char
+	*needle)
+{
+    const matchindex *mi = file->found;
+
+    return (mi != NULL && mi->version == file->version &&
+	strcmp(mi->needle, needle) == 0 && mi->case_sensitive ==
+	ISSET(CASE_SENSITIVE) && mi->regexp == ISSET(USE_REGEXP));
+}
+
+/* Return the number of matches in mi that lie before (lineno, x), or,
+ * when searching forward, at it.  So this is the first match that lies
+ * beyond that place, or, when searching backwards, the first one that
+ * doesn't lie before it. */
+static size_t matchindex_after(const matchindex *mi, ssize_t lineno,
+	size_t x)
+{
+    size_t lo = 0, hi = mi->count;
+
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	const matchtype *m = &mi->matches[mid];
+
+	if (m->lineno < lineno || (m->lineno == lineno &&
+		(ISSET(BACKWARDS_SEARCH) ? m->x < x : m->x <= x)))
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
+
+/* Move the cursor in the current buffer to the match m. */
+static void goto_match(const matchtype *m)
+{
+    filestruct *fileptr = openfile->current;
+
+    while (fileptr->lineno < m->lineno)
+	fileptr = fileptr->next;
+    while (fileptr->lineno > m->lineno)
+	fileptr = fileptr->prev;
+
+    openfile->current = fileptr;
+    openfile->current_x = m->x;
+    openfile->current_y = fileptr->lineno -
+	openfile->edittop->lineno;
+}
+
+/* If the current buffer's match index was made for needle with the
+ * current search options, and the text hasn't changed since, move to
+ * the next match in it (or the previous one when searching backwards)
+ * and return TRUE.  Otherwise return FALSE, and leave it to
+ * findnextstr(). */
+static bool findnextstr_indexed(const char *needle)
+{
+    const matchindex *mi = openfile->found;
+    size_t lo, target;
+
+    if (!matchindex_current(openfile, needle))
+	return FALSE;
+
+    if (mi->count == 0) {
+	not_found_msg(needle);
+	return TRUE;
+    }
+
+    lo = matchindex_after(mi, openfile->current->lineno,
+	openfile->current_x);
+
+    if (ISSET(BACKWARDS_SEARCH)) {
+	if (lo == 0) {
+	    target = mi->count - 1;
+	    statusbar(_("Search Wrapped"));
+	} else
+	    target = lo - 1;
+    } else {
+	if (lo == mi->count) {
+	    target = 0;
+	    statusbar(_("Search Wrapped"));
+	} else
+	    target = lo;
+    }
+
+    if (mi->matches[target].lineno == openfile->current->lineno &&
+	mi->matches[target].x == openfile->current_x) {
+	statusbar(_("This is the only occurrence"));
+	return TRUE;
+    }
+
+    goto_match(&mi->matches[target]);
+
+    return TRUE;
+}
+
 /* Search for the last string without prompting. */
 void do_research(void)
 {
@@ -536,6 +1369,17 @@ void do_research(void)
 
     search_init_globals();
 
+    /* If we've already found all the matches of this search, and the
+     * text hasn't changed since, just step to the next one. */
+    if (last_search[0] != '\0' && findnextstr_indexed(last_search)) {
+	openfile->placewewant = xplustabs();
+	edit_redraw(fileptr, pww_save);
+	if (ISSET(HIGHLIGHT_MATCHES) && set_match_highlight(last_search))
+	    edit_refresh();
+	search_replace_abort();
+	return;
+    }
+
     if (last_search[0] != '\0') {
 #ifdef HAVE_REGEX_H
 	/* Since answer is "", use last_search! */
@@ -561,7 +1405,7 @@ void do_research(void)
 	     * "^$"), so that we find one only once per line.  We should
 	     * only end up back at the same position if the string isn't
 	     * found again, in which case it's the only occurrence. */
-	    if (ISSET(USE_REGEXP) && regexp_bol_or_eol(&search_regexp,
+	    if (ISSET(USE_REGEXP) && regexp_bol_or_eol(search_regexp,
 		last_search)) {
 		didfind = findnextstr(
 #ifndef DISABLE_SPELLER
@@ -584,57 +1428,373 @@ void do_research(void)
 
     openfile->placewewant = xplustabs();
     edit_redraw(fileptr, pww_save);
+    if (ISSET(HIGHLIGHT_MATCHES) && last_search[0] != '\0' &&
+	set_match_highlight(last_search))
+	edit_refresh();
     search_replace_abort();
 }
-#endif
 
-#ifdef HAVE_REGEX_H
-int replace_regexp(char *string, bool create)
+#ifdef ENABLE_MULTIBUFFER
+/* Find all the matches of needle in every open buffer, and remember
+ * them in each buffer's match index.  Each buffer is one piece of the
+ * search, so that every buffer is searched exactly once, by a single
+ * thread.  The threads read the buffers in place, since nothing can
+ * change them until we're done waiting for the threads.  Return FALSE
+ * if the user cancelled. */
+static bool find_all_buffers(const char *needle)
 {
-    /* We have a split personality here.  If create is FALSE, just
-     * calculate the size of the replacement line (necessary because of
-     * subexpressions \1 to \9 in the replaced text). */
+    openfilestruct *file = openfile;
+    size_t i = 0;
+    bool done;
+
+    findall_nchunks = 0;
+    do {
+	findall_nchunks++;
+	file = file->next;
+    } while (file != openfile);
+
+    findall_chunks = (findallchunk *)nmalloc(findall_nchunks *
+	sizeof(findallchunk));
+
+    do {
+	findall_chunks[i].first = file->fileage;
+	findall_chunks[i].lines = file->filebot->lineno;
+	findall_chunks[i].matches = NULL;
+	findall_chunks[i].count = 0;
+	findall_chunks[i].size = 0;
+	i++;
+	file = file->next;
+    } while (file != openfile);
+
+    done = findall_search(needle);
+
+    if (done) {
+	i = 0;
+	do {
+	    findall_collect(file, needle, i++, 1);
+	    file = file->next;
+	} while (file != openfile);
+    }
+
+    findall_free_chunks();
+
+    return done;
+}
+
+/* Draw the list of all the matches in the open buffers in the edit
+ * window, a page at a time, with the selected match highlighted.  Each
+ * row shows the buffer's filename, the line number and the text of the
+ * line.  The list begins with the current buffer's matches, and goes
+ * on around the ring of buffers. */
+static void buffer_matches_refresh(size_t selected, size_t total)
+{
+    openfilestruct *file = openfile;
+    filestruct *fileptr = openfile->current;
+    size_t i = selected - selected % editwinrows, n = i;
+    int row;
+
+    blank_edit();
+
+    /* Find the match at the top of this page. */
+    while (n >= file->found->count) {
+	n -= file->found->count;
+	file = file->next;
+	fileptr = file->current;
+    }
+
+    for (row = 0; row < editwinrows && i < total; row++, i++) {
+	const matchtype *m;
+	char *head, *disp;
+	size_t headlen;
+
+	while (n == file->found->count) {
+	    n = 0;
+	    file = file->next;
+	    fileptr = file->current;
+	}
+
+	m = &file->found->matches[n++];
+
+	while (fileptr->lineno < m->lineno)
+	    fileptr = fileptr->next;
+	while (fileptr->lineno > m->lineno)
+	    fileptr = fileptr->prev;
+
+	head = charalloc(strlen(file->filename) + strlen(_("New Buffer")) +
+		digits(m->lineno) + 4);
+	sprintf(head, "%s:%ld: ", file->filename[0] == '\0' ?
+		_("New Buffer") : file->filename, (long)m->lineno);
+	headlen = strlenpt(head);
+
+	if (i == selected)
+	    wattron(edit, reverse_attr);
+
+	blank_line(edit, row, 0, COLS);
+
+	disp = display_string(head, 0, COLS, FALSE);
+	mvwaddstr(edit, row, 0, disp);
+	free(disp);
+
+	if (headlen < COLS) {
+	    disp = display_string(fileptr->data, 0, COLS - headlen,
+		FALSE);
+	    waddstr(edit, disp);
+	    free(disp);
+	}
+
+	if (i == selected)
+	    wattroff(edit, reverse_attr);
+
+	free(head);
+    }
+
+    wnoutrefresh(edit);
+}
+
+/* Let the user pick one of the total matches in the open buffers from
+ * a list, starting with the match m in file selected.  If Enter is
+ * pressed, set file and m to the chosen match and return TRUE.  If the
+ * list is left with Exit, return FALSE. */
+static bool browse_buffer_matches(openfilestruct **file, const
+	matchtype **m, size_t total)
+{
+    openfilestruct *f;
+    size_t selected = *m - (*file)->found->matches;
+    size_t old_selected = (size_t)-1;
+    int kbinput, oldmenu = currmenu;
+    bool meta_key, func_key, chosen = FALSE;
+    const sc *s;
+    const subnfunc *sf;
+
+    for (f = openfile; f != *file; f = f->next)
+	selected += f->found->count;
+
+    curs_set(0);
+    currmenu = MFINDLIST;
+    bottombars(MFINDLIST);
+    wnoutrefresh(bottomwin);
+
+    while (TRUE) {
+	/* Display the list if the selected match has changed. */
+	if (old_selected != selected)
+	    buffer_matches_refresh(selected, total);
+
+	old_selected = selected;
+
+	kbinput = get_kbinput(edit, &meta_key, &func_key);
+	s = get_shortcut(MFINDLIST, &kbinput, &meta_key, &func_key);
+	if (s == NULL)
+	    continue;
+	sf = sctofunc((sc *)s);
+	if (sf == NULL)
+	    break;
+
+	if (sf->scfunc == DO_PAGE_UP) {
+	    if (selected >= editwinrows + selected % editwinrows)
+		selected -= editwinrows + selected % editwinrows;
+	    else
+		selected = 0;
+	} else if (sf->scfunc == DO_PAGE_DOWN) {
+	    selected += editwinrows - selected % editwinrows;
+	    if (selected > total - 1)
+		selected = total - 1;
+	} else if (sf->scfunc == DO_UP_VOID) {
+	    if (selected > 0)
+		selected--;
+	} else if (sf->scfunc == DO_DOWN_VOID) {
+	    if (selected < total - 1)
+		selected++;
+	} else if (sf->scfunc == DO_ENTER) {
+	    chosen = TRUE;
+	    break;
+	} else if (sf->scfunc == DO_EXIT)
+	    break;
+    }
+
+    if (chosen) {
+	f = openfile;
+	while (selected >= f->found->count) {
+	    selected -= f->found->count;
+	    f = f->next;
+	}
+
+	*file = f;
+	*m = &f->found->matches[selected];
+    }
+
+    currmenu = oldmenu;
+    curs_set(1);
+    display_main_list();
+
+    return chosen;
+}
+
+/* Show all the matches of the last search string in the open buffers
+ * as a list, with the next one after the cursor selected (or the
+ * previous one when searching backwards), and go to the one the user
+ * picks, switching straight to its buffer.  The first time, all the buffers are searched at once; after that their
+ * match indexes are used, until the search string, the search options
+ * or the text of a buffer change. */
+void do_find_in_buffers(void)
+{
+    openfilestruct *file = openfile, *target_file = NULL;
+    filestruct *fileptr = openfile->current;
+    size_t fileptr_x = openfile->current_x;
+    size_t lo, total = 0, nbuffers = 0;
+    bool backwards = ISSET(BACKWARDS_SEARCH), searched = FALSE;
+    bool switched = FALSE;
+    const matchtype *target = NULL;
+
+    search_init_globals();
+
+    if (last_search[0] == '\0') {
+	statusbar(_("No current search pattern"));
+	return;
+    }
+
+    do {
+	if (!matchindex_current(file, last_search))
+	    searched = TRUE;
+	file = file->next;
+    } while (file != openfile);
+
+    if (searched) {
+#ifdef HAVE_REGEX_H
+	if (ISSET(USE_REGEXP) && !regexp_init(last_search))
+	    return;
+#endif
+
+	if (!find_all_buffers(last_search)) {
+	    statusbar(_("Cancelled"));
+	    search_replace_abort();
+	    return;
+	}
+    }
+
+    /* Select the next match in the current buffer first, then the
+     * first one in the other buffers in turn, and finally the first
+     * one in the current buffer. */
+    lo = matchindex_after(openfile->found, fileptr->lineno, fileptr_x);
+
+    if (backwards ? lo > 0 : lo < openfile->found->count) {
+	target_file = openfile;
+	target = &openfile->found->matches[backwards ? lo - 1 : lo];
+    } else {
+	file = openfile;
+	do {
+	    file = backwards ? file->prev : file->next;
+
+	    if (file->found->count > 0) {
+		target_file = file;
+		target = &file->found->matches[backwards ?
+			file->found->count - 1 : 0];
+		break;
+	    }
+	} while (file != openfile);
+    }
+
+    if (target == NULL) {
+	not_found_msg(last_search);
+	search_replace_abort();
+	return;
+    }
+
+    file = openfile;
+    do {
+	total += file->found->count;
+	if (file->found->count > 0)
+	    nbuffers++;
+	file = file->next;
+    } while (file != openfile);
+
+    statusbar(P_("Found %lu occurrence in %lu buffer(s)",
+	"Found %lu occurrences in %lu buffer(s)",
+	(unsigned long)total), (unsigned long)total,
+	(unsigned long)nbuffers);
+
+    if (browse_buffer_matches(&target_file, &target, total)) {
+	switched = (target_file != openfile);
+	openfile = target_file;
+
+	goto_match(target);
+	openfile->placewewant = xplustabs();
+    }
+
+    if (ISSET(HIGHLIGHT_MATCHES))
+	set_match_highlight(last_search);
+
+    /* Show the buffer we went to only once we're in place in it. */
+    if (switched) {
+	display_buffer();
+	statusbar(_("Switched to %s"),
+		((openfile->filename[0] == '\0') ? _("New Buffer") :
+		openfile->filename));
+    } else
+	edit_refresh();
+    search_replace_abort();
+}
+#endif /* ENABLE_MULTIBUFFER */
+#endif /* !NANO_TINY */
 
+#ifdef HAVE_REGEX_H
+/* Write the replacement text for the regex match that starts at match
+ * into string, unless string is NULL, handling subexpression
+ * replacement using \1, \2, \3, etc.  The subexpressions are taken
+ * from regmatches, relative to the start of the match.  Return the
+ * length of the replacement text. */
+static size_t regexp_replacement(char *string, const char *match)
+{
     const char *c = last_replace;
-    size_t search_match_count = regmatches[0].rm_eo -
-	regmatches[0].rm_so;
-    size_t new_line_size = strlen(openfile->current->data) + 1 -
-	search_match_count;
+    size_t length = 0;
 
-    /* Iterate through the replacement text to handle subexpression
-     * replacement using \1, \2, \3, etc. */
+    /* Iterate through the replacement text. */
     while (*c != '\0') {
 	int num = (*(c + 1) - '0');
 
 	if (*c != '\\' || num < 1 || num > 9 || num >
-		search_regexp.re_nsub) {
-	    if (create)
+		search_regexp->re_nsub) {
+	    if (string != NULL)
 		*string++ = *c;
 	    c++;
-	    new_line_size++;
+	    length++;
 	} else {
 	    size_t i = regmatches[num].rm_eo - regmatches[num].rm_so;
 
 	    /* Skip over the replacement expression. */
 	    c += 2;
 
-	    /* But add the length of the subexpression to new_size. */
-	    new_line_size += i;
+	    /* But add the length of the subexpression to length. */
+	    length += i;
 
-	    /* And if create is TRUE, append the result of the
-	     * subexpression match to the new line. */
-	    if (create) {
-		strncpy(string, openfile->current->data +
-			openfile->current_x + regmatches[num].rm_so, i);
+	    /* And if string isn't NULL, append the result of the
+	     * subexpression match to it. */
+	    if (string != NULL) {
+		strncpy(string, match + regmatches[num].rm_so, i);
 		string += i;
 	    }
 	}
     }
 
+    return length;
+}
+
+int replace_regexp(char *string, bool create)
+{
+    /* We have a split personality here.  If create is FALSE, just
+     * calculate the size of the replacement line (necessary because of
+     * subexpressions \1 to \9 in the replaced text). */
+
+    size_t search_match_count = regmatches[0].rm_eo -
+	regmatches[0].rm_so;
+    size_t new_line_size = line_len(openfile->current) + 1 -
+	search_match_count;
+    size_t length = regexp_replacement(create ? string : NULL,
+	openfile->current->data + openfile->current_x);
+
     if (create)
-	*string = '\0';
+	string[length] = '\0';
 
-    return new_line_size;
+    return new_line_size + length;
 }
 #endif
 
@@ -643,6 +1803,12 @@ char *replace_line(const char *needle)
     char *copy;
     size_t new_line_size, search_match_count;
 
+#ifndef NANO_TINY
+    /* The caller frees the current line's text and puts the copy in
+     * its place, so the text had better be the line's own. */
+    unshare_node(openfile->current);
+#endif
+
     /* Calculate the size of the new line. */
 #ifdef HAVE_REGEX_H
     if (ISSET(USE_REGEXP)) {
@@ -651,7 +1817,7 @@ char *replace_line(const char *needle)
     } else {
 #endif
 	search_match_count = strlen(needle);
-	new_line_size = strlen(openfile->current->data) -
+	new_line_size = line_len(openfile->current) -
 		search_match_count + strlen(answer) + 1;
 #ifdef HAVE_REGEX_H
     }
@@ -680,6 +1846,351 @@ char *replace_line(const char *needle)
     return copy;
 }
 
+/* Return where x in a line ends up after the replacements in edits,
+ * which holds count groups of four: the start and end of a replaced
+ * match in the old line, and the start and end of its replacement in
+ * the new one.  A position inside a match goes to the end of its
+ * replacement if to_end is TRUE, and to the start otherwise. */
+static size_t replaced_x(const size_t *edits, size_t count, size_t x,
+	bool to_end)
+{
+    ssize_t shift = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++, edits += 4) {
+	if (x < edits[0] || (x == edits[0] && !to_end))
+	    break;
+	if (x < edits[1])
+	    return to_end ? edits[3] : edits[2];
+	shift = (ssize_t)edits[3] - (ssize_t)edits[1];
+    }
+
+    return x + shift;
+}
+
+/* Replace all the matches of needle from the one at (current,
+ * current_x) onward, in the order that a search would find them, up to
+ * and including a match at real_current_x in real_current.  Each line
+ * is searched once and rewritten at most once, totsize is updated once,
+ * a single undo record covers all the changes, and nothing is drawn.
+ * keep_real_x and keep_mark_begin are TRUE if real_current_x and
+ * mark_begin_x mustn't be moved.  Return the number of replacements
+ * made. */
+static ssize_t replace_all(
+#ifndef DISABLE_SPELLER
+	bool whole_word,
+#endif
+	const filestruct *real_current, size_t *real_current_x, const
+	char *needle, bool keep_real_x, bool keep_mark_begin)
+{
+    filestruct *fileptr;
+    ssize_t numreplaced = 0, lo_line[2], hi_line[2];
+    size_t lo_x[2], hi_x[2], nranges = 1, r;
+    size_t replace_len = strlen(answer), outsize = 0, editsize = 0;
+    size_t *edits = NULL;
+    char *out = NULL;
+    bool before_begin;
+    ssize_t totsize_change = 0;
+#ifndef NANO_TINY
+    undo *u = NULL;
+#endif
+
+    /* Work out which stretches of the buffer the rest of the search
+     * would have gone through: from the current match to the end (or,
+     * searching backwards, the start) of the buffer and around again
+     * to the beginning, or straight to the beginning if we've already
+     * wrapped. */
+    before_begin = (openfile->current->lineno < real_current->lineno ||
+	(openfile->current == real_current && openfile->current_x <
+	*real_current_x));
+
+#ifndef NANO_TINY
+    if (ISSET(BACKWARDS_SEARCH)) {
+	lo_line[0] = real_current->lineno;
+	lo_x[0] = *real_current_x;
+	hi_line[0] = openfile->current->lineno;
+	hi_x[0] = openfile->current_x;
+	if (before_begin) {
+	    lo_line[0] = openfile->fileage->lineno;
+	    lo_x[0] = 0;
+	    lo_line[1] = real_current->lineno;
+	    lo_x[1] = *real_current_x;
+	    hi_line[1] = openfile->filebot->lineno;
+	    hi_x[1] = (size_t)-1;
+	    nranges = 2;
+	}
+    } else
+#endif
+    {
+	lo_line[0] = openfile->current->lineno;
+	lo_x[0] = openfile->current_x;
+	hi_line[0] = real_current->lineno;
+	hi_x[0] = *real_current_x;
+	if (!before_begin) {
+	    lo_line[0] = openfile->fileage->lineno;
+	    lo_x[0] = 0;
+	    lo_line[1] = openfile->current->lineno;
+	    lo_x[1] = openfile->current_x;
+	    hi_line[1] = openfile->filebot->lineno;
+	    hi_x[1] = (size_t)-1;
+	    nranges = 2;
+	}
+    }
+
+#ifndef NANO_TINY
+    add_undo(REPLACEALL);
+    if (ISSET(UNDOABLE))
+	u = openfile->current_undo;
+#endif
+
+    for (fileptr = openfile->fileage; fileptr != NULL; fileptr =
+	fileptr->next) {
+	const char *data = fileptr->data;
+	size_t search_x = 0, copied = 0, outlen = 0, nedits = 0;
+
+	for (r = 0; r < nranges; r++)
+	    if (lo_line[r] <= fileptr->lineno && fileptr->lineno <=
+		hi_line[r])
+		break;
+	if (r == nranges)
+	    continue;
+
+	while (TRUE) {
+	    const char *found;
+	    size_t match_x, match_len, new_len;
+	    bool wanted = FALSE;
+
+#ifdef HAVE_REGEX_H
+	    if (ISSET(USE_REGEXP)) {
+		regoff_t match_start;
+		size_t i;
+
+		if (regexec(search_regexp, data + search_x, 10,
+			regmatches, (search_x > 0) ? REG_NOTBOL : 0) != 0)
+		    break;
+
+		match_start = regmatches[0].rm_so;
+		found = data + search_x + match_start;
+		match_len = regmatches[0].rm_eo - match_start;
+
+		/* Make the subexpressions relative to the match, as
+		 * regexp_replacement() wants them. */
+		for (i = 0; i < 10; i++)
+		    if (regmatches[i].rm_so != -1) {
+			regmatches[i].rm_so -= match_start;
+			regmatches[i].rm_eo -= match_start;
+		    }
+	    } else
+#endif
+	    {
+		found = ISSET(CASE_SENSITIVE) ? strstr(data + search_x,
+			needle) : mbstrcasestr(data + search_x, needle);
+		if (found == NULL)
+		    break;
+
+		match_len = strlen(needle);
+	    }
+
+	    match_x = found - data;
+
+	    /* Only replace the matches that the search would still have
+	     * come across. */
+	    for (r = 0; r < nranges; r++)
+		if ((fileptr->lineno > lo_line[r] || (fileptr->lineno ==
+			lo_line[r] && match_x >= lo_x[r])) &&
+			(fileptr->lineno < hi_line[r] || (fileptr->lineno ==
+			hi_line[r] && match_x <= hi_x[r])))
+		    wanted = TRUE;
+
+#ifndef DISABLE_SPELLER
+	    if (wanted && whole_word) {
+		char *word = mallocstrncpy(NULL, found, match_len + 1);
+
+		word[match_len] = '\0';
+		wanted = is_whole_word(match_x, data, word);
+		free(word);
+	    }
+#endif
+
+	    if (!wanted) {
+		if (data[match_x] == '\0')
+		    break;
+		search_x = move_mbright(data, match_x);
+		continue;
+	    }
+
+	    /* Copy the text before the match and the replacement text
+	     * into the new line, making room for them first. */
+#ifdef HAVE_REGEX_H
+	    if (ISSET(USE_REGEXP))
+		new_len = regexp_replacement(NULL, found);
+	    else
+#endif
+		new_len = replace_len;
+
+	    if (outlen + (match_x - copied) + new_len + 1 > outsize) {
+		outsize = (outlen + (match_x - copied) + new_len + 1) * 2;
+		out = charealloc(out, outsize);
+	    }
+
+	    strncpy(out + outlen, data + copied, match_x - copied);
+	    outlen += match_x - copied;
+
+	    if (nedits == editsize) {
+		editsize = (editsize == 0) ? 16 : editsize * 2;
+		edits = (size_t *)nrealloc(edits, 4 * editsize *
+			sizeof(size_t));
+	    }
+	    edits[4 * nedits] = match_x;
+	    edits[4 * nedits + 1] = match_x + match_len;
+	    edits[4 * nedits + 2] = outlen;
+	    edits[4 * nedits + 3] = outlen + new_len;
+	    nedits++;
+
+#ifdef HAVE_REGEX_H
+	    if (ISSET(USE_REGEXP))
+		regexp_replacement(out + outlen, found);
+	    else
+#endif
+		strncpy(out + outlen, answer, new_len);
+	    outlen += new_len;
+
+	    copied = match_x + match_len;
+	    numreplaced++;
+
+	    /* Go on after the match, or after the next character if the
+	     * match was empty, so that we don't find it again. */
+	    if (match_len > 0)
+		search_x = copied;
+	    else if (data[match_x] == '\0')
+		break;
+	    else
+		search_x = move_mbright(data, match_x);
+	}
+
+	if (nedits == 0)
+	    continue;
+
+#ifndef NANO_TINY
+	/* The old text gets freed or kept in the undo record, so it had
+	 * better be this line's own. */
+	unshare_node(fileptr);
+	data = fileptr->data;
+#endif
+
+	/* Copy the rest of the line, and put the new line in place of
+	 * the old one. */
+	if (outlen + strlen(data + copied) + 1 > outsize) {
+	    outsize = outlen + strlen(data + copied) + 1;
+	    out = charealloc(out, outsize);
+	}
+	strcpy(out + outlen, data + copied);
+
+	totsize_change += (ssize_t)mbstrlen(out) -
+		(ssize_t)mbstrlen(data);
+
+	/* Keep the positions on this line in sync with the text
+	 * changes.  Work them all out before setting any, since
+	 * real_current_x may point at current_x. */
+	{
+	    size_t new_real_x = *real_current_x;
+	    size_t new_current_x = openfile->current_x;
+
+	    if (fileptr == real_current && !keep_real_x)
+		new_real_x = replaced_x(edits, nedits, new_real_x, TRUE);
+	    if (fileptr == openfile->current)
+		new_current_x = replaced_x(edits, nedits, new_current_x,
+			FALSE);
+#ifndef NANO_TINY
+	    if (fileptr == openfile->mark_begin && !keep_mark_begin)
+		openfile->mark_begin_x = replaced_x(edits, nedits,
+			openfile->mark_begin_x, FALSE);
+#endif
+
+	    openfile->current_x = new_current_x;
+	    *real_current_x = new_real_x;
+	}
+
+	/* Keep the old line in the undo record, or get rid of it. */
+#ifndef NANO_TINY
+	if (u != NULL) {
+	    filestruct *saved = make_new_node(u->cutbottom);
+
+	    /* When we're replacing in a marked region, the lines at its
+	     * edges have been cut short, so keep the whole of them. */
+	    if (filepart != NULL && (fileptr == openfile->fileage ||
+		fileptr == openfile->filebot)) {
+		const char *head = (fileptr == openfile->fileage) ?
+			filepart->top_data : "";
+		const char *tail = (fileptr == openfile->filebot) ?
+			filepart->bot_data : "";
+
+		saved->data = charalloc(strlen(head) + strlen(data) +
+			strlen(tail) + 1);
+		sprintf(saved->data, "%s%s%s", head, data, tail);
+		free(fileptr->data);
+	    } else
+		saved->data = fileptr->data;
+	    saved->lineno = fileptr->lineno;
+	    if (u->cutbottom == NULL) {
+		/* Undoing starts at the first line that was changed. */
+		u->cutbuffer = saved;
+		set_undo_line(u, fileptr);
+		u->begin = 0;
+	    } else
+		u->cutbottom->next = saved;
+	    u->cutbottom = saved;
+	    u->cutsize += undo_line_size(saved);
+	} else
+#endif
+	    free(fileptr->data);
+
+	fileptr->data = mallocstrcpy(NULL, out);
+#ifndef NANO_TINY
+	mark_changed(fileptr, fileptr);
+#endif
+    }
+
+#ifndef NANO_TINY
+    if (u != NULL)
+	account_undo(u);
+#endif
+
+    openfile->totsize += totsize_change;
+
+    free(out);
+    free(edits);
+
+    return numreplaced;
+}
+
+#ifndef NANO_TINY
+/* Replace all the matches of needle in the current buffer with answer,
+ * from the top down, and return the number of replacements made.
+ * search_regexp must already be compiled if we're doing a regex
+ * search. */
+ssize_t replace_in_buffer(const char *needle)
+{
+    size_t top_x = 0;
+    bool backwards = ISSET(BACKWARDS_SEARCH);
+    ssize_t numreplaced;
+
+    openfile->current = openfile->fileage;
+    openfile->current_x = 0;
+
+    UNSET(BACKWARDS_SEARCH);
+    numreplaced = replace_all(
+#ifndef DISABLE_SPELLER
+	FALSE,
+#endif
+	openfile->fileage, &top_x, needle, TRUE, FALSE);
+    if (backwards)
+	SET(BACKWARDS_SEARCH);
+
+    return numreplaced;
+}
+#endif
+
 /* Step through each replace word and prompt user before replacing.
  * Parameters real_current and real_current_x are needed in order to
  * allow the cursor position to be updated when a word before the cursor
@@ -697,7 +2208,10 @@ ssize_t do_replace_loop(
 {
     ssize_t numreplaced = -1;
     size_t match_len;
-    bool replaceall = FALSE;
+#ifdef ENABLE_COLOR
+    bool replaced_all = FALSE;
+	/* Did we replace all the rest of the matches in one go? */
+#endif
 #ifdef HAVE_REGEX_H
     /* The starting-line match and bol/eol regex flags. */
     bool begin_line = FALSE, bol_or_eol = FALSE;
@@ -745,6 +2259,8 @@ ssize_t do_replace_loop(
 #endif
 	, real_current, *real_current_x, needle, &match_len)) {
 	int i = 0;
+	size_t xpt;
+	char *exp_word;
 
 #ifdef HAVE_REGEX_H
 	/* If the bol_or_eol flag is set, we've found a match on the
@@ -764,56 +2280,71 @@ ssize_t do_replace_loop(
 	}
 #endif
 
-	if (!replaceall)
-	    edit_refresh();
+	edit_refresh();
 
 	/* Indicate that we found the search string. */
 	if (numreplaced == -1)
 	    numreplaced = 0;
 
-	if (!replaceall) {
-	    size_t xpt = xplustabs();
-	    char *exp_word = display_string(openfile->current->data,
-		xpt, strnlenpt(openfile->current->data,
-		openfile->current_x + match_len) - xpt, FALSE);
+	xpt = xplustabs();
+	exp_word = display_string(openfile->current->data, xpt,
+		strnlenpt(openfile->current->data, openfile->current_x +
+		match_len) - xpt, FALSE);
 
-	    curs_set(0);
+	curs_set(0);
 
-	    do_replace_highlight(TRUE, exp_word);
+	do_replace_highlight(TRUE, exp_word);
 
-	    i = do_yesno_prompt(TRUE, _("Replace this instance?"));
+	i = do_yesno_prompt(TRUE, _("Replace this instance?"));
 
-	    do_replace_highlight(FALSE, exp_word);
+	do_replace_highlight(FALSE, exp_word);
 
-	    free(exp_word);
+	free(exp_word);
 
-	    curs_set(1);
+	curs_set(1);
 
-	    if (i == -1) {	/* We canceled the replace. */
-		if (canceled != NULL)
-		    *canceled = TRUE;
-		break;
-	    }
+	if (i == -1) {	/* We canceled the replace. */
+	    if (canceled != NULL)
+		*canceled = TRUE;
+	    break;
 	}
 
 #ifdef HAVE_REGEX_H
 	/* Set the bol_or_eol flag if we're doing a bol and/or eol regex
 	 * replace ("^", "$", or "^$"). */
-	if (ISSET(USE_REGEXP) && regexp_bol_or_eol(&search_regexp,
+	if (ISSET(USE_REGEXP) && regexp_bol_or_eol(search_regexp,
 		needle))
 	    bol_or_eol = TRUE;
 #endif
 
-	if (i > 0 || replaceall) {	/* Yes, replace it!!!! */
+	if (i == 2) {	/* Replace this one and all the rest. */
+	    numreplaced += replace_all(
+#ifndef DISABLE_SPELLER
+		whole_word,
+#endif
+		real_current, real_current_x, needle,
+#ifndef NANO_TINY
+		old_mark_set && !right_side_up,
+		old_mark_set && right_side_up
+#else
+		FALSE, FALSE
+#endif
+		);
+
+	    set_modified();
+#ifdef ENABLE_COLOR
+	    replaced_all = TRUE;
+#endif
+	    break;
+	}
+
+	if (i > 0) {	/* Yes, replace it!!!! */
 	    char *copy;
 	    size_t length_change;
 
 #ifndef NANO_TINY
 	    update_undo(REPLACE);
 #endif
-	    if (i == 2)
-		replaceall = TRUE;
-
 	    copy = replace_line(needle);
 
 	    length_change = strlen(copy) -
@@ -865,22 +2396,23 @@ ssize_t do_replace_loop(
 		mbstrlen(openfile->current->data);
 	    free(openfile->current->data);
 	    openfile->current->data = copy;
+#ifndef NANO_TINY
+	    mark_changed(openfile->current, openfile->current);
+#endif
 
 #ifdef ENABLE_COLOR
 	reset_multis(openfile->current, TRUE);
 #endif
 	edit_refresh();
-	    if (!replaceall) {
 #ifdef ENABLE_COLOR
-		/* If color syntaxes are available and turned on, we
-		 * need to call edit_refresh(). */
-		if (openfile->colorstrings != NULL &&
-			!ISSET(NO_COLOR_SYNTAX))
-		    edit_refresh();
-		else
-#endif
-		    update_line(openfile->current, openfile->current_x);
-	    }
+	    /* If color syntaxes are available and turned on, we need to
+	     * call edit_refresh(). */
+	    if (openfile->colorstrings != NULL &&
+		!ISSET(NO_COLOR_SYNTAX))
+		edit_refresh();
+	    else
+#endif
+		update_line(openfile->current, openfile->current_x);
 
 	    set_modified();
 	    numreplaced++;
@@ -899,6 +2431,13 @@ ssize_t do_replace_loop(
     }
 #endif
 
+#ifdef ENABLE_COLOR
+    /* Lines all over the buffer may have changed, so work out the
+     * multi-line colors again, once. */
+    if (replaced_all)
+	precalc_multicolorinfo();
+#endif
+
     /* If the NO_NEWLINES flag isn't set, and text has been added to the
      * magicline, make a new magicline. */
     if (!ISSET(NO_NEWLINES) && openfile->filebot->data[0] != '\0')
@@ -986,12 +2525,21 @@ void do_replace(void)
     begin_x = openfile->current_x;
     pww_save = openfile->placewewant;
 
+#ifndef NANO_TINY
+    /* Replacing doesn't keep the lengths of lines up to date. */
+    hold_lengths();
+#endif
+
     numreplaced = do_replace_loop(
 #ifndef DISABLE_SPELLER
 	FALSE,
 #endif
 	NULL, begin, &begin_x, last_search);
 
+#ifndef NANO_TINY
+    release_lengths();
+#endif
+
     /* Restore where we were. */
     openfile->edittop = edittop_save;
     openfile->current = begin;
@@ -1173,6 +2721,426 @@ bool find_bracket_match(bool reverse, const char *bracket_set)
     return TRUE;
 }
 
+/* Free the bracket index bi. */
+void free_bracketindex(bracketindex *bi)
+{
+    free(bi->bracket_set);
+    free(bi->lines);
+    free(bi->blockfirst);
+    free(bi->tree);
+    free(bi);
+}
+
+/* Find the next bracket of the index bi in the line text, starting at
+ * start.  If reverse is TRUE, find the previous one instead, starting
+ * at start and going back. */
+static const char *bracket_pbrk(const bracketindex *bi, const char
+	*text, const char *start, bool reverse)
+{
+    if (bi->bytewise)
+	return reverse ? revstrpbrk(text, bi->bracket_set, start) :
+		strpbrk(start, bi->bracket_set);
+    else
+	return reverse ? mbrevstrpbrk(text, bi->bracket_set, start) :
+		mbstrpbrk(start, bi->bracket_set);
+}
+
+/* Add up the brackets of the index bi in the line text into the
+ * summary s. */
+static void bracket_summarize(const bracketindex *bi, const char *text,
+	bracketsummary *s)
+{
+    const char *ptr = text;
+
+    s->net = 0;
+    s->low = 0;
+
+    while ((ptr = bracket_pbrk(bi, text, ptr, FALSE)) != NULL) {
+	if (strncmp(ptr, bi->bracket_set, bi->open_len) == 0) {
+	    s->net++;
+	    ptr += bi->open_len;
+	} else {
+	    s->net--;
+	    if (s->net < s->low)
+		s->low = s->net;
+	    ptr += strlen(bi->bracket_set + bi->open_len);
+	}
+    }
+}
+
+/* Set s to the summary of a followed by b. */
+static void bracket_combine(bracketsummary *s, const bracketsummary *a,
+	const bracketsummary *b)
+{
+    s->low = (a->net + b->low < a->low) ? a->net + b->low : a->low;
+    s->net = a->net + b->net;
+}
+
+/* Return whether the count of still-unmatched brackets, which is depth
+ * before going through the text summarized by s, drops to zero inside
+ * of it.  When going forward, every opening bracket raises the count
+ * and every closing one lowers it; when going in reverse, it's the
+ * other way around.  Otherwise, add the change of the count to
+ * depth. */
+static bool bracket_passes(const bracketsummary *s, bool reverse,
+	ssize_t *depth)
+{
+    /* Going backward, the lowest point is reached at the start of the
+     * text, so it lies net below where the forward count got lowest. */
+    if (*depth + (reverse ? s->low - s->net : s->low) <= 0)
+	return FALSE;
+
+    *depth += reverse ? -s->net : s->net;
+
+    return TRUE;
+}
+
+/* Set leaf block of the tree of the bracket index bi to the summary of
+ * the lines in that block, if there are any. */
+static void bracket_leaf(bracketindex *bi, size_t block)
+{
+    bracketsummary *leaf = &bi->tree[bi->leaves + block];
+    size_t i;
+
+    leaf->net = 0;
+    leaf->low = 0;
+
+    for (i = block * BRACKET_BLOCK_LINES; i < bi->nlines &&
+	i < (block + 1) * BRACKET_BLOCK_LINES; i++)
+	bracket_combine(leaf, leaf, &bi->lines[i]);
+}
+
+/* Bring the bracket index bi up to date with the lines of the current
+ * buffer that have changed since it last was, summarizing only those
+ * lines again and recomputing only the leaves of the blocks they are in
+ * (or, when the number of lines has changed, of all the blocks from
+ * there on, since the lines after them have shifted) plus the nodes of
+ * the tree above those leaves.  Return FALSE if the tree has become too
+ * small for the buffer, in which case bi is left as it was. */
+static bool bracket_update(bracketindex *bi)
+{
+    size_t m = bi->nlines, n = openfile->filebot->lineno;
+    size_t head = bi->changed.head, tail = bi->changed.tail;
+    size_t nblocks = (n + BRACKET_BLOCK_LINES - 1) /
+	BRACKET_BLOCK_LINES;
+    size_t lo, hi, i;
+    const filestruct *line;
+
+    /* Whatever was noted beyond the ends of the buffer, now or as it
+     * was, doesn't count. */
+    if (head > m)
+	head = m;
+    if (head > n)
+	head = n;
+    if (tail > (m < n ? m : n) - head)
+	tail = (m < n ? m : n) - head;
+
+    if (m == n && head + tail == n)
+	return TRUE;
+
+    if (nblocks > bi->leaves)
+	return FALSE;
+
+    /* Move the summaries of the unchanged lines at the end to where
+     * those lines are now. */
+    if (n > m)
+	bi->lines = (bracketsummary *)nrealloc(bi->lines, n *
+		sizeof(bracketsummary));
+    memmove(&bi->lines[n - tail], &bi->lines[m - tail], tail *
+	sizeof(bracketsummary));
+    if (n < m)
+	bi->lines = (bracketsummary *)nrealloc(bi->lines, n *
+		sizeof(bracketsummary));
+    bi->blockfirst = (const filestruct **)nrealloc(bi->blockfirst,
+	nblocks * sizeof(filestruct *));
+
+    /* Start from the first line of a block that the changes leave
+     * alone, or from the top. */
+    i = head - head % BRACKET_BLOCK_LINES;
+    if (i == head && i > 0)
+	i -= BRACKET_BLOCK_LINES;
+    line = (head == 0) ? openfile->fileage :
+	bi->blockfirst[i / BRACKET_BLOCK_LINES];
+
+    /* Summarize the changed lines again, and find the first line of
+     * each block from there on, as far as the blocks have moved. */
+    for (; line != NULL && (i < n - tail || (m != n &&
+	i < n)); line = line->next, i++) {
+	assert(line->lineno == i + 1);
+
+	if (i < head)
+	    continue;
+	if (i % BRACKET_BLOCK_LINES == 0)
+	    bi->blockfirst[i / BRACKET_BLOCK_LINES] = line;
+	if (i < n - tail)
+	    bracket_summarize(bi, line->data, &bi->lines[i]);
+    }
+
+    bi->nlines = n;
+
+    /* Recompute the leaves of the changed blocks, including those that
+     * are now past the last block, and the nodes above them. */
+    lo = head / BRACKET_BLOCK_LINES;
+    if (m == n)
+	hi = (n - tail - 1) / BRACKET_BLOCK_LINES;
+    else
+	hi = ((nblocks > bi->nblocks) ? nblocks : bi->nblocks) - 1;
+    if (lo > hi)
+	lo = hi;
+
+    bi->nblocks = nblocks;
+
+    for (i = lo; i <= hi; i++)
+	bracket_leaf(bi, i);
+
+    for (lo = (bi->leaves + lo) / 2, hi = (bi->leaves + hi) / 2;
+	lo > 0; lo /= 2, hi /= 2) {
+	for (i = lo; i <= hi; i++)
+	    bracket_combine(&bi->tree[i], &bi->tree[2 * i],
+		&bi->tree[2 * i + 1]);
+    }
+
+    return TRUE;
+}
+
+/* Return the bracket index of the current buffer for the pair of
+ * brackets in bracket_set, the opening one of which is open_len bytes
+ * long, building it first if it's not there, or bringing it up to date
+ * if lines have changed since it was built. */
+static const bracketindex *bracket_index(const char *bracket_set,
+	size_t open_len)
+{
+    bracketindex *bi = openfile->brackets;
+    const filestruct *line;
+    size_t i;
+
+    if (bi != NULL && strcmp(bi->bracket_set, bracket_set) == 0 &&
+	bracket_update(bi)) {
+	bi->changed.head = (size_t)-1;
+	bi->changed.tail = (size_t)-1;
+	return bi;
+    }
+
+    if (bi != NULL)
+	free_bracketindex(bi);
+
+    bi = (bracketindex *)nmalloc(sizeof(bracketindex));
+    bi->bracket_set = mallocstrcpy(NULL, bracket_set);
+    bi->open_len = open_len;
+    /* Single-byte brackets can't be part of a multibyte character, so
+     * for them the plain byte functions will do, which are faster. */
+    bi->bytewise = (open_len == 1 && bracket_set[2] == '\0');
+    bi->changed.head = (size_t)-1;
+    bi->changed.tail = (size_t)-1;
+    bi->nlines = openfile->filebot->lineno;
+    bi->lines = (bracketsummary *)nmalloc(bi->nlines *
+	sizeof(bracketsummary));
+    bi->nblocks = (bi->nlines + BRACKET_BLOCK_LINES - 1) /
+	BRACKET_BLOCK_LINES;
+    bi->blockfirst = (const filestruct **)nmalloc(bi->nblocks *
+	sizeof(filestruct *));
+
+    for (bi->leaves = 1; bi->leaves < bi->nblocks; bi->leaves *= 2)
+	;
+    bi->tree = (bracketsummary *)nmalloc(2 * bi->leaves *
+	sizeof(bracketsummary));
+
+    /* Summarize every line, and each block of lines as a leaf of the
+     * tree.  The leaves past the last block stay empty. */
+    for (i = 0; i < bi->leaves; i++) {
+	bi->tree[bi->leaves + i].net = 0;
+	bi->tree[bi->leaves + i].low = 0;
+    }
+
+    for (line = openfile->fileage, i = 0; line != NULL; line =
+	line->next, i++) {
+	bracketsummary *leaf = &bi->tree[bi->leaves + i /
+		BRACKET_BLOCK_LINES];
+
+	assert(line->lineno == i + 1);
+
+	if (i % BRACKET_BLOCK_LINES == 0)
+	    bi->blockfirst[i / BRACKET_BLOCK_LINES] = line;
+
+	bracket_summarize(bi, line->data, &bi->lines[i]);
+	bracket_combine(leaf, leaf, &bi->lines[i]);
+    }
+
+    for (i = bi->leaves - 1; i > 0; i--)
+	bracket_combine(&bi->tree[i], &bi->tree[2 * i],
+		&bi->tree[2 * i + 1]);
+
+    openfile->brackets = bi;
+
+    return bi;
+}
+
+/* Look in the subtree node of the bracket index bi, which covers the
+ * blocks from lo up to hi, for the first block after block first (or,
+ * when reverse, the last block before it) in which the count depth of
+ * unmatched brackets drops to zero.  Return that block, or -1 if there
+ * is none, in which case depth has been brought past the subtree. */
+static ssize_t bracket_tree_find(const bracketindex *bi, size_t node,
+	size_t lo, size_t hi, size_t first, bool reverse, ssize_t *depth)
+{
+    size_t mid = (lo + hi) / 2;
+    ssize_t found;
+
+    /* Skip the subtrees that lie entirely on the wrong side of first,
+     * and those that the count passes through. */
+    if (reverse ? lo >= first : hi <= first + 1)
+	return -1;
+    if ((reverse ? hi <= first : lo > first) &&
+	bracket_passes(&bi->tree[node], reverse, depth))
+	return -1;
+
+    if (hi - lo == 1)
+	return lo;
+
+    if (reverse) {
+	found = bracket_tree_find(bi, 2 * node + 1, mid, hi, first,
+		reverse, depth);
+	if (found == -1)
+	    found = bracket_tree_find(bi, 2 * node, lo, mid, first,
+		reverse, depth);
+    } else {
+	found = bracket_tree_find(bi, 2 * node, lo, mid, first,
+		reverse, depth);
+	if (found == -1)
+	    found = bracket_tree_find(bi, 2 * node + 1, mid, hi, first,
+		reverse, depth);
+    }
+
+    return found;
+}
+
+/* Look in the text of line from start on (or, when reverse, from start
+ * back) for the bracket at which the count depth of unmatched brackets
+ * drops to zero.  Return it, or NULL if there is none, in which case
+ * depth has been brought past the text. */
+static const char *bracket_line_find(const bracketindex *bi, const char
+	*text, const char *start, bool reverse, ssize_t *depth)
+{
+    const char *ptr = start;
+    bool opening;
+
+    while (TRUE) {
+	if (reverse ? ptr < text : *ptr == '\0')
+	    return NULL;
+
+	ptr = bracket_pbrk(bi, text, ptr, reverse);
+
+	if (ptr == NULL)
+	    return NULL;
+
+	opening = (strncmp(ptr, bi->bracket_set, bi->open_len) == 0);
+	*depth += (opening != reverse) ? 1 : -1;
+
+	if (*depth == 0)
+	    return ptr;
+
+	if (!reverse)
+	    ptr += opening ? bi->open_len : strlen(bi->bracket_set +
+		bi->open_len);
+	else if (ptr == text)
+	    return NULL;
+	else if (bi->bytewise)
+	    ptr--;
+	else
+	    ptr = text + move_mbleft(text, ptr - text);
+    }
+}
+
+/* Find the bracket matching the one of ch_len bytes at the current
+ * cursor position, using the bracket index.  bracket_set holds that
+ * bracket followed by its counterpart, and reverse tells whether it's a
+ * closing one.  Return 1 and move the cursor there if we found the
+ * match, 0 if there is no match, and -1 if the index can't be used. */
+static int find_bracket_indexed(bool reverse, const char *bracket_set,
+	size_t ch_len)
+{
+    const bracketindex *bi;
+    const filestruct *line = openfile->current;
+    const char *found;
+    char *canonical;
+    ssize_t depth = 1, block;
+    size_t i;
+
+    /* When both brackets are the same, there's no telling whether one
+     * opens or closes. */
+    if (strncmp(bracket_set, bracket_set + ch_len, ch_len) == 0 &&
+	bracket_set[2 * ch_len] == '\0')
+	return -1;
+
+    /* The index always wants the opening bracket first. */
+    if (reverse) {
+	canonical = mallocstrcpy(NULL, bracket_set + ch_len);
+	canonical = charealloc(canonical, strlen(bracket_set) + 1);
+	strncat(canonical, bracket_set, ch_len);
+	bi = bracket_index(canonical, strlen(canonical) - ch_len);
+	free(canonical);
+    } else
+	bi = bracket_index(bracket_set, ch_len);
+
+    /* First look in the rest of the current line. */
+    if (reverse)
+	found = (openfile->current_x == 0) ? NULL :
+		bracket_line_find(bi, line->data, line->data +
+		move_mbleft(line->data, openfile->current_x), TRUE,
+		&depth);
+    else
+	found = bracket_line_find(bi, line->data, line->data +
+		openfile->current_x + ch_len, FALSE, &depth);
+
+    i = line->lineno - 1;
+    block = i / BRACKET_BLOCK_LINES;
+
+    /* Then in the rest of its block, line by line, and then among the
+     * other blocks, and then line by line in the one found. */
+    while (found == NULL) {
+	if (reverse ? i % BRACKET_BLOCK_LINES == 0 :
+		(i + 1) % BRACKET_BLOCK_LINES == 0 || i + 1 == bi->nlines) {
+	    block = bracket_tree_find(bi, 1, 0, bi->leaves, block,
+		reverse, &depth);
+
+	    if (block == -1 || block >= bi->nblocks)
+		return 0;
+
+	    if (!reverse) {
+		line = bi->blockfirst[block];
+		i = block * BRACKET_BLOCK_LINES;
+	    } else if (block + 1 < bi->nblocks) {
+		line = bi->blockfirst[block + 1]->prev;
+		i = (block + 1) * BRACKET_BLOCK_LINES - 1;
+	    } else {
+		line = openfile->filebot;
+		i = bi->nlines - 1;
+	    }
+	} else if (reverse) {
+	    line = line->prev;
+	    i--;
+	} else {
+	    line = line->next;
+	    i++;
+	}
+
+	if (bracket_passes(&bi->lines[i], reverse, &depth))
+	    continue;
+
+	found = bracket_line_find(bi, line->data, reverse ? line->data +
+		strlen(line->data) : line->data, reverse, &depth);
+
+	assert(found != NULL);
+    }
+
+    openfile->current_y += line->lineno - openfile->current->lineno;
+    openfile->current = (filestruct *)line;
+    openfile->current_x = found - line->data;
+    openfile->placewewant = xplustabs();
+
+    return 1;
+}
+
 /* Search for a match to the bracket at the current cursor position, if
  * there is one. */
 void do_find_bracket(void)
@@ -1261,6 +3229,17 @@ void do_find_bracket(void)
 
     found_ch = charalloc(mb_cur_max() + 1);
 
+    /* Let the bracket index find the match if it can, as it skips over
+     * balanced stretches of lines without looking at them again. */
+    switch (find_bracket_indexed(reverse, bracket_set, ch_len)) {
+	case 1:
+	    edit_redraw(current_save, pww_save);
+	    goto cleanup_and_exit;
+	case 0:
+	    statusbar(_("No matching bracket"));
+	    goto cleanup_and_exit;
+    }
+
     while (TRUE) {
 	if (find_bracket_match(reverse, bracket_set)) {
 	    /* If we found an identical bracket, increment count.  If we
@@ -1286,6 +3265,7 @@ void do_find_bracket(void)
 	}
     }
 
+  cleanup_and_exit:
     /* Clean up. */
     free(bracket_set);
     free(found_ch);
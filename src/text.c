@@ -35,6 +35,10 @@
 static pid_t pid = -1;
 	/* The PID of the forked process in execute_command(), for use
 	 * with the cancel_command() signal handler. */
+static undo *last_cutu = NULL;
+	/* The last thing we cut, to set up the undo for an uncut. */
+static size_t undo_serial = 0;
+	/* How many undo items have been made so far. */
 #endif
 #ifndef DISABLE_WRAPPING
 static bool prepend_wrap = FALSE;
@@ -69,6 +73,28 @@ void do_delete(void)
     size_t orig_lenpt = 0;
 
 #ifndef NANO_TINY
+    /* In a long line, the gap at the cursor takes in the character
+     * under it, after the undo item has seen it, so that the text
+     * after it doesn't move. */
+    if (make_gap(0)) {
+	size_t char_len = gap_expose();
+
+	if (char_len > 0) {
+	    update_undo(DEL);
+	    gap_erase(char_len);
+	    adjust_line_len(openfile->current, -(ssize_t)char_len, -1);
+	    mark_changed(openfile->current, openfile->current);
+	    openfile->placewewant = xplustabs();
+	    openfile->totsize--;
+	    set_modified();
+	    update_line(openfile->current, openfile->current_x);
+	    return;
+	}
+
+	/* At the end of the line, it gets joined with the next one. */
+	close_gap();
+    }
+
     update_undo(DEL);
 #endif
 
@@ -95,6 +121,9 @@ void do_delete(void)
 	null_at(&openfile->current->data, openfile->current_x +
 		line_len - char_buf_len);
 #ifndef NANO_TINY
+	adjust_line_len(openfile->current, -char_buf_len, -1);
+	mark_changed(openfile->current, openfile->current);
+
 	if (openfile->mark_set && openfile->mark_begin ==
 		openfile->current && openfile->current_x <
 		openfile->mark_begin_x)
@@ -116,6 +145,9 @@ void do_delete(void)
 	strcpy(openfile->current->data + openfile->current_x,
 		foo->data);
 #ifndef NANO_TINY
+	measure_line(openfile->current);
+	mark_changed(openfile->current, foo);
+
 	if (openfile->mark_set && openfile->mark_begin ==
 		openfile->current->next) {
 	    openfile->mark_begin = openfile->current;
@@ -127,7 +159,7 @@ void do_delete(void)
 
 	unlink_node(foo);
 	delete_node(foo);
-	renumber(openfile->current);
+	renumber_partly(openfile->current, -1);
 	openfile->totsize--;
 
 	/* If the NO_NEWLINES flag isn't set, and text has been added to
@@ -236,6 +268,10 @@ void do_indent(ssize_t cols)
 	bot = top;
     }
 
+    /* Keep the lines as they are, so that all of them can be unindented
+     * or indented again at once. */
+    begin_undo_group(top, bot, UNDO_GROUP_INDENT);
+
     if (!unindent) {
 	/* Set up the text we'll be using as indentation. */
 	line_indent = charalloc(cols + 1);
@@ -265,6 +301,8 @@ void do_indent(ssize_t cols)
 	size_t indent_len = indent_length(f->data);
 
 	if (!unindent) {
+	    unshare_node(f);
+
 	    /* If we're indenting, add the characters in line_indent to
 	     * the beginning of the non-whitespace text of this line. */
 	    f->data = charealloc(f->data, line_len +
@@ -301,6 +339,8 @@ void do_indent(ssize_t cols)
 			/* The change in the indentation on this line
 			 * after we unindent. */
 
+		unshare_node(f);
+
 		/* If we're unindenting, and there's at least cols
 		 * columns' worth of indentation at the beginning of the
 		 * non-whitespace text of this line, remove it. */
@@ -338,12 +378,16 @@ void do_indent(ssize_t cols)
 	free(line_indent);
 
     if (indent_changed) {
+	mark_changed(top, bot);
+	commit_undo_group();
+
 	/* Mark the file as modified. */
 	set_modified();
 
 	/* Update the screen. */
 	edit_refresh_needed = TRUE;
-    }
+    } else
+	discard_undo_group();
 }
 
 /* Indent the current line, or all lines covered by the mark if the mark
@@ -363,15 +407,17 @@ void do_unindent(void)
 /* undo a cut, or re-do an uncut */
 void undo_cut(undo *u)
 {
+    filestruct *top, *bot;
+
     /* If we cut the magicline may was well not crash :/ */
     if (!u->cutbuffer)
 	return;
 
-    cutbuffer = copy_filestruct(u->cutbuffer);
-
-    /* Compute cutbottom for the uncut using out copy */
-    for (cutbottom = cutbuffer; cutbottom->next != NULL; cutbottom = cutbottom->next)
-	;
+    /* Get a copy of the text, reading back in the part of it that's in
+     * the cut spill file, and leave the cutbuffer alone. */
+    top = unspill_cut(u->cut_range, u->cut_lines, u->cutbuffer, &bot);
+    if (top == NULL)
+	return;
 
     /* Get to where we need to uncut from */
     if (u->mark_set && u->mark_begin_lineno < u->lineno)
@@ -379,15 +425,14 @@ void undo_cut(undo *u)
     else
 	do_gotolinecolumn(u->lineno, u->begin+1, FALSE, FALSE, FALSE, FALSE);
 
-    copy_from_filestruct(cutbuffer, cutbottom);
-    free_filestruct(cutbuffer);
-    cutbuffer = NULL;
-
+    copy_from_filestruct(top, bot);
+    free_filestruct(top);
 }
 
 /* Re-do a cut, or undo an uncut */
 void redo_cut(undo *u) {
     int i;
+    size_t n;
     filestruct *t, *c;
 
     /* If we cut the magicline may was well not crash :/ */
@@ -396,9 +441,7 @@ void redo_cut(undo *u) {
 
     do_gotolinecolumn(u->lineno, u->begin+1, FALSE, FALSE, FALSE, FALSE);
     openfile->mark_set = u->mark_set;
-    if (cutbuffer)
-	free(cutbuffer);
-    cutbuffer = NULL;
+    free_cutbuffer();
 
     /* Move ahead the same # lines we had if a marked cut */
     if (u->mark_set) {
@@ -409,7 +452,9 @@ void redo_cut(undo *u) {
 	/* Here we have a regular old potentially multi-line ^K cut.  We'll
 	   need to trick nano into thinking it's a marked cut to cut more
 	   than one line again */
-	for (c = u->cutbuffer, t = openfile->current; c->next != NULL && t->next != NULL; ) {
+	for (n = 0, t = openfile->current; n < u->cut_lines && t->next != NULL; n++)
+	    t = t->next;
+	for (c = u->cutbuffer; c->next != NULL && t->next != NULL; ) {
 
 #ifdef DEBUG
 	fprintf(stderr, "Advancing, lineno  = %lu, data = \"%s\"\n", (unsigned long) t->lineno, t->data);
@@ -423,35 +468,406 @@ void redo_cut(undo *u) {
     }
 
     openfile->mark_begin_x = u->mark_begin_x;
-    do_cut_text(FALSE, u->to_end, TRUE);
+    do_cut_text(u->to_end, TRUE);
     openfile->mark_set = FALSE;
     openfile->mark_begin = NULL;
     openfile->mark_begin_x = 0;
     edit_refresh_needed = TRUE;
 }
 
+/* Swap the text of the lines that a replace-all changed, starting at
+ * f, with the old text kept in u, keeping totsize in sync. */
+static void swap_replaced_lines(filestruct *f, undo *u)
+{
+    filestruct *saved;
+
+    for (saved = u->cutbuffer; saved != NULL; saved = saved->next) {
+	char *data = saved->data;
+
+	while (f->lineno < saved->lineno)
+	    f = f->next;
+
+	/* The line's text goes into the undo item. */
+	unshare_node(f);
+
+	openfile->totsize += mbstrlen(data) - mbstrlen(f->data);
+	u->cutsize -= undo_line_size(saved);
+	saved->data = f->data;
+	f->data = data;
+	u->cutsize += undo_line_size(saved);
+	mark_changed(f, f);
+    }
+}
+
+/* Write len and then the len bytes of s to the file f, or only
+ * (size_t)-1 if s is NULL.  Return FALSE if that fails. */
+bool spill_string(FILE *f, const char *s, size_t len)
+{
+    if (s == NULL)
+	len = (size_t)-1;
+
+    if (fwrite(&len, sizeof(size_t), 1, f) != 1)
+	return FALSE;
+
+    return (s == NULL || fwrite(s, 1, len, f) == len);
+}
+
+/* Read a string written by spill_string() back from the file f into a
+ * newly allocated *s, and its length into *len if len isn't NULL.
+ * Return FALSE if that fails. */
+bool unspill_string(FILE *f, char **s, size_t *len)
+{
+    size_t n;
+
+    *s = NULL;
+
+    if (fread(&n, sizeof(size_t), 1, f) != 1)
+	return FALSE;
+
+    if (n == (size_t)-1)
+	n = 0;
+    else {
+	*s = charalloc(n + 1);
+	if (fread(*s, 1, n, f) != n) {
+	    free(*s);
+	    *s = NULL;
+	    return FALSE;
+	}
+	(*s)[n] = '\0';
+    }
+
+    if (len != NULL)
+	*len = n;
+
+    return TRUE;
+}
+
+/* Move the text of the undo item u back to the start of its room, if
+ * backspacing left room in front of it. */
+static void close_undo_gap(undo *u)
+{
+    if (u->datagap == 0)
+	return;
+
+    charmove(u->strdata, u->strdata + u->datagap, u->datalen + 1);
+    u->datagap = 0;
+}
+
+/* Write the text that the undo item u holds out to the undo spill file
+ * of the current buffer, and free it, so that the item takes up little
+ * memory until it's needed again.  Return FALSE if it couldn't be
+ * written out, in which case the item is left as it was. */
+static bool spill_undo(undo *u)
+{
+    FILE *f = openfile->undo_spill;
+    const filestruct *line;
+    size_t nlines = 0;
+    bool bytes = (u->type == ADD || u->type == DEL);
+
+    close_undo_gap(u);
+
+    /* The file has no name, so it goes away by itself when it's closed
+     * or when we die. */
+    if (f == NULL && (f = openfile->undo_spill = tmpfile()) == NULL)
+	return FALSE;
+
+    if (fseeko(f, 0, SEEK_END) == -1 || (u->spill_offset =
+	ftello(f)) == -1)
+	return FALSE;
+
+    for (line = u->cutbuffer; line != NULL; line = line->next)
+	nlines++;
+
+    if (!spill_string(f, u->strdata, bytes ? u->datalen :
+	(u->strdata != NULL) ? strlen(u->strdata) : 0) ||
+	!spill_string(f, u->strdata2, (u->strdata2 != NULL) ?
+	strlen(u->strdata2) : 0) ||
+	fwrite(&nlines, sizeof(size_t), 1, f) != 1)
+	return FALSE;
+
+    for (line = u->cutbuffer; line != NULL; line = line->next) {
+	if (fwrite(&line->lineno, sizeof(ssize_t), 1, f) != 1 ||
+		!spill_string(f, line->data, strlen(line->data)))
+	    return FALSE;
+    }
+
+    if (fflush(f) != 0)
+	return FALSE;
+
+    free(u->strdata);
+    u->strdata = NULL;
+    u->dataroom = 0;
+    free(u->strdata2);
+    u->strdata2 = NULL;
+    if (u->cutbuffer != NULL)
+	free_filestruct(u->cutbuffer);
+    u->cutbuffer = NULL;
+    u->cutbottom = NULL;
+    u->cutsize = 0;
+
+    u->spilled = TRUE;
+    account_undo(u);
+
+    return TRUE;
+}
+
+/* Read the text of the undo item u back in from the undo spill file of
+ * the current buffer, if it was written out.  Return FALSE if that
+ * fails. */
+static bool unspill_undo(undo *u)
+{
+    FILE *f = openfile->undo_spill;
+    char *data = NULL, *data2 = NULL;
+    size_t len, nlines, i;
+    filestruct *top = NULL, *bot = NULL;
+    size_t cutsize = 0;
+
+    /* Undoing and redoing use the text from its start. */
+    close_undo_gap(u);
+
+    if (!u->spilled)
+	return TRUE;
+
+    if (fseeko(f, u->spill_offset, SEEK_SET) == -1 ||
+	!unspill_string(f, &data, &len) ||
+	!unspill_string(f, &data2, NULL) ||
+	fread(&nlines, sizeof(size_t), 1, f) != 1)
+	goto read_error;
+
+    for (i = 0; i < nlines; i++) {
+	ssize_t lineno;
+	char *text;
+
+	if (fread(&lineno, sizeof(ssize_t), 1, f) != 1 ||
+		!unspill_string(f, &text, NULL))
+	    goto read_error;
+
+	bot = make_new_node(bot);
+	bot->data = text;
+	bot->lineno = lineno;
+	if (bot->prev != NULL)
+	    bot->prev->next = bot;
+	else
+	    top = bot;
+	cutsize += undo_line_size(bot);
+    }
+
+    u->strdata = data;
+    if (u->type == ADD || u->type == DEL) {
+	u->datalen = len;
+	u->dataroom = len + 1;
+    }
+    u->strdata2 = data2;
+    u->cutbuffer = top;
+    u->cutbottom = bot;
+    u->cutsize = cutsize;
+
+    u->spilled = FALSE;
+    account_undo(u);
+
+    /* Its text may have to be written out again. */
+    if (openfile->undo_trim == NULL ||
+	u->serial < openfile->undo_trim->serial)
+	openfile->undo_trim = u;
+
+    return TRUE;
+
+  read_error:
+    free(data);
+    free(data2);
+    if (top != NULL)
+	free_filestruct(top);
+    statusbar(_("Error reading undo data back in"));
+
+    return FALSE;
+}
+
+/* If the undo items of the current buffer take up more memory than
+ * the undo budget allows, write the text of the oldest ones out to the
+ * undo spill file until they take up no more than three quarters of
+ * it, so that this needn't happen again right away.  The newest item
+ * is always kept, as it may still grow.  The items below undo_trim
+ * have been dealt with already, so we carry on from there. */
+static void trim_undo(void)
+{
+    size_t budget = (size_t)undo_budget * 1024;
+    undo *u;
+
+    if (undo_budget == 0 || openfile->undo_size <= budget)
+	return;
+
+    for (u = openfile->undo_trim; u != NULL && u != openfile->undotop &&
+	openfile->undo_size > budget / 4 * 3; u = u->prev) {
+	if (!u->spilled && u->size > sizeof(undo) && !spill_undo(u))
+	    break;
+    }
+
+    openfile->undo_trim = u;
+}
+
+/* Let go of the handle on its line that the undo item u holds. */
+static void release_undo_line(undo *u)
+{
+    linehandle *handle = u->handle;
+
+    if (handle == NULL)
+	return;
+
+    u->handle = NULL;
+
+    if (--handle->refs > 0)
+	return;
+
+    if (handle->line != NULL)
+	handle->line->handle = NULL;
+    free(handle);
+}
+
+/* Make the undo item u refer to line, both by its number and by a
+ * handle, so that undoing and redoing can go straight to it. */
+void set_undo_line(undo *u, filestruct *line)
+{
+    release_undo_line(u);
+
+    if (line->handle == NULL) {
+	line->handle = (linehandle *)nmalloc(sizeof(linehandle));
+	line->handle->line = line;
+	line->handle->refs = 0;
+    }
+
+    line->handle->refs++;
+    u->handle = line->handle;
+    u->lineno = line->lineno;
+}
+
+/* Return the line that the undo item u applies to: the one its handle
+ * holds, if that line is still in the buffer where it should be, and
+ * otherwise the one with its line number, which it then gets a handle
+ * to.  Return NULL if there is no such line. */
+static filestruct *undo_line(undo *u)
+{
+    filestruct *f;
+
+    if (u->handle != NULL && u->handle->line != NULL &&
+	u->handle->line->lineno == u->lineno)
+	return u->handle->line;
+
+    /* The line was deleted, possibly to be made again by an uncut or a
+     * redo, so look for it the slow way. */
+    f = fsfromline(u->lineno);
+
+    if (f != NULL)
+	set_undo_line(u, f);
+
+    return f;
+}
+
+/* Put the cursor on line f at column, the way do_gotolinecolumn()
+ * does, but without going through the buffer to find the line. */
+static void goto_undo_line(filestruct *f, ssize_t column)
+{
+    if (column < 1)
+	column = openfile->placewewant + 1;
+
+    openfile->current = f;
+    openfile->current_x = actual_x(f->data, column - 1);
+    openfile->placewewant = column - 1;
+
+    edit_update(CENTER);
+    edit_refresh();
+    display_main_list();
+}
+
+/* Swap the u->lines lines starting at f with the lines kept in u, in
+ * one pass, keeping the ones taken out in u instead, and return the
+ * first line put in.  The cursor goes to the start of that line. */
+static filestruct *swap_group_lines(filestruct *f, undo *u)
+{
+    filestruct *top = u->cutbuffer, *bot = u->cutbottom;
+    filestruct *last = f, *line;
+    ssize_t nlines = 0, i;
+
+    for (i = 1; i < u->lines; i++)
+	last = last->next;
+
+    top->prev = f->prev;
+    if (f->prev != NULL)
+	f->prev->next = top;
+    else
+	openfile->fileage = top;
+    bot->next = last->next;
+    if (last->next != NULL)
+	last->next->prev = bot;
+    else
+	openfile->filebot = bot;
+    f->prev = NULL;
+    last->next = NULL;
+
+    u->cutsize = 0;
+    for (line = f; line != NULL; line = line->next) {
+	openfile->totsize -= mbstrlen(line->data) + 1;
+	u->cutsize += undo_line_size(line);
+	if (line == openfile->edittop)
+	    openfile->edittop = top;
+	if (openfile->mark_set && line == openfile->mark_begin) {
+	    openfile->mark_begin = top;
+	    openfile->mark_begin_x = 0;
+	}
+	/* Only the first line keeps its place, so the handles to the
+	 * others must not lead to them anymore. */
+	if (line != f && line->handle != NULL) {
+	    line->handle->line = NULL;
+	    line->handle = NULL;
+	}
+    }
+
+    for (line = top; line != NULL && line != bot->next; line =
+	line->next) {
+	openfile->totsize += mbstrlen(line->data) + 1;
+	nlines++;
+    }
+
+    top->handle = f->handle;
+    f->handle = NULL;
+    if (top->handle != NULL)
+	top->handle->line = top;
+
+    u->cutbuffer = f;
+    u->cutbottom = last;
+    u->lines = nlines;
+
+    renumber(top);
+    mark_changed(top, bot);
+
+    openfile->current = top;
+    openfile->current_x = 0;
+    openfile->placewewant = 0;
+
+    return top;
+}
+
 /* Undo the last thing(s) we did */
 void do_undo(void)
 {
     undo *u = openfile->current_undo;
-    filestruct *f = openfile->current, *t;
+    filestruct *f, *t;
     int len = 0;
+    size_t chars;
     char *undidmsg, *data;
     filestruct *oldcutbuffer = cutbuffer, *oldcutbottom = cutbottom;
+    bool held;
 
     if (!u) {
 	statusbar(_("Nothing in undo buffer!"));
 	return;
     }
 
+    if (!unspill_undo(u))
+	return;
 
-    if (u->lineno <= f->lineno)
-        for (; f->prev != NULL && f->lineno != u->lineno; f = f->prev)
-	    ;
-    else
-        for (; f->next != NULL && f->lineno != u->lineno; f = f->next)
-	    ;
-    if (f->lineno != u->lineno) {
+
+    f = undo_line(u);
+    if (f == NULL) {
         statusbar(_("Internal error: can't match line %d.  Please save your work"), u->lineno);
 	return;
     }
@@ -460,29 +876,47 @@ void do_undo(void)
     fprintf(stderr, "Undo running for type %d\n", u->type);
 #endif
 
+    /* The text of the line is changed in place, and for line breaks
+     * and wraps that of the next line too. */
+    unshare_node(f);
+    if (f->next != NULL)
+	unshare_node(f->next);
+
+    /* Taking out or putting back typed text keeps the lengths of its
+     * line up to date, but the other kinds of undo don't. */
+    held = (u->type != ADD && u->type != DEL);
+    if (held)
+	hold_lengths();
+
     openfile->current_x = u->begin;
     switch(u->type) {
     case ADD:
 	undidmsg = _("text add");
-	len = strlen(f->data) - strlen(u->strdata) + 1;
+	len = line_len(f) - u->datalen + 1;
+	chars = mbstrnlen(&f->data[u->begin], u->datalen);
         data = charalloc(len);
         strncpy(data, f->data, u->begin);
-	strcpy(&data[u->begin], &f->data[u->begin + strlen(u->strdata)]);
+	strcpy(&data[u->begin], &f->data[u->begin + u->datalen]);
 	free(f->data);
 	f->data = data;
+	adjust_line_len(f, -(ssize_t)u->datalen, -(ssize_t)chars);
+	mark_changed(f, f);
 	break;
     case DEL:
 	undidmsg = _("text delete");
-	len = strlen(f->data) + strlen(u->strdata) + 1;
+	len = line_len(f) + u->datalen + 1;
 	data = charalloc(len);
 
 	strncpy(data, f->data, u->begin);
 	strcpy(&data[u->begin], u->strdata);
-	strcpy(&data[u->begin + strlen(u->strdata)], &f->data[u->begin]);
+	strcpy(&data[u->begin + u->datalen], &f->data[u->begin]);
 	free(f->data);
 	f->data = data;
+	adjust_line_len(f, u->datalen, mbstrnlen(u->strdata,
+		u->datalen));
+	mark_changed(f, f);
 	if (u->xflags == UNDO_DEL_BACKSPACE)
-	    openfile->current_x += strlen(u->strdata);
+	    openfile->current_x += u->datalen;
 	break;
 #ifndef DISABLE_WRAPPING
     case SPLIT:
@@ -493,10 +927,13 @@ void do_undo(void)
 	    f->next->data = mallocstrcpy(f->next->data, u->strdata2);
 	else {
 	    filestruct *foo = openfile->current->next;
+	    if (foo == openfile->filebot)
+		openfile->filebot = f;
 	    unlink_node(foo);
 	    delete_node(foo);
 	}
 	renumber(f);
+	mark_changed(f, (f->next != NULL) ? f->next : f);
 	break;
 #endif /* DISABLE_WRAPPING */
     case UNSPLIT:
@@ -509,14 +946,17 @@ void do_undo(void)
 	f->data = data;
 	splice_node(f, t, f->next);
 	renumber(f);
+	mark_changed(f, t);
 	break;
     case CUT:
 	undidmsg = _("text cut");
         undo_cut(u);
+	f = NULL;
 	break;
     case UNCUT:
 	undidmsg = _("text uncut");
 	redo_cut(u);
+	f = NULL;
 	break;
     case ENTER:
 	undidmsg = _("line break");
@@ -524,8 +964,12 @@ void do_undo(void)
 	    filestruct *foo = f->next;
 	    f->data = (char *) nrealloc(f->data, strlen(f->data) + strlen(f->next->data) + 1);
 	    strcat(f->data,  f->next->data);
+	    if (foo == openfile->filebot)
+		openfile->filebot = f;
 	    unlink_node(foo);
 	    delete_node(foo);
+	    renumber(f);
+	    mark_changed(f, f);
 	}
 	break;
     case INSERT:
@@ -542,15 +986,29 @@ void do_undo(void)
 	cut_marked();
 	u->cutbuffer = cutbuffer;
 	u->cutbottom = cutbottom;
+	u->cutsize = 0;
+	for (f = u->cutbuffer; f != NULL; f = f->next)
+	    u->cutsize += undo_line_size(f);
 	cutbuffer = oldcutbuffer;
 	cutbottom = oldcutbottom;
 	openfile->mark_set = FALSE;
+	f = NULL;
 	break;
     case REPLACE:
 	undidmsg = _("text replace");
 	data = u->strdata;
 	u->strdata = f->data;
 	f->data = data;
+	mark_changed(f, f);
+	break;
+    case REPLACEALL:
+	undidmsg = _("text replace");
+	swap_replaced_lines(f, u);
+	break;
+    case GROUP:
+	undidmsg = (u->xflags == UNDO_GROUP_JUSTIFY) ? _("justify") :
+		_("indent");
+	f = swap_group_lines(f, u);
 	break;
 
     default:
@@ -558,8 +1016,19 @@ void do_undo(void)
 	break;
 
     }
-    renumber(f);
-    do_gotolinecolumn(u->lineno, u->begin, FALSE, FALSE, FALSE, TRUE);
+
+    if (held)
+	release_lengths();
+
+    /* Cutting and uncutting may have deleted the line, so then find
+     * the place again by its number. */
+    if (f != NULL)
+	goto_undo_line(f, u->begin);
+    else
+	do_gotolinecolumn(u->lineno, u->begin, FALSE, FALSE, FALSE, TRUE);
+    set_modified();
+    account_undo(u);
+    trim_undo();
     statusbar(_("Undid action (%s)"), undidmsg);
     openfile->current_undo = openfile->current_undo->next;
     openfile->last_action = OTHER;
@@ -568,9 +1037,11 @@ void do_undo(void)
 void do_redo(void)
 {
     undo *u = openfile->undotop;
-    filestruct *f = openfile->current;
+    filestruct *f;
     int len = 0;
+    size_t chars;
     char *undidmsg, *data;
+    bool held;
 
     for (; u != NULL && u->next != openfile->current_undo; u = u->next)
 	;
@@ -583,13 +1054,11 @@ void do_redo(void)
 	return;
     }
 
-    if (u->lineno <= f->lineno)
-        for (; f->prev != NULL && f->lineno != u->lineno; f = f->prev)
-	    ;
-    else
-        for (; f->next != NULL && f->lineno != u->lineno; f = f->next)
-	    ;
-    if (f->lineno != u->lineno) {
+    if (!unspill_undo(u))
+	return;
+
+    f = undo_line(u);
+    if (f == NULL) {
         statusbar(_("Internal error: can't match line %d.  Please save your work"), u->lineno);
 	return;
     }
@@ -598,29 +1067,46 @@ void do_redo(void)
     fprintf(stderr, "Redo running for type %d\n", u->type);
 #endif
 
+    unshare_node(f);
+    if (f->next != NULL)
+	unshare_node(f->next);
+
+    /* Putting back or taking out typed text and breaking a line keep
+     * the lengths of the lines they change up to date, but the other
+     * kinds of redo don't. */
+    held = (u->type != ADD && u->type != DEL && u->type != ENTER);
+    if (held)
+	hold_lengths();
+
     switch(u->type) {
     case ADD:
 	undidmsg = _("text add");
-	len = strlen(f->data) + strlen(u->strdata) + 1;
+	len = line_len(f) + u->datalen + 1;
         data = charalloc(len);
 	strncpy(data, f->data, u->begin);
 	strcpy(&data[u->begin], u->strdata);
-	strcpy(&data[u->begin + strlen(u->strdata)], &f->data[u->begin]);
+	strcpy(&data[u->begin + u->datalen], &f->data[u->begin]);
 	free(f->data);
 	f->data = data;
+	adjust_line_len(f, u->datalen, mbstrnlen(u->strdata,
+		u->datalen));
+	mark_changed(f, f);
 	break;
     case DEL:
 	undidmsg = _("text delete");
-	len = strlen(f->data) + strlen(u->strdata) + 1;
+	len = line_len(f) - u->datalen + 1;
+	chars = mbstrnlen(&f->data[u->begin], u->datalen);
 	data = charalloc(len);
         strncpy(data, f->data, u->begin);
-	strcpy(&data[u->begin], &f->data[u->begin + strlen(u->strdata)]);
+	strcpy(&data[u->begin], &f->data[u->begin + u->datalen]);
 	free(f->data);
 	f->data = data;
+	adjust_line_len(f, -(ssize_t)u->datalen, -(ssize_t)chars);
+	mark_changed(f, f);
 	break;
     case ENTER:
 	undidmsg = _("line break");
-	do_gotolinecolumn(u->lineno, u->begin+1, FALSE, FALSE, FALSE, FALSE);
+	goto_undo_line(f, u->begin + 1);
 	do_enter(TRUE);
 	break;
 #ifndef DISABLE_WRAPPING
@@ -646,33 +1132,57 @@ void do_redo(void)
 	    delete_node(tmp);
 	}
 	renumber(f);
+	mark_changed(f, f);
 	break;
     case CUT:
 	undidmsg = _("text cut");
 	redo_cut(u);
+	f = NULL;
 	break;
     case UNCUT:
 	undidmsg = _("text uncut");
 	undo_cut(u);
+	f = NULL;
 	break;
     case REPLACE:
 	undidmsg = _("text replace");
 	data = u->strdata;
 	u->strdata = f->data;
 	f->data = data;
+	mark_changed(f, f);
+	break;
+    case REPLACEALL:
+	undidmsg = _("text replace");
+	swap_replaced_lines(f, u);
+	break;
+    case GROUP:
+	undidmsg = (u->xflags == UNDO_GROUP_JUSTIFY) ? _("justify") :
+		_("indent");
+	f = swap_group_lines(f, u);
 	break;
     case INSERT:
 	undidmsg = _("text insert");
 	do_gotolinecolumn(u->lineno, u->begin+1, FALSE, FALSE, FALSE, FALSE);
         copy_from_filestruct(u->cutbuffer, u->cutbottom);
 	openfile->placewewant = xplustabs();
+	f = NULL;
 	break;
     default:
 	undidmsg = _("Internal error: unknown type.  Please save your work");
 	break;
 
     }
-    do_gotolinecolumn(u->lineno, u->begin, FALSE, FALSE, FALSE, TRUE);
+
+    if (held)
+	release_lengths();
+
+    if (f != NULL)
+	goto_undo_line(f, u->begin);
+    else
+	do_gotolinecolumn(u->lineno, u->begin, FALSE, FALSE, FALSE, TRUE);
+    set_modified();
+    account_undo(u);
+    trim_undo();
     statusbar(_("Redid action (%s)"), undidmsg);
 
     openfile->current_undo = u;
@@ -716,6 +1226,9 @@ void do_enter(bool undoing)
 #endif
     null_at(&openfile->current->data, openfile->current_x);
 #ifndef NANO_TINY
+    measure_line(openfile->current);
+    measure_line(newnode);
+
     if (openfile->mark_set && openfile->current ==
 	openfile->mark_begin && openfile->current_x <
 	openfile->mark_begin_x) {
@@ -730,8 +1243,19 @@ void do_enter(bool undoing)
     splice_node(openfile->current, newnode,
 	openfile->current->next);
 
-    renumber(openfile->current);
-    openfile->current = newnode;
+    /* When typing, number only the lines on the screen right away. */
+    if (undoing) {
+	renumber(openfile->current);
+	openfile->current = newnode;
+    } else {
+	filestruct *prev = openfile->current;
+
+	openfile->current = newnode;
+	renumber_partly(prev, 1);
+    }
+#ifndef NANO_TINY
+    mark_changed(newnode->prev, newnode);
+#endif
 
     openfile->totsize++;
     set_modified();
@@ -835,13 +1359,101 @@ bool execute_command(const char *command)
     return TRUE;
 }
 
+/* Add the len bytes of text to the end of the text kept by the undo
+ * item u, or to its start if prepend is TRUE.  The room for the text
+ * doubles whenever it runs out, so that a long run of typing or
+ * deleting adds each character in amortized constant time.  For that,
+ * backspacing keeps the text at the end of its room, and adds to it in
+ * the room left in front of it, until close_undo_gap() moves it back
+ * to the start. */
+static void undo_add_text(undo *u, const char *text, size_t len, bool
+	prepend)
+{
+    if (prepend && len <= u->datagap) {
+	u->datagap -= len;
+	strncpy(u->strdata + u->datagap, text, len);
+	u->datalen += len;
+	return;
+    }
+
+    close_undo_gap(u);
+
+    if (u->datalen + len + 1 > u->dataroom) {
+	while (u->datalen + len + 1 > u->dataroom)
+	    u->dataroom = (u->dataroom < 8) ? 8 : u->dataroom * 2;
+	u->strdata = charealloc(u->strdata, u->dataroom);
+    }
+
+    if (prepend) {
+	u->datagap = u->dataroom - u->datalen - len - 1;
+	charmove(u->strdata + u->datagap + len, u->strdata, u->datalen);
+	strncpy(u->strdata + u->datagap, text, len);
+    } else
+	strncpy(u->strdata + u->datalen, text, len);
+
+    u->datalen += len;
+    u->strdata[u->datagap + u->datalen] = '\0';
+}
+
+/* Return how much memory the line f takes up as part of the lines that
+ * an undo item keeps. */
+size_t undo_line_size(const filestruct *f)
+{
+    return sizeof(filestruct) + line_len(f) + 1;
+}
+
+/* Work out again how much memory the undo item u takes up, and update
+ * the total for the current file accordingly.  The size of the lines
+ * it keeps is kept up to date in u->cutsize as they come and go. */
+void account_undo(undo *u)
+{
+    size_t size = sizeof(undo) + u->cutsize;
+
+    if (u->type == ADD || u->type == DEL)
+	size += u->dataroom;
+    else if (u->strdata != NULL)
+	size += strlen(u->strdata) + 1;
+    if (u->strdata2 != NULL)
+	size += strlen(u->strdata2) + 1;
+
+    openfile->undo_size += size - u->size;
+    u->size = size;
+}
+
+/* Free the undo item u, and let go of what it refers to. */
+static void free_undo(undo *u)
+{
+    release_undo_line(u);
+    release_spill_range(u->cut_range);
+    if (u == last_cutu)
+	last_cutu = NULL;
+    if (u->strdata != NULL)
+	free(u->strdata);
+    if (u->strdata2 != NULL)
+	free(u->strdata2);
+    if (u->cutbuffer)
+	free_filestruct(u->cutbuffer);
+    free(u);
+}
+
+/* Free the undo items from u onward, as the file they're for is being
+ * closed. */
+void free_undo_stack(undo *u)
+{
+    while (u != NULL) {
+	undo *next = u->next;
+
+	free_undo(u);
+	u = next;
+    }
+}
+
 /* Add a new undo struct to the top of the current pile */
 void add_undo(undo_type current_action)
 {
     undo *u;
     char *data;
     openfilestruct *fs = openfile;
-    static undo *last_cutu = NULL; /* Last thing we cut to set up the undo for uncut */
     ssize_t wrap_loc;	/* For calculating split beginning */
 
     if (!ISSET(UNDOABLE))
@@ -858,45 +1470,61 @@ void add_undo(undo_type current_action)
     while (fs->undotop != NULL && fs->undotop != fs->current_undo) {
 	undo *u2 = fs->undotop;
 	fs->undotop = fs->undotop->next;
-	if (u2->strdata != NULL)
-	    free(u2->strdata);
-	if (u2->cutbuffer)
-	    free_filestruct(u2->cutbuffer);
-	free(u2);
+	if (fs->undotop != NULL)
+	    fs->undotop->prev = NULL;
+	fs->undo_size -= u2->size;
+	if (u2 == fs->undo_trim)
+	    fs->undo_trim = NULL;
+	free_undo(u2);
     }
 
     /* Allocate and initialize a new undo type */
     u = (undo *) nmalloc(sizeof(undo));
     u->type = current_action;
-    u->lineno = fs->current->lineno;
+    u->handle = NULL;
+    set_undo_line(u, fs->current);
     u->begin = fs->current_x;
+    u->serial = undo_serial++;
     u->next = fs->undotop;
+    u->prev = NULL;
+    if (fs->undotop != NULL)
+	fs->undotop->prev = u;
     fs->undotop = u;
     fs->current_undo = u;
+    if (fs->undo_trim == NULL)
+	fs->undo_trim = u;
     u->strdata = NULL;
+    u->datalen = 0;
+    u->dataroom = 0;
+    u->datagap = 0;
     u->strdata2 = NULL;
+    u->size = 0;
+    u->spilled = FALSE;
+    u->cut_lines = 0;
+    u->cut_range = NULL;
     u->cutbuffer = NULL;
     u->cutbottom  = NULL;
+    u->cutsize = 0;
     u->mark_set = 0;
     u->mark_begin_lineno = 0;
     u->mark_begin_x = 0;
     u->xflags = 0;
     u->to_end = FALSE;
+    u->lines = 0;
 
     switch (u->type) {
     /* We need to start copying data into the undo buffer or we wont be able
        to restore it later */
     case ADD:
-        data = charalloc(2);
-        data[0] = fs->current->data[fs->current_x];
-        data[1] = '\0';
-        u->strdata = data;
+	undo_add_text(u, &fs->current->data[fs->current_x],
+		parse_mbchar(&fs->current->data[fs->current_x], NULL, NULL),
+		FALSE);
 	break;
     case DEL:
 	if (u->begin != strlen(fs->current->data)) {
-            data = mallocstrncpy(NULL, &fs->current->data[u->begin], 2);
-            data[1] = '\0';
-            u->strdata = data;
+	    undo_add_text(u, &fs->current->data[u->begin],
+		parse_mbchar(&fs->current->data[u->begin], NULL, NULL),
+		FALSE);
 	    break;
 	}
 	/* Else purposely fall into unsplit code */
@@ -927,6 +1555,11 @@ void add_undo(undo_type current_action)
 	data = mallocstrcpy(NULL, fs->current->data);
 	u->strdata = data;
 	break;
+    case REPLACEALL:
+	/* The old lines are added by replace_all() as it goes. */
+    case GROUP:
+	/* The old lines are added by begin_undo_group(). */
+	break;
     case CUT:
 	u->mark_set = openfile->mark_set;
 	if (u->mark_set) {
@@ -939,9 +1572,17 @@ void add_undo(undo_type current_action)
     case UNCUT:
 	if (!last_cutu)
 	    statusbar(_("Internal error: can't setup uncut.  Please save your work."));
-	else if (last_cutu->type == CUT) {
-	    u->cutbuffer = last_cutu->cutbuffer;
-	    u->cutbottom = last_cutu->cutbottom;
+	else if (last_cutu->type == CUT && unspill_undo(last_cutu) &&
+		last_cutu->cutbuffer != NULL) {
+	    /* Keep a copy of the text, as the cut may be written out to
+	     * the undo spill file or thrown away before this item is. */
+	    u->cutbuffer = copy_filestruct(last_cutu->cutbuffer);
+	    for (u->cutbottom = u->cutbuffer; u->cutbottom->next != NULL;
+		u->cutbottom = u->cutbottom->next)
+		;
+	    u->cutsize = last_cutu->cutsize;
+	    u->cut_lines = last_cutu->cut_lines;
+	    u->cut_range = hold_spill_range(last_cutu->cut_range);
 	}
 	break;
     case ENTER:
@@ -955,6 +1596,11 @@ void add_undo(undo_type current_action)
     fprintf(stderr, "fs->current->data = \"%s\", current_x = %lu, u->begin = %d, type = %d\n",
 			fs->current->data,  (unsigned long) fs->current_x, u->begin, current_action);
     fprintf(stderr, "left add_undo...\n");
+#endif
+    account_undo(u);
+    trim_undo();
+#ifdef DEBUG
+    fprintf(stderr, "undo items now take up %lu bytes\n", (unsigned long) fs->undo_size);
 #endif
     fs->last_action = current_action;
 }
@@ -967,8 +1613,7 @@ void add_undo(undo_type current_action)
 void update_undo(undo_type action)
 {
     undo *u;
-    char *data;
-    int len = 0;
+    int char_len;
     openfilestruct *fs = openfile;
 
     if (!ISSET(UNDOABLE))
@@ -1001,18 +1646,23 @@ void update_undo(undo_type action)
         fprintf(stderr, "fs->current->data = \"%s\", current_x = %lu, u->begin = %d\n",
 			fs->current->data, (unsigned long) fs->current_x, u->begin);
 #endif
-        len = strlen(u->strdata) + 2;
-        data = (char *) nrealloc((void *) u->strdata, len * sizeof(char *));
-        data[len-2] = fs->current->data[fs->current_x];
-        data[len-1] = '\0';
-        u->strdata = (char *) data;
+	undo_add_text(u, &fs->current->data[fs->current_x],
+		parse_mbchar(&fs->current->data[fs->current_x], NULL, NULL),
+		FALSE);
 #ifdef DEBUG
 	fprintf(stderr, "current undo data now \"%s\"\n", u->strdata);
 #endif
 	break;
     case DEL:
-	len = strlen(u->strdata) + 2;
-	assert(len > 2);
+	assert(u->datalen > 0);
+	/* Deleting the end of the line joins lines, which is undone
+	 * another way. */
+	if (fs->current->data[fs->current_x] == '\0') {
+	    add_undo(action);
+	    return;
+	}
+	char_len = parse_mbchar(&fs->current->data[fs->current_x], NULL,
+		NULL);
         if (fs->current_x == u->begin) {
 	    /* They're deleting */
 	    if (!u->xflags)
@@ -1021,13 +1671,9 @@ void update_undo(undo_type action)
 		add_undo(action);
 		return;
 	    }
-	    data = charalloc(len);
-	    strcpy(data, u->strdata);
-	    data[len-2] = fs->current->data[fs->current_x];;
-	    data[len-1] = '\0';
-	    free(u->strdata);
-	    u->strdata = data;
-	} else if (fs->current_x == u->begin - 1) {
+	    undo_add_text(u, &fs->current->data[fs->current_x],
+		char_len, FALSE);
+	} else if (fs->current_x + char_len == u->begin) {
 	    /* They're backspacing */
 	    if (!u->xflags)
 		u->xflags = UNDO_DEL_BACKSPACE;
@@ -1035,32 +1681,38 @@ void update_undo(undo_type action)
 		add_undo(action);
 		return;
 	    }
-	    data = charalloc(len);
-	    data[0] = fs->current->data[fs->current_x];
-	    strcpy(&data[1], u->strdata);
-	    free(u->strdata);
-	    u->strdata = data;
-	    u->begin--;
+	    /* The text moves up just as the line itself does. */
+	    undo_add_text(u, &fs->current->data[fs->current_x],
+		char_len, TRUE);
+	    u->begin -= char_len;
 	} else {
 	    /* They deleted something else on the line */
 	    add_undo(DEL);
 	    return;
 	}
 #ifdef DEBUG
-	fprintf(stderr, "current undo data now \"%s\"\nu->begin = %d\n", u->strdata, u->begin);
+	fprintf(stderr, "current undo data now \"%s\"\nu->begin = %d\n", u->strdata + u->datagap, u->begin);
 #endif
 	break;
     case CUT:
 	if (!cutbuffer)
 	    break;
 	if (u->cutbuffer)
-	    free(u->cutbuffer);
+	    free_filestruct(u->cutbuffer);
 	u->cutbuffer = copy_filestruct(cutbuffer);
+	u->cutsize = undo_line_size(u->cutbuffer);
         /* Compute cutbottom for the uncut using out copy */
         for (u->cutbottom = u->cutbuffer; u->cutbottom->next != NULL; u->cutbottom = u->cutbottom->next)
-            ;
+            u->cutsize += undo_line_size(u->cutbottom->next);
+	/* The part of the text that was written out stays in the cut
+	 * spill file, so only where it is needs to be kept. */
+	u->cut_lines = cut_spill_lines;
+	hold_spill_range(cut_spill_range);
+	release_spill_range(u->cut_range);
+	u->cut_range = cut_spill_range;
 	break;
     case REPLACE:
+    case REPLACEALL:
     case UNCUT:
 	add_undo(action);
 	break;
@@ -1077,10 +1729,13 @@ void update_undo(undo_type action)
     case UNSPLIT:
 	/* These cases are handled by the earlier check for a new line and action */
     case ENTER:
+    case GROUP:
     case OTHER:
 	break;
     }
 
+    account_undo(u);
+    trim_undo();
 #ifdef DEBUG
     fprintf(stderr, "Done in udpate_undo (type was %d)\n", action);
 #endif
@@ -1093,6 +1748,86 @@ void update_undo(undo_type action)
     fs->last_action = action;
 }
 
+/* Start an undo item for a change that may rewrite all the lines from
+ * top to bot at once, such as indenting or justifying them, by keeping
+ * a copy of those lines as they are now.  Whatever the change does to
+ * them, and however many lines it leaves, is then undone or redone in
+ * one go, once it's been committed with commit_undo_group().  xflags
+ * says what kind of change it is. */
+void begin_undo_group(filestruct *top, const filestruct *bot, int
+	xflags)
+{
+    undo *u;
+
+    if (!ISSET(UNDOABLE))
+	return;
+
+    add_undo(GROUP);
+    u = openfile->current_undo;
+    set_undo_line(u, top);
+    u->begin = 0;
+    u->xflags = xflags;
+
+    u->cutbuffer = copy_node(top);
+    u->cutbottom = u->cutbuffer;
+    u->cutsize = undo_line_size(u->cutbuffer);
+    while (top != bot) {
+	top = top->next;
+	u->cutbottom->next = copy_node(top);
+	u->cutbottom->next->prev = u->cutbottom;
+	u->cutbottom = u->cutbottom->next;
+	u->cutsize += undo_line_size(u->cutbottom);
+    }
+    u->cutbuffer->prev = NULL;
+    u->cutbottom->next = NULL;
+
+    /* The lines after bot are left alone, so counting them now tells
+     * us later where the changed lines end. */
+    u->lines = openfile->filebot->lineno - bot->lineno;
+
+    account_undo(u);
+    trim_undo();
+}
+
+/* Finish the undo item started by begin_undo_group(), now that the
+ * change is done. */
+void commit_undo_group(void)
+{
+    undo *u = openfile->current_undo;
+
+    if (!ISSET(UNDOABLE) || u == NULL || u->type != GROUP)
+	return;
+
+    u->lines = openfile->filebot->lineno - u->lines - u->lineno + 1;
+    undo_line(u);
+
+    account_undo(u);
+    trim_undo();
+    openfile->last_action = OTHER;
+}
+
+/* Throw away the undo item started by begin_undo_group(), as the
+ * change it was for has been taken back. */
+void discard_undo_group(void)
+{
+    undo *u = openfile->current_undo;
+
+    if (!ISSET(UNDOABLE) || u == NULL || u->type != GROUP)
+	return;
+
+    openfile->undotop = u->next;
+    openfile->current_undo = u->next;
+    if (openfile->undotop != NULL)
+	openfile->undotop->prev = NULL;
+    if (openfile->undo_trim == u)
+	openfile->undo_trim = NULL;
+    openfile->undo_size -= u->size;
+    release_undo_line(u);
+    free_filestruct(u->cutbuffer);
+    free(u);
+    openfile->last_action = OTHER;
+}
+
 #endif /* !NANO_TINY */
 
 #ifndef DISABLE_WRAPPING
@@ -1297,6 +2032,11 @@ bool do_wrap(filestruct *line, bool undoing)
 	openfile->totsize++;
     }
 
+#ifndef NANO_TINY
+    measure_line(line);
+    measure_line(line->next);
+#endif
+
     /* Step 3, clean up.  Reposition the cursor and mark, and do some
      * other sundry things. */
 
@@ -1306,8 +2046,15 @@ bool do_wrap(filestruct *line, bool undoing)
 
     /* Each line knows its number.  We recalculate these if we inserted
      * a new line. */
-    if (!prepending)
-	renumber(line);
+    if (!prepending) {
+	if (undoing)
+	    renumber(line);
+	else
+	    renumber_partly(line, 1);
+    }
+#ifndef NANO_TINY
+    mark_changed(line, line->next);
+#endif
 
     /* If the cursor was after the break point, we must move it.  We
      * also clear the prepend_wrap flag in this case. */
@@ -1833,6 +2580,9 @@ void backup_lines(filestruct *first_line, size_t par_len)
 	    openfile->mark_begin = top;
 	    openfile->mark_begin_x = mark_begin_x_save;
 	}
+
+	/* The copied lines are about to be justified in place. */
+	unshare_node(top);
 #endif
 	top = top->prev;
     }
@@ -2033,10 +2783,20 @@ void do_justify(bool full_justify)
 	 * paragraph(s) into the file in the same place, and set
 	 * first_par_line to the first line of the copy. */
 	if (first_par_line == NULL) {
-	    backup_lines(openfile->current, full_justify ?
+	    size_t backup_len = full_justify ?
 		openfile->filebot->lineno - openfile->current->lineno +
 		((openfile->filebot->data[0] != '\0') ? 1 : 0) :
-		par_len);
+		par_len;
+#ifndef NANO_TINY
+	    filestruct *backup_bot = openfile->current;
+
+	    for (i = 1; i < backup_len; i++)
+		backup_bot = backup_bot->next;
+
+	    begin_undo_group(openfile->current, backup_bot,
+		UNDO_GROUP_JUSTIFY);
+#endif
+	    backup_lines(openfile->current, backup_len);
 	    first_par_line = openfile->current;
 	}
 
@@ -2250,8 +3010,12 @@ void do_justify(bool full_justify)
      * up.  current_y and totsize have been maintained above.  If we
      * actually justified something, set last_par_line to the new end of
      * the paragraph. */
-    if (first_par_line != NULL)
+    if (first_par_line != NULL) {
 	last_par_line = openfile->current;
+#ifndef NANO_TINY
+	mark_changed(first_par_line, last_par_line);
+#endif
+    }
 
     edit_refresh();
 
@@ -2323,10 +3087,18 @@ void do_justify(bool full_justify)
 	    }
 #endif
 	    openfile->modified = modified_save;
+#ifndef NANO_TINY
+	    openfile->version++;
+#endif
 
 	    /* Clear the justify buffer. */
 	    jusbuffer = NULL;
 
+#ifndef NANO_TINY
+	    /* There's nothing left to undo. */
+	    discard_undo_group();
+#endif
+
 	    if (!openfile->modified)
 		titlebar(NULL);
 	    edit_refresh_needed = TRUE;
@@ -2334,6 +3106,12 @@ void do_justify(bool full_justify)
     } else {
 	unget_kbinput(kbinput, meta_key, func_key);
 
+#ifndef NANO_TINY
+	/* Let the justify be undone from now on. */
+	if (first_par_line != NULL)
+	    commit_undo_group();
+#endif
+
 	/* Blow away the text in the justify buffer. */
 	free_filestruct(jusbuffer);
 	jusbuffer = NULL;
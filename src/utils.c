@@ -138,11 +138,14 @@ void null_at(char **data, size_t index)
  * normally have newlines in it, so encode its nulls as newlines. */
 void unsunder(char *str, size_t true_len)
 {
+    char *nul;
+
     assert(str != NULL);
 
-    for (; true_len > 0; true_len--, str++) {
-	if (*str == '\0')
-	    *str = '\n';
+    while ((nul = (char *)memchr(str, '\0', true_len)) != NULL) {
+	*nul = '\n';
+	true_len -= nul - str + 1;
+	str = nul + 1;
     }
 }
 
@@ -246,6 +249,15 @@ ssize_t ngetline(char **lineptr, size_t *n, FILE *stream)
 #endif /* ENABLE_NANORC */
 
 #ifdef HAVE_REGEX_H
+static regexcachetype *regexp_cache = NULL;
+	/* The compiled regexes we know about, most recently used first. */
+static regexcachetype *regexp_cache_bot = NULL;
+	/* The least recently used compiled regex. */
+static unsigned long regexp_cache_hits = 0;
+	/* How many times a regex was found in the cache. */
+static unsigned long regexp_cache_misses = 0;
+	/* How many times a regex had to be compiled. */
+
 /* Do the compiled regex in preg and the regex in string match the
  * beginning or end of a line? */
 bool regexp_bol_or_eol(const regex_t *preg, const char *string)
@@ -255,6 +267,157 @@ bool regexp_bol_or_eol(const regex_t *preg, const char *string)
 	REG_NOMATCH);
 }
 
+/* Move entry to the front of the regex cache, since it's the most
+ * recently used one now. */
+static void regexp_cache_touch(regexcachetype *entry)
+{
+    if (entry == regexp_cache)
+	return;
+
+    if (entry->prev != NULL)
+	entry->prev->next = entry->next;
+    if (entry->next != NULL)
+	entry->next->prev = entry->prev;
+    if (entry == regexp_cache_bot)
+	regexp_cache_bot = entry->prev;
+
+    entry->prev = NULL;
+    entry->next = regexp_cache;
+    if (regexp_cache != NULL)
+	regexp_cache->prev = entry;
+    regexp_cache = entry;
+    if (regexp_cache_bot == NULL)
+	regexp_cache_bot = entry;
+}
+
+/* Unlink entry from the regex cache, and free it. */
+static void regexp_cache_delete(regexcachetype *entry)
+{
+    if (entry->prev != NULL)
+	entry->prev->next = entry->next;
+    else
+	regexp_cache = entry->next;
+    if (entry->next != NULL)
+	entry->next->prev = entry->prev;
+    else
+	regexp_cache_bot = entry->prev;
+
+    regfree(&entry->preg);
+    free(entry->regex);
+    free(entry);
+}
+
+/* Drop the least recently used regexes that nobody is holding on to
+ * until at most MAX_REGEXP_CACHE of them are left. */
+static void regexp_cache_trim(void)
+{
+    regexcachetype *entry;
+    size_t idle = 0;
+
+    for (entry = regexp_cache; entry != NULL; entry = entry->next)
+	if (entry->refcount == 0)
+	    idle++;
+
+    for (entry = regexp_cache_bot; entry != NULL &&
+	idle > MAX_REGEXP_CACHE;) {
+	regexcachetype *prev = entry->prev;
+
+	if (entry->refcount == 0) {
+	    regexp_cache_delete(entry);
+	    idle--;
+	}
+	entry = prev;
+    }
+}
+
+/* Return the compiled form of the regex string regex with the flags
+ * cflags, compiling it only if the regex cache doesn't already have it.
+ * The caller has to give it back with regexp_cache_release() when it's
+ * done with it.  If regex is invalid, return NULL, and if errmsg isn't
+ * NULL, point it at an allocated description of the error. */
+regex_t *regexp_cache_get(const char *regex, int cflags, char **errmsg)
+{
+    regexcachetype *entry;
+    int rc;
+
+    assert(regex != NULL);
+
+    for (entry = regexp_cache; entry != NULL; entry = entry->next) {
+	if (entry->cflags == cflags && strcmp(entry->regex, regex) == 0)
+	    break;
+    }
+
+    if (entry != NULL) {
+	regexp_cache_hits++;
+#ifdef DEBUG
+	fprintf(stderr, "regexp_cache_get(): hit for \"%s\" (%lu hits, %lu misses)\n", regex, regexp_cache_hits, regexp_cache_misses);
+#endif
+	regexp_cache_touch(entry);
+	entry->refcount++;
+	return &entry->preg;
+    }
+
+    regexp_cache_misses++;
+#ifdef DEBUG
+    fprintf(stderr, "regexp_cache_get(): miss for \"%s\" (%lu hits, %lu misses)\n", regex, regexp_cache_hits, regexp_cache_misses);
+#endif
+
+    entry = (regexcachetype *)nmalloc(sizeof(regexcachetype));
+
+    rc = regcomp(&entry->preg, regex, cflags);
+
+    if (rc != 0) {
+	if (errmsg != NULL) {
+	    size_t len = regerror(rc, &entry->preg, NULL, 0);
+
+	    *errmsg = charalloc(len);
+	    regerror(rc, &entry->preg, *errmsg, len);
+	}
+	free(entry);
+	return NULL;
+    }
+
+    entry->regex = mallocstrcpy(NULL, regex);
+    entry->cflags = cflags;
+    entry->refcount = 1;
+    entry->prev = NULL;
+    entry->next = NULL;
+
+    regexp_cache_touch(entry);
+    regexp_cache_trim();
+
+    return &entry->preg;
+}
+
+/* Give back a regex we got from regexp_cache_get().  It stays in the
+ * cache until enough other unused regexes push it out. */
+void regexp_cache_release(regex_t *preg)
+{
+    regexcachetype *entry;
+
+    for (entry = regexp_cache; entry != NULL; entry = entry->next) {
+	if (&entry->preg == preg)
+	    break;
+    }
+
+    assert(entry != NULL && entry->refcount > 0);
+
+    if (entry != NULL && --entry->refcount == 0)
+	regexp_cache_trim();
+}
+
+#ifdef DEBUG
+/* Empty the regex cache, whether or not anyone still holds its
+ * regexes. */
+void regexp_cache_free(void)
+{
+    fprintf(stderr, "regexp_cache_free(): %lu hits, %lu misses\n", regexp_cache_hits, regexp_cache_misses);
+
+    while (regexp_cache != NULL)
+	regexp_cache_delete(regexp_cache);
+}
+#endif
+
 /* Fix the regex if we're on platforms which requires an adjustment
  * from GNU-style to BSD-style word boundaries.  */
 const char *fixbounds(const char *r) {
@@ -339,28 +502,54 @@ const char *strstrwrapper(const char *haystack, const char *needle,
     if (ISSET(USE_REGEXP)) {
 #ifndef NANO_TINY
 	if (ISSET(BACKWARDS_SEARCH)) {
-	    if (regexec(&search_regexp, haystack, 1, regmatches,
+	    if (regexec(search_regexp, haystack, 1, regmatches,
 		0) == 0 && haystack + regmatches[0].rm_so <= start) {
 		const char *retval = haystack + regmatches[0].rm_so;
-
+#ifdef REG_STARTEND
+		size_t last_find = regmatches[0].rm_so;
+		size_t ceiling = start - haystack;
+		size_t far_end = strlen(haystack);
+
+		/* Walk forward over the line once, one match start at a
+		 * time, remembering the last match that starts no later
+		 * than start.  REG_STARTEND keeps regexec() from
+		 * measuring the rest of the line again on every step,
+		 * and only the whole match is asked for until we know
+		 * which one we want. */
+		while (last_find < ceiling) {
+		    regmatches[0].rm_so = move_mbright(haystack,
+			last_find);
+		    regmatches[0].rm_eo = far_end;
+
+		    if (regexec(search_regexp, haystack, 1, regmatches,
+			REG_STARTEND) != 0 || regmatches[0].rm_so >
+			ceiling)
+			break;
+
+		    last_find = regmatches[0].rm_so;
+		}
+
+		retval = haystack + last_find;
+#else
 		/* Search forward until there are no more matches. */
-		while (regexec(&search_regexp, retval + 1, 1,
+		while (regexec(search_regexp, retval + 1, 1,
 			regmatches, REG_NOTBOL) == 0 &&
 			retval + regmatches[0].rm_so + 1 <= start)
 		    retval += regmatches[0].rm_so + 1;
+#endif
 		/* Finally, put the subexpression matches in global
 		 * variable regmatches.  The REG_NOTBOL flag doesn't
 		 * matter now. */
-		regexec(&search_regexp, retval, 10, regmatches, 0);
+		regexec(search_regexp, retval, 10, regmatches, 0);
 		return retval;
 	    }
 	} else
 #endif /* !NANO_TINY */
-	if (regexec(&search_regexp, start, 10, regmatches,
+	if (regexec(search_regexp, start, 10, regmatches,
 		(start > haystack) ? REG_NOTBOL : 0) == 0) {
 	    const char *retval = start + regmatches[0].rm_so;
 
-	    regexec(&search_regexp, retval, 10, regmatches, 0);
+	    regexec(search_regexp, retval, 10, regmatches, 0);
 	    return retval;
 	}
 	return NULL;
@@ -542,11 +731,21 @@ void new_magicline(void)
     openfile->filebot->next->prev = openfile->filebot;
     openfile->filebot->next->next = NULL;
     openfile->filebot->next->lineno = openfile->filebot->lineno + 1;
+#ifndef NANO_TINY
+    openfile->filebot->next->handle = NULL;
+    openfile->filebot->next->sharers = NULL;
+    openfile->filebot->next->len_stamp = 0;
+#endif
 #ifdef ENABLE_COLOR
-    openfile->filebot->next->multidata = NULL;
+    memset(openfile->filebot->next->multidata, -1,
+	sizeof(openfile->filebot->next->multidata));
+    openfile->filebot->next->multimore = NULL;
 #endif
     openfile->filebot = openfile->filebot->next;
     openfile->totsize++;
+#ifndef NANO_TINY
+    mark_changed(openfile->filebot, openfile->filebot);
+#endif
 }
 
 #ifndef NANO_TINY
@@ -559,6 +758,7 @@ void remove_magicline(void)
 	openfile->filebot != openfile->fileage) {
 	assert(openfile->filebot != openfile->edittop && openfile->filebot != openfile->current);
 
+	mark_changed(openfile->filebot, openfile->filebot);
 	openfile->filebot = openfile->filebot->prev;
 	free_filestruct(openfile->filebot->next);
 	openfile->filebot->next = NULL;
@@ -598,15 +798,15 @@ void mark_order(const filestruct **top, size_t *top_x, const filestruct
 
 /* Calculate the number of characters between begin and end, and return
  * it. */
-size_t get_totsize(const filestruct *begin, const filestruct *end)
+size_t get_totsize(filestruct *begin, const filestruct *end)
 {
     size_t totsize = 0;
-    const filestruct *f;
+    filestruct *f;
 
     /* Go through the lines from begin to end->prev, if we can. */
     for (f = begin; f != end && f != NULL; f = f->next) {
 	/* Count the number of characters on this line. */
-	totsize += mbstrlen(f->data);
+	totsize += line_chars(f);
 
 	/* Count the newline if we have one. */
 	if (f->next != NULL)
@@ -616,7 +816,7 @@ size_t get_totsize(const filestruct *begin, const filestruct *end)
     /* Go through the line at end, if we can. */
     if (f != NULL) {
 	/* Count the number of characters on this line. */
-	totsize += mbstrlen(f->data);
+	totsize += line_chars(f);
 
 	/* Count the newline if we have one. */
 	if (f->next != NULL)
@@ -40,6 +40,20 @@ static int statusblank = 0;
 static bool disable_cursorpos = FALSE;
 	/* Should we temporarily disable constant cursor position
 	 * display? */
+#ifndef NANO_TINY
+static char *hl_needle = NULL;
+	/* The search string whose matches are highlighted, if any. */
+static bool hl_case_sensitive = FALSE;
+	/* Is the highlighted search case sensitive? */
+#ifdef HAVE_REGEX_H
+static regex_t *hl_regexp = NULL;
+	/* The compiled form of hl_needle, if it's a regex. */
+#endif
+static const openfilestruct *hl_file = NULL;
+	/* The buffer that hl_cache is about. */
+static linematches hl_cache[MATCH_CACHE_SIZE];
+	/* The matches in the lines we've drawn lately. */
+#endif
 
 /* Control character compatibility:
  *
@@ -125,7 +139,23 @@ void get_key_buffer(WINDOW *win)
     if (nodelay_mode) {
 	if ((input =  wgetch(win)) == ERR)
            return;
-    } else
+    } else {
+#ifndef NANO_TINY
+	input = ERR;
+
+	/* If a journal is behind, wait a moment for the first
+	 * character, and bring the journals up to date if none comes
+	 * before going on to wait for as long as it takes. */
+	if (journals_pending()) {
+	    wtimeout(win, JOURNAL_DELAY);
+	    input = wgetch(win);
+	    nodelay(win, FALSE);
+	    if (input == ERR)
+		flush_journals();
+	}
+
+	if (input == ERR)
+#endif
 	while ((input = wgetch(win)) == ERR) {
 	    errcount++;
 
@@ -137,6 +167,7 @@ void get_key_buffer(WINDOW *win)
 	    if (errcount == MAX_BUF_SIZE)
 		handle_hupterm(0);
 	}
+    }
 
 #ifndef NANO_TINY
     allow_pending_sigwinch(FALSE);
@@ -2113,6 +2144,11 @@ void titlebar(const char *path)
 
     assert(path != NULL || openfile->filename != NULL);
 
+    /* There's no screen when we're replacing in files from the command
+     * line. */
+    if (topwin == NULL)
+	return;
+
     wattron(topwin, reverse_attr);
 
     blank_titlebar();
@@ -2252,9 +2288,14 @@ void titlebar(const char *path)
 }
 
 /* Mark the current file as modified if it isn't already, and then
- * update the titlebar to display the file's new status. */
+ * update the titlebar to display the file's new status.  Since the text
+ * has changed, also bump its version. */
 void set_modified(void)
 {
+#ifndef NANO_TINY
+    openfile->version++;
+#endif
+
     if (!openfile->modified) {
 	openfile->modified = TRUE;
 	titlebar(NULL);
@@ -2275,6 +2316,13 @@ void statusbar(const char *msg, ...)
 
     va_start(ap, msg);
 
+    /* There's no screen when we're replacing in files from the command
+     * line, so there's nowhere to say anything. */
+    if (bottomwin == NULL) {
+	va_end(ap);
+	return;
+    }
+
     /* Curses mode is turned off.  If we use wmove() now, it will muck
      * up the terminal settings.  So we just use vfprintf(). */
     if (isendwin()) {
@@ -2455,6 +2503,146 @@ void reset_cursor(void)
     }
 }
 
+#ifndef NANO_TINY
+/* Set up highlighting of all the matches of needle on the screen, with
+ * the current search options, or turn it off if needle is NULL.  Return
+ * TRUE if what should be highlighted has changed, in which case the
+ * edit window has to be redrawn. */
+bool set_match_highlight(const char *needle)
+{
+    size_t i;
+
+    if (needle != NULL && hl_needle != NULL && strcmp(needle,
+	hl_needle) == 0 && hl_case_sensitive == ISSET(CASE_SENSITIVE)
+#ifdef HAVE_REGEX_H
+	&& (hl_regexp != NULL) == ISSET(USE_REGEXP)
+#endif
+	)
+	return FALSE;
+
+    if (needle == NULL && hl_needle == NULL)
+	return FALSE;
+
+#ifdef HAVE_REGEX_H
+    if (hl_regexp != NULL) {
+	regexp_cache_release(hl_regexp);
+	hl_regexp = NULL;
+    }
+#endif
+
+    /* Whatever we remembered is of no use anymore. */
+    for (i = 0; i < MATCH_CACHE_SIZE; i++) {
+	free(hl_cache[i].spans);
+	hl_cache[i].line = NULL;
+	hl_cache[i].spans = NULL;
+	hl_cache[i].count = 0;
+	hl_cache[i].size = 0;
+    }
+
+    if (needle == NULL) {
+	free(hl_needle);
+	hl_needle = NULL;
+	return TRUE;
+    }
+
+#ifdef HAVE_REGEX_H
+    if (ISSET(USE_REGEXP)) {
+	hl_regexp = regexp_cache_get(needle, REG_EXTENDED |
+		(ISSET(CASE_SENSITIVE) ? 0 : REG_ICASE), NULL);
+	if (hl_regexp == NULL) {
+	    free(hl_needle);
+	    hl_needle = NULL;
+	    return TRUE;
+	}
+    }
+#endif
+
+    hl_needle = mallocstrcpy(hl_needle, needle);
+    hl_case_sensitive = ISSET(CASE_SENSITIVE);
+
+    return TRUE;
+}
+
+/* Return the matches of the highlighted search string in fileptr.  They
+ * are only looked for again when the buffer has been changed since we
+ * last saw the line. */
+static const linematches *line_matches(const filestruct *fileptr)
+{
+    linematches *lm = &hl_cache[((unsigned long)fileptr /
+	sizeof(filestruct)) % MATCH_CACHE_SIZE];
+    const char *text = fileptr->data;
+    size_t k = 0;
+
+    assert(hl_needle != NULL);
+
+    /* Different buffers may have reached the same version. */
+    if (hl_file != openfile) {
+	size_t i;
+
+	for (i = 0; i < MATCH_CACHE_SIZE; i++)
+	    hl_cache[i].line = NULL;
+	hl_file = openfile;
+    }
+
+    if (lm->line == fileptr && lm->version == openfile->version)
+	return lm;
+
+    lm->line = fileptr;
+    lm->version = openfile->version;
+    lm->count = 0;
+
+    while (TRUE) {
+	const char *found;
+	size_t found_len;
+
+#ifdef HAVE_REGEX_H
+	if (hl_regexp != NULL) {
+	    regmatch_t match;
+
+	    if (regexec(hl_regexp, text + k, 1, &match, (k == 0) ?
+		0 : REG_NOTBOL) != 0)
+		break;
+
+	    found = text + k + match.rm_so;
+	    found_len = match.rm_eo - match.rm_so;
+	} else
+#endif
+	{
+	    found = hl_case_sensitive ? strstr(text + k, hl_needle) :
+		mbstrcasestr(text + k, hl_needle);
+	    if (found == NULL)
+		break;
+
+	    found_len = strlen(hl_needle);
+	}
+
+	k = found - text;
+
+	/* Skip over a zero-length match; there's nothing to paint. */
+	if (found_len == 0) {
+	    if (text[k] == '\0')
+		break;
+	    k = move_mbright(text, k);
+	    continue;
+	}
+
+	if (lm->count == lm->size) {
+	    lm->size = (lm->size == 0) ? 8 : lm->size * 2;
+	    lm->spans = (size_t *)nrealloc(lm->spans, 2 * lm->size *
+		sizeof(size_t));
+	}
+
+	lm->spans[2 * lm->count] = k;
+	lm->spans[2 * lm->count + 1] = k + found_len;
+	lm->count++;
+
+	k += found_len;
+    }
+
+    return lm;
+}
+#endif /* !NANO_TINY */
+
 /* edit_draw() takes care of the job of actually painting a line into
  * the edit window.  fileptr is the line to be painted, at row line of
  * the window.  converted is the actual string to be written to the
@@ -2491,14 +2679,6 @@ void edit_draw(filestruct *fileptr, const char *converted, int
     if (openfile->colorstrings != NULL && !ISSET(NO_COLOR_SYNTAX)) {
 	const colortype *tmpcolor = openfile->colorstrings;
 
-	/* Set up multi-line color data for this line if it's not yet calculated  */
-        if (fileptr->multidata == NULL && openfile->syntax
-		&& openfile->syntax->nmultis > 0) {
- 	    int i;
-	    fileptr->multidata = (short *) nmalloc(openfile->syntax->nmultis * sizeof(short));
-            for (i = 0; i < openfile->syntax->nmultis; i++)
-		fileptr->multidata[i] = -1;	/* Assue this applies until we know otherwise */
-	}
 	for (; tmpcolor != NULL; tmpcolor = tmpcolor->next) {
 	    int x_start;
 		/* Starting column for mvwaddnstr.  Zero-based. */
@@ -2564,7 +2744,7 @@ void edit_draw(filestruct *fileptr, const char *converted, int
 		    }
 		    k = startmatch.rm_eo;
 		}
-	    } else if (fileptr->multidata != NULL && fileptr->multidata[tmpcolor->id] != CNONE) {
+	    } else if (*multidata_for(fileptr, tmpcolor->id) != CNONE) {
 		/* This is a multi-line regex.  There are two steps.
 		 * First, we have to see if the beginning of the line is
 		 * colored by a start on an earlier line, and an end on
@@ -2581,10 +2761,10 @@ void edit_draw(filestruct *fileptr, const char *converted, int
 		regoff_t start_col;
 		    /* Where it starts in that line. */
 		const filestruct *end_line;
-		short md = fileptr->multidata[tmpcolor->id];
+		short md = *multidata_for(fileptr, tmpcolor->id);
 
 		if (md == -1)
-		    fileptr->multidata[tmpcolor->id] = CNONE; /* until we find out otherwise */
+		    *multidata_for(fileptr, tmpcolor->id) = CNONE; /* until we find out otherwise */
 		else if (md == CNONE)
 		    continue;
 		else if (md == CWHOLELINE) {
@@ -2662,12 +2842,12 @@ void edit_draw(filestruct *fileptr, const char *converted, int
 		     * page. */
 		    if (end_line != fileptr) {
 			paintlen = -1;
-			fileptr->multidata[tmpcolor->id] = CWHOLELINE;
+			*multidata_for(fileptr, tmpcolor->id) = CWHOLELINE;
 		    } else {
 			paintlen = actual_x(converted,
 				strnlenpt(fileptr->data,
 				endmatch.rm_eo) - start);
-			fileptr->multidata[tmpcolor->id] = CBEGINBEFORE;
+			*multidata_for(fileptr, tmpcolor->id) = CBEGINBEFORE;
 		    }
 		    mvwaddnstr(edit, line, 0, converted, paintlen);
   step_two:
@@ -2715,7 +2895,7 @@ void edit_draw(filestruct *fileptr, const char *converted, int
 				mvwaddnstr(edit, line, x_start,
 					converted + index, paintlen);
 				if (paintlen > 0)
-				    fileptr->multidata[tmpcolor->id] = CSTARTENDHERE;
+				    *multidata_for(fileptr, tmpcolor->id) = CSTARTENDHERE;
 
 			    }
 			} else {
@@ -2737,7 +2917,7 @@ void edit_draw(filestruct *fileptr, const char *converted, int
 				/* We painted to the end of the line, so
 				 * don't bother checking any more
 				 * starts. */
-				fileptr->multidata[tmpcolor->id] = CENDAFTER;
+				*multidata_for(fileptr, tmpcolor->id) = CENDAFTER;
 				break;
 			    }
 			}
@@ -2753,6 +2933,37 @@ void edit_draw(filestruct *fileptr, const char *converted, int
 #endif /* ENABLE_COLOR */
 
 #ifndef NANO_TINY
+    /* If the matches of the last search are to be shown, paint the
+     * ones that are on this page. */
+    if (hl_needle != NULL) {
+	const linematches *lm = line_matches(fileptr);
+	size_t i;
+
+	wattron(edit, reverse_attr);
+	for (i = 0; i < lm->count; i++) {
+	    size_t match_start = lm->spans[2 * i];
+	    size_t match_end = lm->spans[2 * i + 1];
+	    int x_start, paintlen;
+	    size_t index;
+
+	    if (match_end <= startpos)
+		continue;
+	    if (match_start >= endpos)
+		break;
+
+	    x_start = (match_start <= startpos) ? 0 :
+		strnlenpt(fileptr->data, match_start) - start;
+
+	    index = actual_x(converted, x_start);
+
+	    paintlen = actual_x(converted + index,
+		strnlenpt(fileptr->data, match_end) - start - x_start);
+
+	    mvwaddnstr(edit, line, x_start, converted + index, paintlen);
+	}
+	wattroff(edit, reverse_attr);
+    }
+
     /* If the mark is on, we need to display it. */
     if (openfile->mark_set && (fileptr->lineno <=
 	openfile->mark_begin->lineno || fileptr->lineno <=
@@ -2824,6 +3035,54 @@ void edit_draw(filestruct *fileptr, const char *converted, int
 #endif /* !NANO_TINY */
 }
 
+#ifndef NANO_TINY
+/* Return what display_string() would for the line with a gap at the
+ * cursor whose text before the gap is head and after it is tail,
+ * starting at start_col, without putting the whole line together.  Set
+ * more to whether the line goes on past the right edge of the
+ * screen. */
+static char *display_gap_string(const char *head, const char *tail, size_t
+	start_col, bool *more)
+{
+    size_t start_index = actual_x(head, start_col);
+	/* Index in head of the first character shown. */
+    size_t column = strnlenpt(head, start_index);
+	/* Screen column that start_index corresponds to. */
+    size_t pad = column % tabsize;
+	/* Spaces before the shown text that keep its tabs in place. */
+    size_t head_len = strlen(head + start_index);
+    size_t tail_len = strlen(tail), take = COLS + 1;
+    size_t end_col = pad + start_col - column + COLS;
+	/* Where the right edge of the screen is in the shown text. */
+    char *shown = NULL, *converted;
+
+    /* Take more and more of the text after the gap, until it reaches
+     * past the right edge of the screen or runs out. */
+    while (TRUE) {
+	if (take > tail_len)
+	    take = tail_len;
+
+	shown = charealloc(shown, pad + head_len + take + 1);
+	memset(shown, ' ', pad);
+	strncpy(shown + pad, head + start_index, head_len);
+	strncpy(shown + pad + head_len, tail, take);
+	shown[pad + head_len + take] = '\0';
+
+	*more = (strlenpt(shown) > end_col);
+
+	if (*more || take == tail_len)
+	    break;
+
+	take *= 2;
+    }
+
+    converted = display_string(shown, end_col - COLS, COLS, TRUE);
+    free(shown);
+
+    return converted;
+}
+#endif
+
 /* Just update one line in the edit buffer.  This is basically a wrapper
  * for edit_draw().  The line will be displayed starting with
  * fileptr->data[index].  Likely arguments are current_x or zero.
@@ -2839,6 +3098,12 @@ int update_line(filestruct *fileptr, size_t index)
 	 * expanded. */
     size_t page_start;
     filestruct *tmp;
+#ifndef NANO_TINY
+    const char *tail = gap_tail(fileptr);
+	/* The text after the gap at the cursor, if the line has one. */
+    bool more = FALSE;
+	/* Whether the line with the gap goes on past the screen. */
+#endif
 
     assert(fileptr != NULL);
 
@@ -2865,7 +3130,14 @@ int update_line(filestruct *fileptr, size_t index)
 
     /* Expand the line, replacing tabs with spaces, and control
      * characters with their displayed forms. */
-    converted = display_string(fileptr->data, page_start, COLS, !ISSET(SOFTWRAP));
+#ifndef NANO_TINY
+    if (tail != NULL)
+	converted = display_gap_string(fileptr->data, tail, page_start,
+		&more);
+    else
+#endif
+	converted = display_string(fileptr->data, page_start, COLS,
+		!ISSET(SOFTWRAP));
 
 #ifdef DEBUG
     if (ISSET(SOFTWRAP) && strlen(converted) >= COLS - 2)
@@ -2880,7 +3152,12 @@ int update_line(filestruct *fileptr, size_t index)
     if (!ISSET(SOFTWRAP)) {
 	if (page_start > 0)
 	    mvwaddch(edit, line, 0, '$');
+#ifndef NANO_TINY
+	if (tail != NULL ? more : strlenpt(fileptr->data) > page_start +
+		COLS)
+#else
 	if (strlenpt(fileptr->data) > page_start + COLS)
+#endif
 	    mvwaddch(edit, line, COLS - 1, '$');
     } else {
         int full_length = strlenpt(fileptr->data);
@@ -3325,22 +3602,20 @@ void display_main_list(void)
 void do_cursorpos(bool constant)
 {
     filestruct *f;
-    char c;
     size_t i, cur_xpt = xplustabs() + 1;
     size_t cur_lenpt = strlenpt(openfile->current->data) + 1;
     int linepct, colpct, charpct;
 
     assert(openfile->fileage != NULL && openfile->current != NULL);
 
+    /* Count up to the cursor without writing into the current line,
+     * since its text may be shared with the cutbuffer. */
     f = openfile->current->next;
-    c = openfile->current->data[openfile->current_x];
-
     openfile->current->next = NULL;
-    openfile->current->data[openfile->current_x] = '\0';
 
-    i = get_totsize(openfile->fileage, openfile->current);
+    i = get_totsize(openfile->fileage, openfile->current) -
+	mbstrlen(openfile->current->data + openfile->current_x);
 
-    openfile->current->data[openfile->current_x] = c;
     openfile->current->next = f;
 
     if (constant && disable_cursorpos) {
@@ -3356,6 +3631,19 @@ void do_cursorpos(bool constant)
     charpct = (openfile->totsize == 0) ? 0 : 100 * i /
 	openfile->totsize;
 
+#ifndef NANO_TINY
+    /* With undo on, also show how much memory its items take up, in
+     * the kilobytes that the undo budget is given in. */
+    if (ISSET(UNDOABLE))
+	statusbar(
+	    _("line %ld/%ld (%d%%), col %lu/%lu (%d%%), char %lu/%lu (%d%%), undo %luK"),
+	    (long)openfile->current->lineno,
+	    (long)openfile->filebot->lineno, linepct,
+	    (unsigned long)cur_xpt, (unsigned long)cur_lenpt, colpct,
+	    (unsigned long)i, (unsigned long)openfile->totsize, charpct,
+	    (unsigned long)((openfile->undo_size + 1023) / 1024));
+    else
+#endif
     statusbar(
 	_("line %ld/%ld (%d%%), col %lu/%lu (%d%%), char %lu/%lu (%d%%)"),
 	(long)openfile->current->lineno,